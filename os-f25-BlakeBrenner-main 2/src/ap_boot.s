@@ -0,0 +1,77 @@
+; ap_boot.s - Application processor trampoline
+;
+; smp_init() copies everything between ap_trampoline and ap_trampoline_end
+; to SMP_TRAMPOLINE (0x8000) and points the SIPI at it. An AP starts here in
+; real mode at 0800:0000, switches to protected mode with a flat GDT, turns
+; on paging with the kernel's CR3/CR4, loads its stack and calls
+; ap_entry(cpu). The ap_* parameters are patched in the copy before each
+; AP is started.
+
+TRAMPOLINE_BASE equ 0x8000
+%define TRAMP(x) ((x) - ap_trampoline + TRAMPOLINE_BASE)
+
+section .text
+    global ap_trampoline
+    global ap_trampoline_end
+    global ap_param_cr3
+    global ap_param_cr4
+    global ap_param_stack
+    global ap_param_entry
+    global ap_param_cpu
+
+    [BITS 16]
+ap_trampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    lgdt [TRAMP(ap_gdt_desc)]
+    mov eax, cr0
+    or eax, 1                       ; CR0.PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMP(ap_protected)
+
+    [BITS 32]
+ap_protected:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov ss, ax
+
+    ; Same paging setup as the BSP: PSE first, since the directory may
+    ; hold 4 MiB pages
+    mov eax, [TRAMP(ap_param_cr4)]
+    mov cr4, eax
+    mov eax, [TRAMP(ap_param_cr3)]
+    mov cr3, eax
+    mov eax, cr0
+    or eax, 0x80000001              ; CR0.PE | CR0.PG
+    mov cr0, eax
+
+    mov esp, [TRAMP(ap_param_stack)]
+    push dword [TRAMP(ap_param_cpu)]
+    mov eax, [TRAMP(ap_param_entry)]
+    call eax
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+    align 8
+ap_gdt:
+    dq 0                            ; null
+    dq 0x00CF9A000000FFFF           ; 0x08: flat code
+    dq 0x00CF92000000FFFF           ; 0x10: flat data
+ap_gdt_desc:
+    dw ap_gdt_desc - ap_gdt - 1
+    dd TRAMP(ap_gdt)
+
+    align 4
+ap_param_cr3:   dd 0
+ap_param_cr4:   dd 0
+ap_param_stack: dd 0
+ap_param_entry: dd 0
+ap_param_cpu:   dd 0
+ap_trampoline_end:
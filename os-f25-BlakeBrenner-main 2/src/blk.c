@@ -0,0 +1,386 @@
+#include "blk.h"
+#include "sched.h"
+#include "vm.h"
+
+/* All of this is only touched by threads on the BSP, with preemption
+   disabled */
+static struct blk_buf bufs[BLK_CACHE_SECTORS];
+static struct blk_buf *buckets[BLK_HASH_BUCKETS];
+static struct blk_buf lru;           // sentinel: lru.next is the most recent
+static uint32_t ndirty;
+static uint32_t release_gen;         // bumped whenever a buffer may have become reusable
+static uint32_t sync_requested, sync_done;
+static int sync_status;
+static struct blk_stats stats;
+
+static struct wait_queue wb_wait = WAIT_QUEUE_INIT;     // the writeback thread
+static struct wait_queue room_wait = WAIT_QUEUE_INIT;   // no clean buffer, or dirty quota
+static struct wait_queue io_wait = WAIT_QUEUE_INIT;     // BLK_BUSY buffers
+static struct wait_queue sync_wait = WAIT_QUEUE_INIT;   // blk_sync() callers
+
+static int ready;
+static struct blk_buf *batch[BLK_CACHE_SECTORS];
+
+static inline uint32_t hash(uint32_t lba) {
+    return lba & (BLK_HASH_BUCKETS - 1);   // neighbours land in different buckets
+}
+
+static void copy_sector(void *dst, const void *src) {
+    uint32_t n = SECTOR_SIZE / 4;
+    __asm__ __volatile__("cld; rep movsl" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static struct blk_buf *lookup(uint32_t lba) {
+    for (struct blk_buf *b = buckets[hash(lba)]; b; b = b->hnext)
+        if (b->lba == lba)
+            return b;
+    return 0;
+}
+
+static void hash_insert(struct blk_buf *b) {
+    b->hnext = buckets[hash(b->lba)];
+    buckets[hash(b->lba)] = b;
+}
+
+static void hash_remove(struct blk_buf *b) {
+    struct blk_buf **pp = &buckets[hash(b->lba)];
+    while (*pp != b)
+        pp = &(*pp)->hnext;
+    *pp = b->hnext;
+}
+
+static void lru_touch(struct blk_buf *b) {
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+    b->next = lru.next;
+    b->prev = &lru;
+    lru.next->prev = b;
+    lru.next = b;
+}
+
+/* Coldest buffer nobody holds that is clean, or NULL. Busy buffers are
+   always held. */
+static struct blk_buf *victim(void) {
+    for (struct blk_buf *b = lru.prev; b != &lru; b = b->prev)
+        if (!b->refs && !(b->flags & BLK_DIRTY))
+            return b;
+    return 0;
+}
+
+/* Rebind v to lba, held and BLK_BUSY. A buffer is hashed exactly while
+   it is valid or busy. */
+static struct blk_buf *claim(struct blk_buf *v, uint32_t lba) {
+    if (v->flags & BLK_VALID) {
+        hash_remove(v);
+        stats.evictions++;
+    }
+    v->lba = lba;
+    v->flags = BLK_BUSY;
+    v->refs = 1;
+    hash_insert(v);
+    lru_touch(v);
+    stats.misses++;
+    return v;
+}
+
+/* Held buffer for lba. On a hit it is valid; on a miss it comes back
+   BLK_BUSY without data and the caller fills it, then calls filled(). */
+static struct blk_buf *bget(uint32_t lba) {
+    for (;;) {
+        preempt_disable();
+        struct blk_buf *b = lookup(lba);
+        if (b && (b->flags & BLK_BUSY)) {
+            preempt_enable();
+            wait_event(&io_wait, !(b->flags & BLK_BUSY) || b->lba != lba);
+            continue;
+        }
+        if (b) {
+            b->refs++;
+            lru_touch(b);
+            stats.hits++;
+            preempt_enable();
+            return b;
+        }
+
+        struct blk_buf *v = victim();
+        if (v) {
+            claim(v, lba);
+            preempt_enable();
+            return v;
+        }
+        // Everything is held or dirty: let the writeback thread clean some
+        uint32_t gen = release_gen;
+        stats.stalls++;
+        preempt_enable();
+        wake_up(&wb_wait);
+        wait_event(&room_wait, release_gen != gen);
+    }
+}
+
+/* A miss for lba that can be claimed without waiting, or NULL */
+static struct blk_buf *try_claim(uint32_t lba) {
+    preempt_disable();
+    struct blk_buf *v = lookup(lba) ? 0 : victim();
+    if (v)
+        claim(v, lba);
+    preempt_enable();
+    return v;
+}
+
+/* End of a fill: publish the data, or forget the buffer after an error */
+static void filled(struct blk_buf *b, int err) {
+    preempt_disable();
+    if (err) {
+        hash_remove(b);
+        b->flags = 0;
+    } else {
+        b->flags = BLK_VALID;
+    }
+    preempt_enable();
+    wake_up(&io_wait);
+}
+
+struct blk_buf *blk_get(uint32_t lba) {
+    if (!ready)
+        return 0;
+    struct blk_buf *b = bget(lba);
+    if (b->flags & BLK_BUSY) {
+        int err = disk_read(lba, b->data, 1);
+        filled(b, err);
+        if (err) {
+            blk_put(b);
+            return 0;
+        }
+    }
+    return b;
+}
+
+void blk_put(struct blk_buf *b) {
+    preempt_disable();
+    int last = --b->refs == 0;
+    if (last)
+        release_gen++;
+    preempt_enable();
+    if (last)
+        wake_up(&room_wait);
+}
+
+void blk_dirty(struct blk_buf *b) {
+    int wake = 0;
+    preempt_disable();
+    if (b->flags & BLK_DIRTY) {
+        stats.absorbed++;
+    } else {
+        b->flags |= BLK_DIRTY;
+        ndirty++;
+        wake = ndirty == 1 || ndirty == BLK_DIRTY_HIGH;
+    }
+    preempt_enable();
+    if (wake)
+        wake_up(&wb_wait);
+}
+
+/* One pass: write out what is dirty now, flush the drive cache, then let
+   the buffers go. They stay held (and findable) while being written.
+   Every buffer is its own request, straight from the cache frames; the
+   ATA driver's elevator sorts the batch and merges adjacent sectors into
+   single commands, and virtio-blk hands it to the host with one notify.
+   Returns 0 or -1. */
+static int writeback(void) {
+    preempt_disable();
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < BLK_CACHE_SECTORS; i++)
+        if (bufs[i].flags & BLK_DIRTY) {
+            bufs[i].flags &= ~BLK_DIRTY;
+            bufs[i].refs++;
+            batch[n++] = &bufs[i];
+        }
+    ndirty = 0;
+    preempt_enable();
+
+    stats.batches++;
+    disk_plug();
+    for (uint32_t i = 0; i < n; i++) {
+        struct ata_request *r = &batch[i]->io;
+        r->op = ATA_WRITE;
+        r->lba = batch[i]->lba;
+        r->count = 1;
+        r->buf = batch[i]->data;
+        r->callback = 0;
+        disk_submit(r);
+    }
+    disk_unplug();
+
+    // A writer may change a buffer while it is on its way out; it marks
+    // the buffer dirty again, so the next pass writes the final contents
+    int status = 0;
+    for (uint32_t i = 0; i < n; i++)
+        if (disk_wait(&batch[i]->io)) {
+            stats.errors++;
+            status = -1;
+            preempt_disable();
+            if (!(batch[i]->flags & BLK_DIRTY)) {
+                batch[i]->flags |= BLK_DIRTY;   // retried next pass
+                ndirty++;
+            }
+            preempt_enable();
+        }
+
+    if (disk_flush()) {
+        stats.errors++;
+        status = -1;
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+        blk_put(batch[i]);
+    wake_up(&room_wait);   // dirty quota
+    return status;
+}
+
+static void writeback_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        wait_event(&wb_wait, ndirty || sync_requested != sync_done);
+        // Give further writes a chance to join this batch
+        if (sync_requested == sync_done)
+            wait_event_timeout(&wb_wait, ndirty >= BLK_DIRTY_HIGH ||
+                               sync_requested != sync_done, BLK_WB_INTERVAL);
+
+        // Everything written before these blk_sync() calls is dirty now
+        uint32_t gen = sync_requested;
+        int status = writeback();
+        sync_status = status;
+        sync_done = gen;
+        wake_up(&sync_wait);
+    }
+}
+
+int blk_init(void) {
+    if (!disk_get())
+        return -1;
+    uint8_t *frames = vm_reserve(BLK_CACHE_SECTORS * SECTOR_SIZE, VM_WRITE | VM_POPULATE, "bcache");
+    if (!frames)
+        return -1;
+
+    lru.next = lru.prev = &lru;
+    for (uint32_t i = 0; i < BLK_CACHE_SECTORS; i++) {
+        struct blk_buf *b = &bufs[i];
+        b->data = frames + i * SECTOR_SIZE;
+        b->next = lru.next;
+        b->prev = &lru;
+        lru.next->prev = b;
+        lru.next = b;
+    }
+    if (!thread_create("writeback", writeback_main, 0))
+        return -1;
+    ready = 1;
+    return 0;
+}
+
+int blk_read(uint32_t lba, void *buf, uint32_t n) {
+    uint8_t *dst = buf;
+    struct blk_buf *run[BLK_READ_RUN];
+    if (!ready)
+        return disk_read(lba, dst, n);
+
+    for (uint32_t i = 0; i < n; ) {
+        struct blk_buf *b = bget(lba + i);
+        if (!(b->flags & BLK_BUSY)) {
+            copy_sector(dst + i * SECTOR_SIZE, b->data);
+            blk_put(b);
+            i++;
+            continue;
+        }
+
+        // Claim the misses that follow too and fetch them with one command
+        // straight into the caller's buffer, then copy them into the cache
+        uint32_t k = 1;
+        run[0] = b;
+        while (i + k < n && k < BLK_READ_RUN && (b = try_claim(lba + i + k)))
+            run[k++] = b;
+        int err = disk_read(lba + i, dst + i * SECTOR_SIZE, k);
+        for (uint32_t j = 0; j < k; j++) {
+            if (!err)
+                copy_sector(run[j]->data, dst + (i + j) * SECTOR_SIZE);
+            filled(run[j], err);
+            blk_put(run[j]);
+        }
+        if (err)
+            return -1;
+        i += k;
+    }
+    return 0;
+}
+
+int blk_write(uint32_t lba, const void *buf, uint32_t n) {
+    const uint8_t *src = buf;
+    if (!ready)
+        return -1;
+
+    for (uint32_t i = 0; i < n; i++) {
+        if (ndirty >= BLK_DIRTY_MAX) {
+            stats.stalls++;
+            wake_up(&wb_wait);
+            wait_event(&room_wait, ndirty < BLK_DIRTY_MAX);
+        }
+        // A whole-sector write needs no read on a miss
+        struct blk_buf *b = bget(lba + i);
+        copy_sector(b->data, src + i * SECTOR_SIZE);
+        if (b->flags & BLK_BUSY)
+            filled(b, 0);
+        blk_dirty(b);
+        blk_put(b);
+        stats.written++;
+    }
+    return 0;
+}
+
+/* Bottom half (or the submitter, if the request was refused) */
+static void readahead_done(struct ata_request *r) {
+    struct blk_buf *b = r->priv;
+    filled(b, r->status);
+    blk_put(b);
+}
+
+void blk_readahead(uint32_t lba, uint32_t n) {
+    if (!ready)
+        return;
+    disk_plug();
+    for (uint32_t i = 0; i < n; i++) {
+        struct blk_buf *b = try_claim(lba + i);
+        if (!b) {
+            preempt_disable();
+            int cached = lookup(lba + i) != 0;
+            preempt_enable();
+            if (cached)
+                continue;
+            break;   // no clean buffer left to fill
+        }
+        struct ata_request *r = &b->io;
+        r->op = ATA_READ;
+        r->lba = b->lba;
+        r->count = 1;
+        r->buf = b->data;
+        r->callback = readahead_done;
+        r->priv = b;
+        stats.readahead++;
+        disk_submit(r);
+    }
+    disk_unplug();
+}
+
+int blk_sync(void) {
+    if (!ready)
+        return disk_flush();
+    uint32_t gen = ++sync_requested;
+    wake_up(&wb_wait);
+    wait_event(&sync_wait, (int32_t)(sync_done - gen) >= 0);
+    return sync_status;
+}
+
+void blk_get_stats(struct blk_stats *out) {
+    preempt_disable();
+    *out = stats;
+    out->dirty = ndirty;
+    preempt_enable();
+}
@@ -0,0 +1,86 @@
+#ifndef BLK_H
+#define BLK_H
+
+#include <stdint.h>
+#include "disk.h"
+
+/* Block layer over the disk (disk.h: virtio-blk or the ATA driver): a
+   buffer cache of single sectors with write-back.
+
+   Buffers live in BLK_CACHE_SECTORS slots carved out of frames from the
+   page allocator (one VM_POPULATE region, so the drive can DMA straight
+   into them). They are found through a hash on the LBA and recycled
+   least-recently-used first; a buffer is only reused when nobody holds
+   it and it is clean.
+
+   blk_write() and blk_dirty() only mark buffers dirty. The "writeback"
+   thread wakes on the first dirty buffer and waits BLK_WB_INTERVAL to let
+   more writes collect (or less, once BLK_DIRTY_HIGH are dirty). Then it
+   queues every dirty buffer at once under one plug, so the ATA elevator
+   can sort them and merge adjacent sectors into one command (or virtio
+   gets the batch with one notify), and ends the batch with a cache
+   flush. Rewriting a sector that is still dirty costs no disk
+   I/O at all. Writers only wait when BLK_DIRTY_MAX buffers are dirty.
+   blk_sync() is the barrier: it returns once everything written before
+   the call is on the media. */
+
+#define BLK_CACHE_SECTORS 1024              /* 512 KiB, 128 frames */
+#define BLK_HASH_BUCKETS  256               /* power of two */
+#define BLK_DIRTY_HIGH    128               /* dirty buffers that cut the wait short */
+#define BLK_DIRTY_MAX     512               /* dirty buffers before writers wait */
+#define BLK_READ_RUN      128               /* sectors per read command on a miss */
+#define BLK_WB_INTERVAL   (2 * TIMER_HZ)    /* how long dirty data may wait */
+
+/* blk_buf.flags */
+#define BLK_VALID   0x01    /* data holds the sector */
+#define BLK_DIRTY   0x02    /* data is newer than the disk */
+#define BLK_BUSY    0x04    /* being filled; lookups wait */
+
+struct blk_buf {
+    struct blk_buf *hnext;           // hash chain
+    struct blk_buf *prev, *next;     // LRU list, most recently used first
+    uint32_t lba;
+    uint32_t refs;                   // holders; a held buffer is never reused
+    uint32_t flags;
+    uint8_t *data;                   // SECTOR_SIZE bytes
+    struct ata_request io;           // readahead and writeback of this buffer
+};
+
+struct blk_stats {
+    uint32_t hits;          // sectors found in the cache
+    uint32_t misses;        // sectors that needed a buffer
+    uint32_t evictions;     // valid buffers recycled for another LBA
+    uint32_t readahead;     // sectors queued by blk_readahead()
+    uint32_t written;       // sectors passed to blk_write()
+    uint32_t absorbed;      // of those, rewrites of a sector still dirty
+    uint32_t batches;       // writeback passes
+    uint32_t stalls;        // waits for a clean buffer or dirty quota
+    uint32_t errors;        // failed write or flush commands
+    uint32_t dirty;         // buffers dirty right now
+};
+
+/* Set up the cache and start the writeback thread; call after
+   sched_init(). Returns -1 without a disk. */
+int blk_init(void);
+
+/* Hold the buffer for lba, reading it on a miss; NULL on a read error.
+   Modify b->data only between blk_get() and blk_dirty(). */
+struct blk_buf *blk_get(uint32_t lba);
+void blk_dirty(struct blk_buf *b);
+void blk_put(struct blk_buf *b);
+
+/* Copying interface; 0 on success, -1 on error. A read that misses
+   fetches runs of sectors with one command. */
+int blk_read(uint32_t lba, void *buf, uint32_t n);
+int blk_write(uint32_t lba, const void *buf, uint32_t n);
+int blk_sync(void);
+
+/* Start reading sectors [lba, lba + n) into the cache and return without
+   waiting. Sectors that are cached or already on their way are skipped,
+   and so are the rest once no clean buffer is free. A later blk_get() or
+   blk_read() of a sector in flight waits for it. */
+void blk_readahead(uint32_t lba, uint32_t n);
+
+void blk_get_stats(struct blk_stats *out);
+
+#endif /* BLK_H */
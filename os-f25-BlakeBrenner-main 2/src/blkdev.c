@@ -0,0 +1,22 @@
+#include "blkdev.h"
+#include "blk.h"
+
+/* Kernel backend: everything goes through the buffer cache */
+
+const uint8_t *bdev_get(uint32_t lba, void **ref) {
+    struct blk_buf *b = blk_get(lba);
+    *ref = b;
+    return b ? b->data : 0;
+}
+
+void bdev_put(void *ref) {
+    blk_put(ref);
+}
+
+int bdev_read(uint32_t lba, void *buf, uint32_t n) {
+    return blk_read(lba, buf, n);
+}
+
+void bdev_readahead(uint32_t lba, uint32_t n) {
+    blk_readahead(lba, n);
+}
@@ -0,0 +1,36 @@
+#ifndef BLKDEV_H
+#define BLKDEV_H
+
+#include <stdint.h>
+
+/* The sector interface the filesystem code is written against, so the
+   same fat.c builds into the kernel and into host tools.
+
+   In the kernel (blkdev.c) it is the block cache over the ATA driver.
+   On the host (blkdev_host.c, built with -DHOST) it is an mmap of a disk
+   image: bdev_get() hands out pointers straight into the mapping and
+   readahead becomes madvise(), so the filesystem can be profiled at
+   native speed with no copies below it. */
+
+#ifndef SECTOR_SIZE
+#define SECTOR_SIZE 512
+#endif
+
+/* Hold sector lba and return its SECTOR_SIZE bytes, or NULL on a read
+   error. The pointer stays valid until bdev_put(ref). */
+const uint8_t *bdev_get(uint32_t lba, void **ref);
+void bdev_put(void *ref);
+
+/* Copy n sectors into buf; 0 or -1 */
+int bdev_read(uint32_t lba, void *buf, uint32_t n);
+
+/* Hint that [lba, lba + n) will be read soon; never waits */
+void bdev_readahead(uint32_t lba, uint32_t n);
+
+#ifdef HOST
+/* Map a disk image read-only; 0 or -1 */
+int bdev_open(const char *path);
+void bdev_close(void);
+#endif
+
+#endif /* BLKDEV_H */
@@ -0,0 +1,68 @@
+/* Host backend for blkdev.h: the whole disk image is mapped once and
+   sectors are addressed in place. Built into host tools only. */
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blkdev.h"
+
+static const uint8_t *image;
+static size_t image_size;
+
+int bdev_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SECTOR_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);   // the mapping keeps the file
+    if (p == MAP_FAILED)
+        return -1;
+    image = p;
+    image_size = st.st_size;
+    return 0;
+}
+
+void bdev_close(void) {
+    if (image)
+        munmap((void *)image, image_size);
+    image = 0;
+    image_size = 0;
+}
+
+static int in_range(uint32_t lba, uint32_t n) {
+    return image && ((uint64_t)lba + n) * SECTOR_SIZE <= image_size;
+}
+
+const uint8_t *bdev_get(uint32_t lba, void **ref) {
+    *ref = 0;
+    return in_range(lba, 1) ? image + (size_t)lba * SECTOR_SIZE : 0;
+}
+
+void bdev_put(void *ref) {
+    (void)ref;
+}
+
+int bdev_read(uint32_t lba, void *buf, uint32_t n) {
+    if (!in_range(lba, n))
+        return -1;
+    memcpy(buf, image + (size_t)lba * SECTOR_SIZE, (size_t)n * SECTOR_SIZE);
+    return 0;
+}
+
+void bdev_readahead(uint32_t lba, uint32_t n) {
+    if (!in_range(lba, n))
+        return;
+    // madvise wants a page-aligned start
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(image + (size_t)lba * SECTOR_SIZE);
+    uintptr_t end = start + (size_t)n * SECTOR_SIZE;
+    start &= ~(page - 1);
+    madvise((void *)start, end - start, MADV_WILLNEED);
+}
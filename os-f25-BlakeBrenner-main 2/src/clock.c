@@ -0,0 +1,115 @@
+#include "clock.h"
+#include "timer.h"
+#include "spinlock.h"
+
+extern void outb(uint16_t port, uint8_t val);
+extern uint8_t inb(uint16_t port);
+
+#define PIT_CH2         0x42
+#define PIT_CMD         0x43
+#define PIT_GATE_PORT   0x61   /* bit 0: channel 2 gate, 1: speaker, 5: OUT2 */
+#define CAL_COUNT       0xFFFFu
+#define CAL_SPIN_LIMIT  1000000u   /* ~1 s of port reads: no OUT2, give up */
+
+/* ns = (c * mult) >> SCALE_SHIFT */
+#define SCALE_SHIFT     22
+
+static int have_tsc;
+static uint32_t tsc_khz;
+static uint32_t mult;
+static uint64_t base;
+
+uint64_t div64_32(uint64_t n, uint32_t d, uint32_t *rem) {
+    uint32_t hi = (uint32_t)(n >> 32), lo = (uint32_t)n;
+    uint32_t qhi = hi / d, r = hi % d, qlo;
+    // r < d, so the second divl cannot overflow
+    __asm__("divl %4" : "=a"(qlo), "=d"(r) : "a"(lo), "d"(r), "rm"(d));
+    if (rem)
+        *rem = r;
+    return ((uint64_t)qhi << 32) | qlo;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* CPUID exists if EFLAGS.ID can be toggled (not on a 386/early 486) */
+static int cpu_has_tsc(void) {
+    uint32_t a, b;
+    __asm__ __volatile__(
+        "pushfl\n\t"
+        "pushfl\n\t"
+        "popl %0\n\t"
+        "movl %0, %1\n\t"
+        "xorl $0x200000, %0\n\t"
+        "pushl %0\n\t"
+        "popfl\n\t"
+        "pushfl\n\t"
+        "popl %0\n\t"
+        "popfl"
+        : "=&r"(a), "=&r"(b) :: "cc");
+    if (!((a ^ b) & 0x200000u))
+        return 0;
+
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 4) & 1;
+}
+
+/* TSC cycles over CAL_COUNT PIT periods, timed on channel 2 so the tick
+   on channel 0 is left alone. 0 if OUT2 never rises. */
+static uint64_t measure_tsc(void) {
+    uint8_t gate = inb(PIT_GATE_PORT);
+    outb(PIT_GATE_PORT, (gate & ~0x02) | 0x01);   // speaker off, gate on
+    outb(PIT_CMD, 0xB0);                          // channel 2, lo/hi byte, mode 0
+    outb(PIT_CH2, CAL_COUNT & 0xFF);
+    outb(PIT_CH2, CAL_COUNT >> 8);
+
+    uint64_t t0 = rdtsc();
+    uint32_t spins = 0;
+    while (!(inb(PIT_GATE_PORT) & 0x20) && ++spins < CAL_SPIN_LIMIT)
+        ;
+    uint64_t t1 = rdtsc();
+
+    outb(PIT_GATE_PORT, gate);
+    return spins < CAL_SPIN_LIMIT ? t1 - t0 : 0;
+}
+
+void clock_init(void) {
+    uint32_t flags = irq_save();
+    uint64_t delta = cpu_has_tsc() ? measure_tsc() : 0;
+    irq_restore(flags);
+
+    // kHz keeps TSCs above 4 GHz within 32 bits
+    if (delta)
+        tsc_khz = (uint32_t)div64_32(delta * PIT_HZ, CAL_COUNT * 1000u, 0);
+
+    if (tsc_khz) {
+        have_tsc = 1;
+        mult = (uint32_t)div64_32(1000000ull << SCALE_SHIFT, tsc_khz, 0);
+    } else {
+        mult = (uint32_t)div64_32(1000000000ull << SCALE_SHIFT, PIT_HZ, 0);
+    }
+    base = cycles();
+}
+
+uint64_t cycles(void) {
+    return have_tsc ? rdtsc() : timer_pit_counts();
+}
+
+/* 64x32 multiply split in halves so the product never overflows */
+uint64_t cycles_to_ns(uint64_t c) {
+    uint64_t hi = (c >> 32) * mult;
+    uint64_t lo = (c & 0xFFFFFFFFu) * mult;
+    return (hi << (32 - SCALE_SHIFT)) + (lo >> SCALE_SHIFT);
+}
+
+uint64_t clock_ns(void) {
+    return cycles_to_ns(cycles() - base);
+}
+
+uint32_t clock_tsc_khz(void) {
+    return tsc_khz;
+}
@@ -0,0 +1,29 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdint.h>
+
+/* High-resolution monotonic clock. clock_init() measures the TSC against
+   PIT channel 2 (about 55 ms, interrupts off); after that clock_ns() is a
+   rdtsc and a fixed-point multiply. CPUs without a TSC fall back to the
+   PIT counter (838 ns resolution) and cycles() counts PIT periods. */
+
+void clock_init(void);
+
+/* Raw time stamp counter (PIT counts without a TSC) */
+uint64_t cycles(void);
+
+/* Nanoseconds since clock_init() */
+uint64_t clock_ns(void);
+
+/* Convert a cycles() difference to nanoseconds */
+uint64_t cycles_to_ns(uint64_t c);
+
+/* Calibrated TSC frequency in kHz; 0 when the PIT fallback is in use */
+uint32_t clock_tsc_khz(void);
+
+/* 64-by-32 division without libgcc: returns n / d, *rem = n % d (rem may
+   be NULL) */
+uint64_t div64_32(uint64_t n, uint32_t d, uint32_t *rem);
+
+#endif /* CLOCK_H */
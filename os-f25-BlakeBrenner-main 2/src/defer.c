@@ -0,0 +1,80 @@
+#include "defer.h"
+#include "sched.h"
+#include "spinlock.h"
+
+#define DEFER_MASK (DEFER_QUEUE_SIZE - 1)
+
+struct defer_item {
+    defer_fn fn;
+    void *arg;
+    uint32_t data;
+};
+
+/* Only touched with interrupts off on the BSP; indices run freely */
+static struct defer_item ring[DEFER_QUEUE_SIZE];
+static uint32_t head, tail;
+static int draining;
+static struct defer_stats stats;
+
+int defer_queue(defer_fn fn, void *arg, uint32_t data) {
+    if (head - tail == DEFER_QUEUE_SIZE) {
+        stats.dropped++;
+        return -1;
+    }
+    struct defer_item *it = &ring[head & DEFER_MASK];
+    it->fn = fn;
+    it->arg = arg;
+    it->data = data;
+    head++;
+
+    stats.queued++;
+    if (head - tail > stats.max_depth)
+        stats.max_depth = head - tail;
+    return 0;
+}
+
+/* Entered and left with interrupts off; each item runs with them on.
+   Preemption stays off so the drain is never switched away mid-way;
+   a tick that lands here is taken at the next preemption point. */
+static void drain(void) {
+    draining = 1;
+    this_cpu()->preempt_count++;
+    while (tail != head) {
+        struct defer_item it = ring[tail & DEFER_MASK];
+        tail++;
+        stats.run++;
+        __asm__ __volatile__("sti" ::: "memory");
+        it.fn(it.arg, it.data);
+        __asm__ __volatile__("cli" ::: "memory");
+    }
+    this_cpu()->preempt_count--;
+    draining = 0;
+}
+
+void defer_irq_exit(void) {
+    if (head == tail || draining)
+        return;   // an outer drain picks new items up
+    struct cpu *c = this_cpu();
+    if (c->preempt_count) {
+        c->need_resched = 1;   // preempt_resched() runs them
+        return;
+    }
+    drain();
+}
+
+void defer_run(void) {
+    uint32_t flags = irq_save();
+    if (head != tail && !draining) {
+        if (this_cpu()->preempt_count || !(flags & 0x200u))
+            this_cpu()->need_resched = 1;   // at the outermost preempt_enable()
+        else
+            drain();
+    }
+    irq_restore(flags);
+}
+
+void defer_get_stats(struct defer_stats *out) {
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
@@ -0,0 +1,40 @@
+#ifndef DEFER_H
+#define DEFER_H
+
+#include <stdint.h>
+
+/* Deferred work ("bottom halves"). An interrupt handler only captures the
+   hardware state and queues an item, sends the EOI, then calls
+   defer_irq_exit(). Queued items run in FIFO order with interrupts
+   enabled: on that IRQ exit when the interrupted code was preemptible,
+   otherwise at its outermost preempt_enable().
+
+   Bottom halves run on the stack of whatever thread was interrupted, so
+   they must not sleep; they may use the heap and the console. Items are
+   only queued and run on the BSP, which takes every PIC interrupt. */
+
+#define DEFER_QUEUE_SIZE  256   /* power of two */
+
+typedef void (*defer_fn)(void *arg, uint32_t data);
+
+struct defer_stats {
+    uint32_t queued;
+    uint32_t run;
+    uint32_t dropped;     // queue was full
+    uint32_t max_depth;
+};
+
+/* From a top half, interrupts off. Returns -1 (and drops the item) when
+   the queue is full. */
+int defer_queue(defer_fn fn, void *arg, uint32_t data);
+
+/* Last thing in a top half, after the EOI */
+void defer_irq_exit(void);
+
+/* Run whatever is pending now if the caller is preemptible, otherwise at
+   its outermost preempt_enable(). For code that queued from a thread. */
+void defer_run(void);
+
+void defer_get_stats(struct defer_stats *out);
+
+#endif /* DEFER_H */
@@ -0,0 +1,94 @@
+#include "disk.h"
+#include "virtio_blk.h"
+
+static struct disk the_disk;
+static int present;
+
+int disk_init(void) {
+    const struct virtio_blk_info *vi = virtio_blk_get_info();
+    const struct ide_info *di = ide_get_info();
+
+    if (vi) {
+        the_disk.name = "virtio-blk";
+        the_disk.sectors = vi->sectors;
+        the_disk.max_sectors = vi->max_sectors;
+        the_disk.submit = virtio_blk_submit;
+        the_disk.plug = virtio_blk_plug;
+        the_disk.unplug = virtio_blk_unplug;
+    } else if (di) {
+        the_disk.name = "ata";
+        the_disk.sectors = di->sectors;
+        the_disk.max_sectors = ide_max_sectors();
+        the_disk.submit = ide_submit;
+        the_disk.plug = ide_plug;
+        the_disk.unplug = ide_unplug;
+    } else {
+        return -1;
+    }
+    present = 1;
+    return 0;
+}
+
+const struct disk *disk_get(void) {
+    return present ? &the_disk : 0;
+}
+
+void disk_submit(struct ata_request *r) {
+    if (!present) {
+        r->status = -1;
+        if (r->callback)
+            r->callback(r);
+        return;
+    }
+    the_disk.submit(r);
+}
+
+void disk_plug(void) {
+    if (present)
+        the_disk.plug();
+}
+
+void disk_unplug(void) {
+    if (present)
+        the_disk.unplug();
+}
+
+int disk_wait(struct ata_request *r) {
+    wait_event(&r->wait, r->status != ATA_PENDING);
+    return r->status;
+}
+
+static int transfer(int op, uint32_t lba, uint8_t *buf, uint32_t n) {
+    if (!present)
+        return -1;
+    while (n) {
+        uint32_t k = n < the_disk.max_sectors ? n : the_disk.max_sectors;
+        struct ata_request r = { 0 };
+        r.op = op;
+        r.lba = lba;
+        r.count = k;
+        r.buf = buf;
+        disk_submit(&r);
+        if (disk_wait(&r))
+            return -1;
+        lba += k;
+        buf += k * SECTOR_SIZE;
+        n -= k;
+    }
+    return 0;
+}
+
+int disk_read(uint32_t lba, void *buf, uint32_t n) {
+    return transfer(ATA_READ, lba, buf, n);
+}
+
+int disk_write(uint32_t lba, const void *buf, uint32_t n) {
+    return transfer(ATA_WRITE, lba, (uint8_t *)buf, n);   // only read from
+}
+
+int disk_flush(void) {
+    struct ata_request r = { 0 };
+    r.op = ATA_FLUSH;
+    disk_submit(&r);
+    return disk_wait(&r);
+}
@@ -0,0 +1,39 @@
+#ifndef DISK_H
+#define DISK_H
+
+#include <stdint.h>
+#include "ide.h"
+
+/* The disk the block layer sits on. disk_init() picks virtio-blk when the
+   VM offers one and the ATA drive otherwise; both drivers take struct
+   ata_request and complete it the same way (status, then the callback
+   from a bottom half or a wake_up on r->wait), so the code above only
+   goes through these calls. */
+
+struct disk {
+    const char *name;
+    uint64_t sectors;
+    uint32_t max_sectors;            // per request
+    void (*submit)(struct ata_request *r);
+    void (*plug)(void);
+    void (*unplug)(void);
+};
+
+/* After virtio_blk_init() and ide_init(). Returns -1 with neither. */
+int disk_init(void);
+
+/* NULL if there is no disk */
+const struct disk *disk_get(void);
+
+void disk_submit(struct ata_request *r);
+void disk_plug(void);
+void disk_unplug(void);
+int disk_wait(struct ata_request *r);
+
+/* Synchronous helpers, split into requests of at most max_sectors;
+   0 on success, -1 on error */
+int disk_read(uint32_t lba, void *buf, uint32_t n);
+int disk_write(uint32_t lba, const void *buf, uint32_t n);
+int disk_flush(void);
+
+#endif /* DISK_H */
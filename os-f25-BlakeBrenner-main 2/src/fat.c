@@ -0,0 +1,334 @@
+#include "blkdev.h"
+#include "fat.h"
+
+/* The same file builds into host tools (-DHOST, see fstest) */
+#ifdef HOST
+#include <stdlib.h>
+#include <string.h>
+#define fat_alloc(n)        malloc(n)
+#define fat_free(p)         free(p)
+#define copy_bytes(d, s, n) memcpy(d, s, n)
+#define preempt_disable()
+#define preempt_enable()
+#else
+#include "blk.h"
+#include "kmalloc.h"
+#include "sched.h"
+#define fat_alloc(n)        kmalloc(n)
+#define fat_free(p)         kfree(p)
+
+_Static_assert(FAT_RA_MAX_SECTORS <= BLK_CACHE_SECTORS / 4,
+               "readahead window would evict what it read before it is used");
+
+static void copy_bytes(void *dst, const void *src, uint32_t n) {
+    __asm__ __volatile__("cld; rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+#endif
+
+#define FAT16_EOC       0xFFF8     /* this and above: end of chain */
+#define RDE_FREE        0xE5
+#define RDE_END         0x00
+#define ATTR_VOLUME_ID  0x08
+#define ATTR_LFN        0x0F
+
+/* Filesystem geometry, in absolute sectors */
+static int mounted;
+static uint32_t part_start;
+static uint32_t fat_start;
+static uint32_t root_start, root_sectors, root_entries;
+static uint32_t data_start;
+static uint32_t cluster_sectors;
+static uint32_t cluster_bytes;
+static uint32_t ra_min, ra_max;     // readahead window bounds in clusters
+
+static struct file *open_files;
+
+static uint32_t cluster_lba(uint32_t cluster) {
+    return data_start + (cluster - 2) * cluster_sectors;
+}
+
+/* Next cluster in the chain; FAT16_EOC at the end or on a read error */
+static uint32_t fat_next(uint32_t cluster) {
+    uint32_t off = cluster * 2;
+    void *ref;
+    const uint8_t *s = bdev_get(fat_start + off / SECTOR_SIZE, &ref);
+    if (!s)
+        return FAT16_EOC;
+    uint32_t next = s[off % SECTOR_SIZE] | (s[off % SECTOR_SIZE + 1] << 8);
+    bdev_put(ref);
+    return next < 2 ? FAT16_EOC : next;
+}
+
+/* The boot sector sits at LBA 0 on a bare volume, or at the start of the
+   first partition (rootfs.img: sector 2048) */
+static uint32_t find_volume(void) {
+    void *ref;
+    const uint8_t *s = bdev_get(0, &ref);
+    if (!s)
+        return 0;
+    const struct boot_sector *bs = (const struct boot_sector *)s;
+    uint32_t start = 0;
+    if (bs->boot_signature == 0xAA55 && bs->bytes_per_sector != SECTOR_SIZE) {
+        const uint8_t *pe = s + 446;   // partition entry 0
+        start = pe[8] | (pe[9] << 8) | (pe[10] << 16) | ((uint32_t)pe[11] << 24);
+    }
+    bdev_put(ref);
+    return start;
+}
+
+int fatInit(void) {
+    mounted = 0;
+    part_start = find_volume();
+    void *ref;
+    const struct boot_sector *bs = (const struct boot_sector *)bdev_get(part_start, &ref);
+    if (!bs)
+        return -1;
+    int ok = bs->bytes_per_sector == SECTOR_SIZE && bs->num_sectors_per_cluster &&
+             bs->num_fat_tables && bs->num_sectors_per_fat;
+    if (ok) {
+        cluster_sectors = bs->num_sectors_per_cluster;
+        cluster_bytes = cluster_sectors * SECTOR_SIZE;
+        ra_max = FAT_RA_MAX_SECTORS / cluster_sectors;
+        if (!ra_max)
+            ra_max = 1;
+        ra_min = FAT_RA_MIN < ra_max ? FAT_RA_MIN : ra_max;
+        fat_start = part_start + bs->num_reserved_sectors;
+        root_start = fat_start + bs->num_fat_tables * bs->num_sectors_per_fat;
+        root_entries = bs->num_root_dir_entries;
+        root_sectors = (root_entries * sizeof(struct root_directory_entry) + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        data_start = root_start + root_sectors;
+    }
+    bdev_put(ref);
+    if (!ok)
+        return -1;
+    mounted = 1;
+    return 0;
+}
+
+int fatReadDir(uint32_t *pos, struct root_directory_entry *out) {
+    const uint32_t per_sector = SECTOR_SIZE / sizeof(struct root_directory_entry);
+    if (!mounted)
+        return -1;
+
+    // Resume where the last call stopped, holding each sector once
+    uint32_t i = *pos;
+    while (i < root_entries) {
+        void *ref;
+        const uint8_t *s = bdev_get(root_start + i / per_sector, &ref);
+        if (!s)
+            return -1;
+        const struct root_directory_entry *e = (const struct root_directory_entry *)s;
+        do {
+            const struct root_directory_entry *d = &e[i % per_sector];
+            uint8_t first = d->file_name[0];
+            if (first == RDE_END) {
+                bdev_put(ref);
+                *pos = root_entries;
+                return -1;
+            }
+            i++;
+            if (first != RDE_FREE && d->attribute != ATTR_LFN && !(d->attribute & ATTR_VOLUME_ID)) {
+                copy_bytes(out, d, sizeof(*d));
+                bdev_put(ref);
+                *pos = i;
+                return 0;
+            }
+        } while (i < root_entries && i % per_sector);
+        bdev_put(ref);
+    }
+    *pos = i;
+    return -1;
+}
+
+static char upper(char c) {
+    return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+/* Compare "NAME.EXT" (any case) with a space-padded 8.3 entry */
+static int name_matches(const char *path, const struct root_directory_entry *e) {
+    int i = 0, k;
+    for (k = 0; k < 8 && path[i] && path[i] != '.'; k++, i++)
+        if (upper(path[i]) != e->file_name[k])
+            return 0;
+    if (k < 8 && e->file_name[k] != ' ')
+        return 0;
+    if (path[i] == '.')
+        i++;
+    for (k = 0; k < 3 && path[i]; k++, i++)
+        if (upper(path[i]) != e->file_extension[k])
+            return 0;
+    return !path[i] && (k == 3 || e->file_extension[k] == ' ');
+}
+
+struct file *fatOpen(const char *path) {
+    while (*path == '/')
+        path++;
+    for (const char *p = path; *p; p++)
+        if (*p == '/')
+            return 0;   // subdirectories are not supported
+
+    // One pass over the root directory
+    struct root_directory_entry e;
+    for (uint32_t pos = 0; fatReadDir(&pos, &e) == 0; ) {
+        if ((e.attribute & FILE_ATTRIBUTE_SUBDIRECTORY) || !name_matches(path, &e))
+            continue;
+        struct file *f = fat_alloc(sizeof(*f));
+        if (!f)
+            return 0;
+        f->rde = e;
+        f->start_cluster = e.cluster;
+        f->pos = 0;
+        f->cur_cluster = e.cluster;
+        f->cur_index = 0;
+        f->ra_expect = 0;
+        f->ra_window = 0;
+        f->ra_end = 0;
+
+        preempt_disable();
+        f->prev = 0;
+        f->next = open_files;
+        if (open_files)
+            open_files->prev = f;
+        open_files = f;
+        preempt_enable();
+        return f;
+    }
+    return 0;
+}
+
+void fatClose(struct file *f) {
+    preempt_disable();
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        open_files = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    preempt_enable();
+    fat_free(f);
+}
+
+void fatSeek(struct file *f, uint32_t pos) {
+    f->pos = pos;
+}
+
+/* Move the file's cluster cursor to its index'th cluster; 0 if the chain
+   ends first */
+static int seek_cluster(struct file *f, uint32_t index) {
+    if (index < f->cur_index) {
+        f->cur_cluster = f->start_cluster;
+        f->cur_index = 0;
+    }
+    while (f->cur_index < index) {
+        uint32_t next = fat_next(f->cur_cluster);
+        if (next >= FAT16_EOC)
+            return 0;
+        f->cur_cluster = next;
+        f->cur_index++;
+    }
+    return f->cur_cluster >= 2 && f->cur_cluster < FAT16_EOC;
+}
+
+/* Queue clusters [from, to) of the file, walking the chain from the
+   cursor without moving it; physically adjacent clusters go out as one
+   range so the elevator can merge them */
+static void readahead(struct file *f, uint32_t from, uint32_t to) {
+    uint32_t cluster = f->cur_cluster, index = f->cur_index;
+    uint32_t run_start = 0, run_len = 0;
+
+    while (index + 1 < to) {
+        uint32_t next = fat_next(cluster);
+        if (next >= FAT16_EOC)
+            break;
+        cluster = next;
+        index++;
+        if (index < from)
+            continue;
+        if (run_len && cluster_lba(cluster) == run_start + run_len) {
+            run_len += cluster_sectors;
+        } else {
+            if (run_len)
+                bdev_readahead(run_start, run_len);
+            run_start = cluster_lba(cluster);
+            run_len = cluster_sectors;
+        }
+    }
+    if (run_len)
+        bdev_readahead(run_start, run_len);
+    f->ra_end = index + 1;
+}
+
+/* Sequential reads grow the window; anything else turns readahead off
+   until the reader settles into a pattern again */
+static void update_readahead(struct file *f, uint32_t first, uint32_t last) {
+    if (f->pos != f->ra_expect) {
+        f->ra_window = 0;
+        f->ra_end = last + 1;
+        return;
+    }
+    if (!f->ra_window)
+        f->ra_window = ra_min;
+
+    // Top up once the reader is within half a window of the end, so
+    // the drive always has the next batch queued
+    if (f->ra_end < first + 1)
+        f->ra_end = first + 1;
+    if (f->ra_end <= last + f->ra_window / 2) {
+        if (f->ra_end > last + 1 && f->ra_window < ra_max) {
+            f->ra_window *= 2;   // the reader kept up with the last batch
+            if (f->ra_window > ra_max)
+                f->ra_window = ra_max;
+        }
+        readahead(f, f->ra_end, last + 1 + f->ra_window);
+    }
+}
+
+int fatRead(struct file *f, void *buf, uint32_t n) {
+    uint8_t *dst = buf;
+    uint32_t size = f->rde.file_size;
+    if (f->pos >= size)
+        return 0;
+    if (n > size - f->pos)
+        n = size - f->pos;
+    if (!n)
+        return 0;
+
+    uint32_t first = f->pos / cluster_bytes, last = (f->pos + n - 1) / cluster_bytes;
+    if (!seek_cluster(f, first))
+        return -1;
+    update_readahead(f, first, last);
+
+    uint32_t got = 0;
+    while (got < n) {
+        uint32_t index = f->pos / cluster_bytes;
+        if (!seek_cluster(f, index))
+            return got ? (int)got : -1;
+        uint32_t off = f->pos % cluster_bytes;
+        uint32_t len = cluster_bytes - off;
+        if (len > n - got)
+            len = n - got;
+
+        uint32_t lba = cluster_lba(f->cur_cluster) + off / SECTOR_SIZE;
+        uint32_t soff = off % SECTOR_SIZE;
+        if (!soff && len >= SECTOR_SIZE) {
+            // Whole sectors straight into the caller's buffer
+            uint32_t whole = len / SECTOR_SIZE;
+            if (bdev_read(lba, dst + got, whole))
+                return got ? (int)got : -1;
+            len = whole * SECTOR_SIZE;
+        } else {
+            void *ref;
+            const uint8_t *s = bdev_get(lba, &ref);
+            if (!s)
+                return got ? (int)got : -1;
+            if (len > SECTOR_SIZE - soff)
+                len = SECTOR_SIZE - soff;
+            copy_bytes(dst + got, s + soff, len);
+            bdev_put(ref);
+        }
+        got += len;
+        f->pos += len;
+    }
+    f->ra_expect = f->pos;
+    return got;
+}
@@ -3,6 +3,7 @@
 #define __FAT_H__
 
 #include <stdint.h>
+#include "blkdev.h"
 
 #define CLUSTER_SIZE 4096
 #define SECTORS_PER_CLUSTER (CLUSTER_SIZE/SECTOR_SIZE)
@@ -77,7 +78,38 @@ struct file {
     struct file *prev;
     struct root_directory_entry rde;
     uint32_t start_cluster;
+    uint32_t pos;            // byte offset of the next fatRead()
+    uint32_t cur_cluster;    // cluster number of the file's cur_index'th cluster
+    uint32_t cur_index;
+
+    /* Readahead: sequential readers get the next ra_window clusters
+       queued ahead of them; the window doubles each time the reader
+       catches up with it and collapses after a seek */
+    uint32_t ra_expect;      // where a sequential read would start
+    uint32_t ra_window;      // clusters, 0 while access looks random;
+                             // at most FAT_RA_MAX_SECTORS worth
+    uint32_t ra_end;         // cluster index readahead has been issued up to
 };
 
+#define FAT_RA_MIN          4     /* clusters on the first sequential read */
+#define FAT_RA_MAX_SECTORS  256   /* largest window; a quarter of the kernel's block cache */
+
+/*
+ * FAT16 over the sector interface in blkdev.h: the block cache in the
+ * kernel, an mmap'd disk image on the host. Only the root directory is
+ * searched.
+ */
+int fatInit(void);
+struct file *fatOpen(const char *path);
+int fatRead(struct file *f, void *buf, uint32_t n);    // bytes read, -1 on error
+void fatSeek(struct file *f, uint32_t pos);
+void fatClose(struct file *f);
+
+/* The next used root directory entry at or after *pos (volume labels and
+   long-name entries skipped), advancing *pos past it. Start with *pos = 0;
+   a listing is one pass over the directory. Returns -1 past the last
+   entry or on a read error. */
+int fatReadDir(uint32_t *pos, struct root_directory_entry *out);
+
 
 #endif
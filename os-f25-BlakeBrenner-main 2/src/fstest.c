@@ -1,109 +1,101 @@
 /*
 
-This is the activity we did in class on 11/3/2025. This file reads the
-superblock from a FAT-formatted disk.img (aka bios information block in FAT
-parlance) and prints out some parameters.
+Host-side test bench for the kernel's FAT code. fat.c is compiled
+unchanged against blkdev_host.c, which maps the disk image instead of
+talking to the ATA controller, so the filesystem can be checked and
+profiled on Linux at native speed.
 
+To build and run it against the kernel's boot disk:
 
-To create the disk image:
+rambler@system ~ $ make fstest rootfs.img
+rambler@system ~ $ ./fstest rootfs.img              # list the root directory
+rambler@system ~ $ ./fstest rootfs.img kernel 100   # read a file 100 times
 
-rambler@system ~ $ dd if=/dev/zero of=disk.img bs=1M count=8192
+Any FAT16 image works, partitioned (the volume is taken from the first
+MBR entry) or bare, e.g. one made with:
+
+rambler@system ~ $ dd if=/dev/zero of=disk.img bs=1M count=64
 rambler@system ~ $ mkfs.vfat -F 16 disk.img
 
 */
 
-#include "fat.h"
 #include <stdio.h>
-#include <fcntl.h>
-#include <unistd.h>
-
-char sector_buf[512];
-char rde_reigon[16384];
-int fd = 0;
-
-
-/*
-   read_sector_from_disk_image()
-
-   Reads one sector from a disk image. Assumes global variable fd represents an
-   open file descriptor for the disk image.
-
-   This is a Linux implementation of ata_lba_read(), which is provided in ide.s,
-   that reads from disk by directly accessing the hardware ATA controller. Since
-   we're experimenting with disk images in Linux, we don't want to directly
-   access the ATA controller.
-
-*/
-int read_sector_from_disk_image(unsigned int sector_num, char *buf, unsigned int nsectors) {
-  // position the OS index 
-  lseek(fd, sector_num * 512, SEEK_SET);
-
-  // Read one sector from disk image
-  int n = read(fd, buf, 512 * nsectors);
- }
-
- //strcpy()
- void array2array(char *dest[], char *src[]){
-  // copy from arr1 to arr2
-  int k = 0;
-  while(dest[k] != 0){
-    src[k] = dest[k];
-    k++;
-  }
- }
-
- //strcpy() for fat
- void extract_fname(struct root_directory_entry *rde, char *fname){
-  // copy from arr1 to arr2
-  int k = 0;
-  while (rde->file_name[k] != ' ') && (k < 8){
-    fname[k] = (rde->file_name)[k];
-    k++;
-  }
-  fname[k] = '\0';
-  if(rde->file_extension[0] == ' '){
-    return;
-  }
-  fname[k++] = '.'; //add dot
-  fname[k++] = '\0';//add null terminator
-  int n = 0
-  while (rde->file_extension[k] != ' ') && (n < 3){
-    fname[k] = (rde->file_extension)[n];
-    k++;
-    n++;
-  }
-  fname[k] = '\0';
- }
-int main() {
-
-  struct boot_sector *bs = (struct boot_sector*)sector_buf;
-  struct root_directory_entry *rde_tbl =(struct root_directory_entry*) rde_reigon;
-  // Open disk image file. fd is a global to make it accessible to
-  // read_sector_from_disk_image()
-  fd = open("disk.img", O_RDONLY);
+#include <stdlib.h>
+#include <time.h>
+#include "fat.h"
 
-  // Call our function to read a sector from the disk image.
-  read_sector_from_disk_image(0, sector_buf, 1);
+#define CHUNK (64 * 1024)
 
-  // not weird way to print sectors per cluster
-  //printf("sectors per cluster = %d\n", sector_buf[13]);
+static void list_root(void) {
+    struct root_directory_entry e;
+    for (uint32_t pos = 0; fatReadDir(&pos, &e) == 0; ) {
+        printf("  %.8s.%.3s %s %u\n", e.file_name, e.file_extension,
+               (e.attribute & FILE_ATTRIBUTE_SUBDIRECTORY) ? "<dir>" : "     ", e.file_size);
+    }
+}
 
-  // Print info from superblock
-  printf("sectors per cluster = %d\n", bs->num_sectors_per_cluster);
-  printf("reserved sectors = %d\n", bs->num_reserved_sectors);
-  printf("num fat tables = %d\n", bs->num_fat_tables);
-  printf("num RDEs = %d\n", bs->num_root_dir_entries);
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  //read RDE reigon replace 0 with 2048 for homework
-  read_sector_from_disk_image( 0 + bs->num_reserved_sectors + bs->num_fat_tables * bs->num_sectors_per_fat, //sector num
-  			       rde_reigon, // buffer to hold the RDE table
-			       32);// Number of sectors in the RDE Table
-  for(int k = 0; k < 512; k++){
-    char temp_str[10];
-    strcpy_fat(temp_str, rde_tbl[k].file_name);
-    extract_fname(&rde_tbl[k], temp_str);
-    printf("fname = %s\n", rde_tbl[k].file_name);
-  }
+/* Read the whole file passes times; prints throughput and an FNV-1a hash
+   of the contents to compare against the original */
+static int bench(const char *path, int passes) {
+    static uint8_t buf[CHUNK];
+    uint32_t hash = 2166136261u;
+    uint64_t total = 0;
+
+    struct file *f = fatOpen(path);
+    if (!f) {
+        fprintf(stderr, "%s: not found\n", path);
+        return 1;
+    }
+    double t0 = now();
+    for (int p = 0; p < passes; p++) {
+        fatSeek(f, 0);
+        int n;
+        while ((n = fatRead(f, buf, CHUNK)) > 0) {
+            total += n;
+            if (p == 0)
+                for (int i = 0; i < n; i++)
+                    hash = (hash ^ buf[i]) * 16777619u;
+        }
+        if (n < 0) {
+            fprintf(stderr, "%s: read error\n", path);
+            fatClose(f);
+            return 1;
+        }
+    }
+    double t = now() - t0;
+    fatClose(f);
+
+    printf("%s: %u bytes, fnv1a %08x\n", path, (unsigned)(total / passes), hash);
+    printf("%d passes, %llu bytes in %.3f s, %.1f MB/s\n", passes, (unsigned long long)total, t,
+           t > 0 ? total / t / 1e6 : 0.0);
+    return 0;
+}
 
-  return 0;
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <disk.img> [file [passes]]\n", argv[0]);
+        return 2;
+    }
+    if (bdev_open(argv[1]) < 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (fatInit() < 0) {
+        fprintf(stderr, "%s: no FAT16 volume\n", argv[1]);
+        return 1;
+    }
+
+    int status = 0;
+    if (argc == 2)
+        list_root();
+    else
+        status = bench(argv[2], argc == 4 && atoi(argv[3]) > 0 ? atoi(argv[3]) : 1);
+    bdev_close();
+    return status;
 }
@@ -0,0 +1,732 @@
+#include "ide.h"
+#include "interrupt.h"
+#include "defer.h"
+#include "spinlock.h"
+#include "paging.h"
+#include "pci.h"
+#include "io.h"
+
+/* Primary channel registers */
+#define ATA_DATA        0x1F0
+#define ATA_ERROR       0x1F1
+#define ATA_COUNT       0x1F2
+#define ATA_LBA0        0x1F3
+#define ATA_LBA1        0x1F4
+#define ATA_LBA2        0x1F5
+#define ATA_DRIVE       0x1F6   /* master, LBA mode: 0xE0 | LBA 27:24 (LBA28), 0x40 (LBA48) */
+#define ATA_STATUS      0x1F7   /* read: also acknowledges the IRQ */
+#define ATA_COMMAND     0x1F7
+#define ATA_CTRL        0x3F6   /* write: device control, read: alt status */
+#define ATA_IRQ         14
+
+#define ATA_SR_BSY      0x80
+#define ATA_SR_DF       0x20
+#define ATA_SR_DRQ      0x08
+#define ATA_SR_ERR      0x01
+
+#define ATA_CTRL_SRST   0x04
+#define ATA_CTRL_NIEN   0x02
+
+#define ATA_CMD_READ            0x20
+#define ATA_CMD_READ_EXT        0x24
+#define ATA_CMD_READ_MULTIPLE   0xC4
+#define ATA_CMD_READ_MULT_EXT   0x29
+#define ATA_CMD_SET_MULTIPLE    0xC6
+#define ATA_CMD_READ_DMA        0xC8
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE           0x30
+#define ATA_CMD_WRITE_EXT       0x34
+#define ATA_CMD_WRITE_MULTIPLE  0xC5
+#define ATA_CMD_WRITE_MULT_EXT  0x39
+#define ATA_CMD_WRITE_DMA       0xCA
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_FLUSH_CACHE     0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xEA
+#define ATA_CMD_IDENTIFY        0xEC
+
+/* PIIX bus-master IDE registers for the primary channel, at BAR4 */
+#define BM_COMMAND      0x00   /* bit 0: start, bit 3: transfer to memory (read) */
+#define BM_STATUS       0x02   /* bits 1-2 are write-1-to-clear */
+#define BM_PRDT         0x04   /* physical address of the PRD table */
+#define BM_CMD_START    0x01
+#define BM_CMD_READ     0x08
+#define BM_SR_ACTIVE    0x01
+#define BM_SR_ERR       0x02
+#define BM_SR_IRQ       0x04
+#define BM_SR_DRV0_DMA  0x20   /* informational: master is set up for DMA */
+
+/* Physical Region Descriptor: a run of physical memory that does not
+   cross a 64 KiB boundary; the controller walks the table up to EOT */
+struct prd {
+    uint32_t addr;
+    uint16_t bytes;      // 0 = 64 KiB
+    uint16_t flags;
+};
+#define PRD_EOT         0x8000
+#define PRD_ENTRIES     (PAGE_SIZE / sizeof(struct prd))
+#define PRD_BOUNDARY    0x10000u
+
+#define LBA28_LIMIT     (1u << 28)
+#define POLL_LIMIT      1000000u   /* status reads before giving up on a polled wait */
+
+/* Bottom-half events: kind in the top byte, payload below */
+#define EV_KICK         1   /* a request was queued */
+#define EV_IRQ          2   /* payload: status register */
+#define EV_TIMEOUT      3   /* payload: seq of the request that timed out */
+#define EV(kind, payload)  (((uint32_t)(kind) << 24) | ((payload) & 0xFFFFFFu))
+
+static int present;
+static struct ide_info info;
+static struct ide_stats stats;
+
+/* Bus-master DMA; bmide is 0 when the PIO path is the only one */
+static uint16_t bmide;
+static struct prd prd_table[PRD_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t prd_phys;
+
+/* Submitted but not started, changed with interrupts off. Sorted by LBA
+   between flushes: a flush is a barrier nothing is moved across. */
+static struct ata_request *q_head;
+static int plugged;
+
+/* Only touched from bottom halves, which never run concurrently */
+static struct ata_request *active;  // the command: merged requests chained by ->next
+static uint32_t cmd_count;      // sectors in the command
+static uint32_t cmd_done;       // sectors moved so far
+static struct ata_request *xfer;    // PIO: the request the next sector belongs to
+static uint32_t xfer_off;       // ... and its index there
+static uint64_t head_pos;       // LBA after the last command, for the elevator
+static uint32_t seq;            // bumped for every started command
+static uint32_t block;          // sectors per DRQ block of the active command
+static int active_dma;          // the active command is a DMA transfer
+static int flush_ext;           // FLUSH CACHE EXT supported
+static struct timer watchdog;
+
+static void ata_bottom_half(void *arg, uint32_t ev);
+
+/* ~400 ns: four alternate-status reads */
+static void ata_delay(void) {
+    for (int i = 0; i < 4; i++)
+        (void)inb(ATA_CTRL);
+}
+
+/* Wait for DRQ on the alternate status, which leaves a pending interrupt
+   alone. Returns 0 when the drive wants data, -1 on an error or timeout. */
+static int wait_drq(void) {
+    for (uint32_t i = 0; i < POLL_LIMIT; i++) {
+        uint8_t s = inb(ATA_CTRL);
+        if (s & ATA_SR_BSY)
+            continue;
+        if (s & (ATA_SR_ERR | ATA_SR_DF))
+            return -1;
+        if (s & ATA_SR_DRQ)
+            return 0;
+    }
+    return -1;
+}
+
+/* Timer callback (PIT interrupt): hand over to the bottom half, which
+   owns the driver state */
+static void watchdog_expired(void *arg) {
+    defer_queue(ata_bottom_half, 0, EV(EV_TIMEOUT, (uint32_t)arg));
+}
+
+/* Describe the buffers of the command to the controller, one entry per
+   physically contiguous run, so the data moves straight between the
+   drive and the callers' frames. Fails (and the command goes through PIO)
+   if a page is not present, if a read would land in a read-only page
+   (e.g. one still copy-on-write), or if the table would overflow. */
+static int build_prd(struct ata_request *chain) {
+    uint32_t n = 0, end = 0;
+
+    for (struct ata_request *r = chain; r; r = r->next) {
+        uint32_t va = (uint32_t)(uintptr_t)r->buf;
+        uint32_t left = r->count * SECTOR_SIZE;
+        if (va & 1)
+            return -1;   // the controller moves 16-bit words
+        while (left) {
+            uint32_t pte = get_pte((void *)va);
+            uint32_t pa = (uint32_t)(uintptr_t)get_physaddr((void *)va);
+            if (!pa || (r->op == ATA_READ && pte && !(pte & PTE_RW)))
+                return -1;
+
+            uint32_t len = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+            if (len > left)
+                len = left;
+            // Extend the last entry while the memory is adjacent and it
+            // stays inside one 64 KiB window (a full window wraps bytes to 0)
+            if (n && pa == end && (pa & (PRD_BOUNDARY - 1))) {
+                prd_table[n - 1].bytes += len;
+            } else {
+                if (n == PRD_ENTRIES)
+                    return -1;
+                prd_table[n].addr = pa;
+                prd_table[n].bytes = len;
+                prd_table[n].flags = 0;
+                n++;
+            }
+            end = pa + len;
+            va += len;
+            left -= len;
+        }
+    }
+    prd_table[n - 1].flags = PRD_EOT;
+    return 0;
+}
+
+/* Select the drive and load the task file; LBA28 takes fewer port writes,
+   so LBA48 only when the command needs it. Returns 1 for LBA48. */
+static int load_taskfile(uint64_t lba, uint32_t count) {
+    uint32_t lo = (uint32_t)lba;
+    if (lba + count > LBA28_LIMIT || count > ATA_MAX_SECTORS_LBA28) {
+        uint32_t hi = (uint32_t)(lba >> 32);
+        outb(ATA_DRIVE, 0x40);
+        ata_delay();
+        outb(ATA_COUNT, (count >> 8) & 0xFF);   // 65536 -> 0
+        outb(ATA_LBA0, lo >> 24);
+        outb(ATA_LBA1, hi & 0xFF);
+        outb(ATA_LBA2, (hi >> 8) & 0xFF);
+        outb(ATA_COUNT, count & 0xFF);
+        outb(ATA_LBA0, lo & 0xFF);
+        outb(ATA_LBA1, (lo >> 8) & 0xFF);
+        outb(ATA_LBA2, (lo >> 16) & 0xFF);
+        return 1;
+    }
+    outb(ATA_DRIVE, 0xE0 | ((lo >> 24) & 0x0F));
+    ata_delay();
+    outb(ATA_COUNT, count & 0xFF);   // 256 -> 0
+    outb(ATA_LBA0, lo & 0xFF);
+    outb(ATA_LBA1, (lo >> 8) & 0xFF);
+    outb(ATA_LBA2, (lo >> 16) & 0xFF);
+    return 0;
+}
+
+/* ---------- Elevator ---------- */
+
+/* A flush, or a request that overlaps one queued before it (see enqueue),
+   starts a new segment; nothing is reordered across the start of one */
+static int starts_segment(const struct ata_request *r) {
+    return r->op == ATA_FLUSH || r->barrier;
+}
+
+/* Two requests whose order matters: they share a sector and one writes */
+static int conflicts(const struct ata_request *a, const struct ata_request *b) {
+    return (a->op == ATA_WRITE || b->op == ATA_WRITE) &&
+           a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+/* Insert r in LBA order into the segment body that starts at *pp and ends
+   where the next segment starts. Interrupts off. */
+static void insert_sorted(struct ata_request **pp, struct ata_request *r) {
+    while (*pp && !starts_segment(*pp) && (*pp)->lba <= r->lba)
+        pp = &(*pp)->next;
+    r->next = *pp;
+    *pp = r;
+}
+
+/* New requests join the last segment, behind its first request. A flush,
+   or a request that conflicts with one it could otherwise overtake (a
+   read of sectors a queued write covers, say), goes at the very end and
+   starts a segment of its own. Interrupts off. */
+static void enqueue(struct ata_request *r) {
+    struct ata_request **seg = &q_head, **pp = &q_head;
+    for (; *pp; pp = &(*pp)->next)
+        if (starts_segment(*pp))
+            seg = &(*pp)->next;
+    r->barrier = 0;
+    if (r->op != ATA_FLUSH)
+        for (struct ata_request *q = *seg; q; q = q->next)
+            if (conflicts(q, r)) {
+                r->barrier = 1;
+                break;
+            }
+    if (starts_segment(r)) {
+        r->next = 0;
+        *pp = r;
+    } else {
+        insert_sorted(seg, r);
+    }
+}
+
+/* Take the next command off the queue. Retries go first, in order. Else
+   C-LOOK within the first segment: the lowest LBA at or past the head
+   position, else wrap to the lowest. Requests that follow it on disk with
+   the same direction ride along, up to the largest transfer and
+   ATA_MAX_MERGE requests, but never from the next segment. Interrupts
+   off. */
+static struct ata_request *dequeue(void) {
+    if (!q_head)
+        return 0;
+    struct ata_request **pp = &q_head;
+    if (q_head->op != ATA_FLUSH && !q_head->nomerge) {
+        while (*pp && (pp == &q_head || !starts_segment(*pp)) && (*pp)->lba < head_pos)
+            pp = &(*pp)->next;
+        if (!*pp || (pp != &q_head && starts_segment(*pp)))
+            pp = &q_head;
+    }
+
+    struct ata_request *first = *pp, *last = first;
+    *pp = first->next;
+    first->next = 0;
+    if (first->op == ATA_FLUSH)
+        return first;
+
+    uint32_t count = first->count, max = ide_max_sectors(), n = 1;
+    while (!first->nomerge && *pp && n < ATA_MAX_MERGE) {
+        struct ata_request *r = *pp;
+        if (r->op != first->op || r->nomerge || starts_segment(r) ||
+            r->lba != first->lba + count || count + r->count > max)
+            break;
+        *pp = r->next;
+        r->next = 0;
+        last->next = r;
+        last = r;
+        count += r->count;
+        n++;
+    }
+    stats.merged += n - 1;
+    head_pos = first->lba + count;
+    return first;
+}
+
+static void complete(int status);
+static void ata_reset(void);
+
+/* Move n sectors of the active command between the data port and the
+   buffers of the requests it carries */
+static void pio_move(uint32_t n, int write) {
+    while (n) {
+        uint32_t m = xfer->count - xfer_off;
+        if (m > n)
+            m = n;
+        uint8_t *p = xfer->buf + xfer_off * SECTOR_SIZE;
+        uint32_t words = m * (SECTOR_SIZE / 2);
+        if (write)
+            __asm__ __volatile__("cld; rep outsw"
+                                 : "+S"(p), "+c"(words) : "d"(ATA_DATA) : "memory");
+        else
+            __asm__ __volatile__("cld; rep insw"
+                                 : "+D"(p), "+c"(words) : "d"(ATA_DATA) : "memory");
+        n -= m;
+        cmd_done += m;
+        xfer_off += m;
+        xfer->done = xfer_off;
+        if (xfer_off == xfer->count) {
+            xfer = xfer->next;
+            xfer_off = 0;
+        }
+    }
+}
+
+/* One DRQ block: `block` sectors, or whatever is left */
+static uint32_t block_len(void) {
+    uint32_t n = cmd_count - cmd_done;
+    return n < block ? n : block;
+}
+
+/* Send one DRQ block of the active write once the drive asks for it */
+static int pio_write_block(void) {
+    if (wait_drq())
+        return -1;
+    pio_move(block_len(), 1);
+    return 0;
+}
+
+static void start_next(void) {
+    uint32_t flags = irq_save();
+    struct ata_request *r = dequeue();
+    irq_restore(flags);
+
+    active = r;
+    if (!r)
+        return;
+
+    cmd_count = cmd_done = xfer_off = 0;
+    for (struct ata_request *m = r; m; m = m->next) {
+        m->done = 0;
+        cmd_count += m->count;
+    }
+    xfer = r;
+    seq++;
+    block = info.multiple ? info.multiple : 1;
+    active_dma = r->op != ATA_FLUSH && bmide && build_prd(r) == 0;
+
+    if (r->op == ATA_FLUSH) {
+        stats.flushes++;
+        outb(ATA_DRIVE, flush_ext ? 0x40 : 0xE0);
+        ata_delay();
+        outb(ATA_COMMAND, flush_ext ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+    } else if (active_dma) {
+        int write = r->op == ATA_WRITE;
+        uint8_t dir = write ? 0 : BM_CMD_READ;
+        stats.dma++;
+        outb(bmide + BM_COMMAND, dir);           // engine stopped, direction set
+        outb(bmide + BM_STATUS, inb(bmide + BM_STATUS) | BM_SR_ERR | BM_SR_IRQ);  // clear stale bits
+        outl(bmide + BM_PRDT, prd_phys);
+        int ext = load_taskfile(r->lba, cmd_count);
+        if (write)
+            outb(ATA_COMMAND, ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA);
+        else
+            outb(ATA_COMMAND, ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA);
+        outb(bmide + BM_COMMAND, dir | BM_CMD_START);
+    } else if (r->op == ATA_WRITE) {
+        stats.pio++;
+        int ext = load_taskfile(r->lba, cmd_count);
+        if (ext)
+            outb(ATA_COMMAND, info.multiple ? ATA_CMD_WRITE_MULT_EXT : ATA_CMD_WRITE_EXT);
+        else
+            outb(ATA_COMMAND, info.multiple ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE);
+        // The first block goes out unprompted; each interrupt asks for the next
+        if (pio_write_block()) {
+            ata_reset();
+            complete(-1);
+            return;
+        }
+    } else {
+        stats.pio++;
+        int ext = load_taskfile(r->lba, cmd_count);
+        if (ext)
+            outb(ATA_COMMAND, info.multiple ? ATA_CMD_READ_MULT_EXT : ATA_CMD_READ_EXT);
+        else
+            outb(ATA_COMMAND, info.multiple ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ);
+    }
+    timer_add(&watchdog, ATA_TIMEOUT_TICKS, watchdog_expired, (void *)(seq & 0xFFFFFFu));
+}
+
+static void complete(int status) {
+    struct ata_request *r = active;
+    active = 0;
+    timer_cancel(&watchdog);
+    if (active_dma)
+        outb(bmide + BM_COMMAND, BM_CMD_READ);   // stop the engine
+
+    if (status && r->next) {
+        // A merged command failed: retry its requests one by one, in
+        // order and ahead of everything queued since, so one bad sector
+        // only fails the request that covers it
+        uint32_t flags = irq_save();
+        struct ata_request *last = r;
+        for (struct ata_request *m = r; m; m = m->next) {
+            m->nomerge = 1;
+            last = m;
+        }
+        last->next = q_head;
+        q_head = r;
+        irq_restore(flags);
+        stats.retries++;
+        start_next();
+        return;
+    }
+    if (status)
+        stats.errors++;
+
+    while (r) {
+        struct ata_request *next = r->next;   // the callback may reuse r
+        if (!status)
+            r->done = r->count;
+        r->status = status;
+        if (r->callback)
+            r->callback(r);
+        else
+            wake_up(&r->wait);
+        r = next;
+    }
+    start_next();
+}
+
+/* Software reset after a timeout, so the next command finds the drive idle */
+static void ata_reset(void) {
+    outb(ATA_CTRL, ATA_CTRL_SRST);
+    ata_delay();
+    outb(ATA_CTRL, 0);
+    for (uint32_t spins = 0; (inb(ATA_CTRL) & ATA_SR_BSY) && spins < 100000; spins++)
+        ;
+}
+
+static void ata_bottom_half(void *arg, uint32_t ev) {
+    (void)arg;
+    uint32_t payload = ev & 0xFFFFFFu;
+
+    switch (ev >> 24) {
+    case EV_KICK:
+        if (!active)
+            start_next();
+        break;
+
+    case EV_IRQ:
+        if (!active)
+            break;   // spurious, or the tail of a timed-out command
+        if (active_dma) {
+            // Payload: bus-master status above the drive status
+            uint8_t bm = payload >> 8;
+            if (!(bm & BM_SR_IRQ))
+                break;
+            if ((payload & (ATA_SR_ERR | ATA_SR_DF)) || (bm & BM_SR_ERR)) {
+                complete(-1);
+            } else {
+                complete(0);
+            }
+        } else if (payload & (ATA_SR_ERR | ATA_SR_DF)) {
+            complete(-1);
+        } else if (active->op == ATA_FLUSH) {
+            complete(0);
+        } else if (active->op == ATA_WRITE) {
+            // The drive has taken the previous block
+            if (cmd_done == cmd_count) {
+                complete(0);
+            } else if (pio_write_block()) {
+                ata_reset();
+                complete(-1);
+            } else {
+                timer_add(&watchdog, ATA_TIMEOUT_TICKS, watchdog_expired, (void *)(seq & 0xFFFFFFu));
+            }
+        } else if (payload & ATA_SR_DRQ) {
+            pio_move(block_len(), 0);
+            if (cmd_done == cmd_count)
+                complete(0);
+            else   // the watchdog measures progress, not the whole transfer
+                timer_add(&watchdog, ATA_TIMEOUT_TICKS, watchdog_expired, (void *)(seq & 0xFFFFFFu));
+        }
+        break;
+
+    case EV_TIMEOUT:
+        if (active && payload == (seq & 0xFFFFFFu)) {
+            ata_reset();
+            complete(-1);
+        }
+        break;
+    }
+}
+
+/* Top half: reading the status register acknowledges the drive, writing
+   the bus-master status back clears its interrupt and error bits */
+__attribute__((interrupt))
+static void ide_irq_handler(struct interrupt_frame *f) {
+    (void)f;
+    uint32_t bm = 0;
+    if (bmide) {
+        bm = inb(bmide + BM_STATUS);
+        outb(bmide + BM_STATUS, bm);
+    }
+    defer_queue(ata_bottom_half, 0, EV(EV_IRQ, (bm << 8) | inb(ATA_STATUS)));
+    PIC_sendEOI(ATA_IRQ);
+    defer_irq_exit();
+}
+
+/* ---------- Polled commands, used only by ide_init() ---------- */
+
+/* Wait for BSY to clear; returns the final status, or 0xFF on timeout */
+static uint8_t poll_not_busy(void) {
+    for (uint32_t i = 0; i < POLL_LIMIT; i++) {
+        uint8_t s = inb(ATA_STATUS);
+        if (!(s & ATA_SR_BSY))
+            return s;
+    }
+    return 0xFF;
+}
+
+static int identify(uint16_t id[256]) {
+    outb(ATA_DRIVE, 0xA0);   // select master
+    ata_delay();
+    outb(ATA_COUNT, 0);
+    outb(ATA_LBA0, 0);
+    outb(ATA_LBA1, 0);
+    outb(ATA_LBA2, 0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+    if (inb(ATA_STATUS) == 0)
+        return -1;                          // no device
+
+    uint8_t s = poll_not_busy();
+    if (inb(ATA_LBA1) || inb(ATA_LBA2))
+        return -1;                          // ATAPI/SATA signature, not ATA
+    if (s == 0xFF || (s & (ATA_SR_ERR | ATA_SR_DF)) || !(s & ATA_SR_DRQ))
+        return -1;
+
+    uint16_t *dst = id;
+    uint32_t words = 256;
+    __asm__ __volatile__("cld; rep insw" : "+D"(dst), "+c"(words) : "d"(ATA_DATA) : "memory");
+    return 0;
+}
+
+static int set_multiple(uint32_t n) {
+    outb(ATA_DRIVE, 0xE0);
+    ata_delay();
+    outb(ATA_COUNT, n);
+    outb(ATA_COMMAND, ATA_CMD_SET_MULTIPLE);
+    ata_delay();
+    uint8_t s = poll_not_busy();
+    return (s == 0xFF || (s & (ATA_SR_ERR | ATA_SR_DF))) ? -1 : 0;
+}
+
+/* Bus mastering needs the PIIX (class 01/01) with an I/O BAR4 and a drive
+   that reports DMA support and at least one multiword or Ultra DMA mode.
+   The firmware has already programmed the controller's timings. */
+static void dma_init(const uint16_t id[256]) {
+    const struct pci_device *d = pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE);
+    if (!d || !(d->prog_if & 0x80))   // prog-if bit 7: bus master capable
+        return;
+    if (!(id[49] & (1u << 8)) || !((id[63] & 0x07) || (id[88] & 0x7F)))
+        return;
+    uint16_t base = pci_bar_io(d, 4);
+    uint32_t pa = (uint32_t)(uintptr_t)get_physaddr(prd_table);
+    if (!base || !pa)
+        return;
+
+    pci_enable_bus_master(d);
+    outb(base + BM_COMMAND, 0);
+    outb(base + BM_STATUS, inb(base + BM_STATUS) | BM_SR_DRV0_DMA | BM_SR_ERR | BM_SR_IRQ);
+    prd_phys = pa;
+    bmide = base;
+    info.dma = 1;
+}
+
+int ide_init(void) {
+    outb(ATA_DRIVE, 0xA0);
+    ata_delay();
+    uint8_t status = inb(ATA_STATUS);
+    if (status == 0xFF || status == 0)   // floating bus / nothing there
+        return -1;
+
+    uint16_t id[256];
+    outb(ATA_CTRL, ATA_CTRL_NIEN);   // polled until the handler is in place
+    if (identify(id)) {
+        outb(ATA_CTRL, 0);
+        return -1;
+    }
+
+    // Model: words 27-46, two characters per word, high byte first
+    for (int i = 0; i < 20; i++) {
+        info.model[2 * i] = id[27 + i] >> 8;
+        info.model[2 * i + 1] = id[27 + i] & 0xFF;
+    }
+    int len = 40;
+    while (len && info.model[len - 1] == ' ')
+        len--;
+    info.model[len] = 0;
+
+    info.lba48 = (id[83] >> 10) & 1;
+    if (info.lba48)
+        info.sectors = ((uint64_t)id[103] << 48) | ((uint64_t)id[102] << 32) |
+                       ((uint32_t)id[101] << 16) | id[100];
+    else
+        info.sectors = ((uint32_t)id[61] << 16) | id[60];
+
+    // Word 47 low byte: largest READ MULTIPLE block (0: not supported)
+    uint32_t max_multiple = id[47] & 0xFF;
+    if (max_multiple > 1 && set_multiple(max_multiple) == 0)
+        info.multiple = max_multiple;
+    flush_ext = info.lba48 && ((id[83] >> 13) & 1);
+    dma_init(id);
+
+    idt_install(IRQ_VECTOR(ATA_IRQ), ide_irq_handler);
+    outb(ATA_CTRL, 0);   // nIEN clear: the drive raises IRQ14
+    IRQ_clear_mask(2);   // cascade
+    IRQ_clear_mask(ATA_IRQ);
+    present = 1;
+    return 0;
+}
+
+const struct ide_info *ide_get_info(void) {
+    return present ? &info : 0;
+}
+
+uint32_t ide_max_sectors(void) {
+    uint32_t max = info.lba48 ? ATA_MAX_SECTORS : ATA_MAX_SECTORS_LBA28;
+    if (info.dma && max > ATA_MAX_SECTORS_DMA)   // what one PRD table can always describe
+        max = ATA_MAX_SECTORS_DMA;
+    return max;
+}
+
+void ide_get_stats(struct ide_stats *out) {
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
+
+void ide_submit(struct ata_request *r) {
+    r->next = 0;
+    r->done = 0;
+    r->nomerge = 0;
+    r->wait.head = r->wait.tail = 0;
+    r->status = ATA_PENDING;
+    int bad = r->op == ATA_FLUSH ? !present :
+              !present || !r->count || r->count > ide_max_sectors() ||
+              r->lba >= info.sectors || r->count > info.sectors - r->lba;
+    if (bad) {
+        r->status = -1;
+        if (r->callback)
+            r->callback(r);
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    enqueue(r);
+    if (!plugged)
+        defer_queue(ata_bottom_half, 0, EV(EV_KICK, 0));
+    irq_restore(flags);
+    defer_run();
+}
+
+void ide_plug(void) {
+    uint32_t flags = irq_save();
+    plugged++;
+    irq_restore(flags);
+}
+
+void ide_unplug(void) {
+    uint32_t flags = irq_save();
+    if (--plugged == 0 && q_head)
+        defer_queue(ata_bottom_half, 0, EV(EV_KICK, 0));
+    irq_restore(flags);
+    defer_run();
+}
+
+int ide_wait(struct ata_request *r) {
+    wait_event(&r->wait, r->status != ATA_PENDING);
+    return r->status;
+}
+
+int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors) {
+    uint32_t max = ide_max_sectors();
+    while (numsectors) {
+        uint32_t n = numsectors < max ? numsectors : max;
+        struct ata_request r = { 0 };
+        r.op = ATA_READ;
+        r.lba = lba;
+        r.count = n;
+        r.buf = buffer;
+        ide_submit(&r);
+        if (ide_wait(&r))
+            return -1;
+        lba += n;
+        buffer += n * SECTOR_SIZE;
+        numsectors -= n;
+    }
+    return 0;
+}
+
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors) {
+    uint32_t max = ide_max_sectors();
+    while (numsectors) {
+        uint32_t n = numsectors < max ? numsectors : max;
+        struct ata_request r = { 0 };
+        r.op = ATA_WRITE;
+        r.lba = lba;
+        r.count = n;
+        r.buf = (uint8_t *)buffer;   // only read from
+        ide_submit(&r);
+        if (ide_wait(&r))
+            return -1;
+        lba += n;
+        buffer += n * SECTOR_SIZE;
+        numsectors -= n;
+    }
+    return 0;
+}
+
+int ata_flush(void) {
+    struct ata_request r = { 0 };
+    r.op = ATA_FLUSH;
+    ide_submit(&r);
+    return ide_wait(&r);
+}
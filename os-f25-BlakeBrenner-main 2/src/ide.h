@@ -1,6 +1,117 @@
 #ifndef __IDE_H__
 #define __IDE_H__
 
+#include <stdint.h>
+#include "sched.h"
+
+/* ATA driver for the primary channel master (ports 0x1F0-0x1F7,
+   IRQ14). Requests are queued and run one at a time; the IRQ top half
+   only reads the status register, and a bottom half moves each data
+   block and starts the next request. The CPU is free for other threads
+   while the drive seeks.
+
+   ide_init() issues IDENTIFY DEVICE. Drives with LBA48 get READ SECTORS
+   EXT for addresses past 28 bits and transfers of up to 65536 sectors;
+   drives that support READ MULTIPLE are switched to their largest block
+   size so that one interrupt moves several sectors.
+
+   When PCI enumeration finds a bus-master IDE controller (the PIIX) and
+   the drive supports DMA, requests use READ DMA instead: a PRD table
+   points the controller at the physical frames behind the request's
+   buffer, the drive fills them without the CPU touching the data, and a
+   single interrupt reports the whole transfer. Buffers that are not
+   mapped at submit time (or not writable, for a read) fall back to PIO.
+
+   Queued requests are kept in LBA order and served by a C-LOOK elevator.
+   When a command is started, the requests that continue it on disk in
+   the same direction are merged into it (up to the largest transfer), so
+   neighbouring sectors from different callers cost one command and one
+   interrupt. ide_plug()/ide_unplug() hold back an idle drive while a
+   caller queues a batch, so the batch is sorted and merged as a whole.
+
+   Writes use WRITE SECTORS / WRITE MULTIPLE or WRITE DMA. The drive may
+   hold them in its own cache until an ATA_FLUSH request (FLUSH CACHE)
+   completes; that is the only durability point. */
+
+#define SECTOR_SIZE           512
+#define ATA_MAX_SECTORS       65536u   /* per request with LBA48 (count 0 on the wire) */
+#define ATA_MAX_SECTORS_LBA28 256u
+#define ATA_MAX_SECTORS_DMA   2048u    /* 1 MiB fits one PRD table at any alignment */
+#define ATA_MAX_MERGE         128u     /* requests per command; keeps DMA within one PRD table */
+#define ATA_TIMEOUT_TICKS     (5 * TIMER_HZ)   /* without progress */
+
+#define ATA_PENDING        1                  /* request status while queued/active */
+
+/* ata_request.op */
+#define ATA_READ           0
+#define ATA_WRITE          1
+#define ATA_FLUSH          2                  /* lba, count and buf unused */
+
+struct ata_request {
+    struct ata_request *next;
+    int op;                                   // ATA_READ, ATA_WRITE, ATA_FLUSH
+    uint64_t lba;
+    uint32_t count;                           // sectors, 1..ide_max_sectors()
+    uint8_t *buf;
+    uint32_t done;                            // sectors transferred so far
+    volatile int status;                      // ATA_PENDING, then 0 or -1
+    /* Called from a bottom half on completion; NULL to sleep in
+       ide_wait() instead */
+    void (*callback)(struct ata_request *r);
+    void *priv;
+    struct wait_queue wait;
+    int nomerge;                              // driver-private: retrying alone
+    int barrier;                              // driver-private: starts an elevator segment
+};
+
+/* What IDENTIFY DEVICE reported */
+struct ide_info {
+    char model[41];
+    uint64_t sectors;        // addressable sectors
+    int lba48;
+    uint32_t multiple;       // sectors per READ MULTIPLE block, 0 = not used
+    int dma;                 // bus-master DMA in use
+};
+
+struct ide_stats {
+    uint32_t dma;            // commands started as DMA
+    uint32_t pio;            // commands started as PIO
+    uint32_t flushes;
+    uint32_t merged;         // requests that rode along in another's command
+    uint32_t retries;        // merged commands that failed and were split up
+    uint32_t errors;
+};
+
+/* Probe and identify the drive and enable its interrupt. Returns 0 if an
+   ATA drive answers. */
+int ide_init(void);
+
+/* NULL if there is no drive */
+const struct ide_info *ide_get_info(void);
+
+/* Largest count a single request may carry on this drive */
+uint32_t ide_max_sectors(void);
+
+void ide_get_stats(struct ide_stats *out);
+
+/* Queue a request. It completes with status -1 if there is no drive or it
+   is out of range. */
+void ide_submit(struct ata_request *r);
+
+/* Hold back an idle drive while a batch is queued; nests. The drive is
+   kicked at the outermost ide_unplug(). */
+void ide_plug(void);
+void ide_unplug(void);
+
+/* Sleep until r completes; returns its status */
+int ide_wait(struct ata_request *r);
+
+/* Synchronous read / write of numsectors sectors; 0 on success, -1 on
+   error. A completed write may still sit in the drive's cache. */
 int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+int ata_lba_write(unsigned int lba, const unsigned char *buffer, unsigned int numsectors);
+
+/* FLUSH CACHE: returns once everything written so far is on the media */
+int ata_flush(void);
 
 #endif
@@ -1,19 +1,23 @@
 #include <stdint.h>
 #include "interrupt.h"
+#include "vm.h"
+#include "page.h"
+#include "smp.h"
+#include "sched.h"
+#include "timer.h"
+#include "defer.h"
 
 /* ------------------- Existing globals ------------------- */
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
-struct tss_entry tss_ent;
 
-/* ------------------- Timer + Keyboard Globals ------------------- */
-
-static volatile uint32_t g_ticks = 0;
+/* ------------------- Keyboard Globals ------------------- */
 
 #define KB_BUF_SIZE 128
 static volatile char kb_buf[KB_BUF_SIZE];
 static volatile unsigned kb_head = 0, kb_tail = 0;
+static struct wait_queue kb_wait = WAIT_QUEUE_INIT;
 
 /* ------------------- Enhanced Keyboard State ------------------- */
 
@@ -73,19 +77,11 @@ static void idt_set_gate(uint8_t num,uint32_t base,uint16_t sel,uint8_t flags) {
     idt_entries[num].flags = flags;
 }
 
-/* ------------------- Timer + Keyboard API ------------------- */
-
-void pit_init(uint32_t hz) {
-    if (!hz) return;
-    uint32_t div = 1193182u / hz;
-    outb(0x43,0x36);
-    outb(0x40, div & 0xFF);
-    outb(0x40, (div>>8)&0xFF);
+void idt_install(uint8_t num, void *handler) {
+    idt_set_gate(num, (uint32_t)handler, 0x08, 0x8E);
 }
 
-uint32_t timer_ticks(void) { 
-    return g_ticks; 
-}
+/* ------------------- Keyboard API ------------------- */
 
 int keyboard_getchar(void) {
     if (kb_head == kb_tail) return -1;
@@ -96,9 +92,9 @@ int keyboard_getchar(void) {
 
 char keyboard_read_char(void) {
     int ch;
-    while ((ch = keyboard_getchar()) == -1) { 
-        __asm__ __volatile__("hlt"); // Save power while waiting
-    }
+    // Sleep until the keyboard bottom half has put something in the buffer
+    while ((ch = keyboard_getchar()) == -1)
+        wait_event(&kb_wait, kb_head != kb_tail);
     return (char)ch;
 }
 
@@ -123,18 +119,11 @@ int keyboard_peek_char(void) {
 
 /* ------------------- Interrupt Handlers ------------------- */
 
-__attribute__((interrupt))
-void pit_handler(struct interrupt_frame *f) {
-    (void)f;
-    g_ticks++;
-    PIC_sendEOI(0);
-}
-
-__attribute__((interrupt))
-void keyboard_handler(struct interrupt_frame *f) {
-    (void)f;
-
-    uint8_t sc = inb(0x60);
+/* Bottom half: decode one scancode into the character buffer. Runs with
+   interrupts on; bottom halves are serialized, so it is the only writer. */
+static void keyboard_bottom_half(void *arg, uint32_t data) {
+    (void)arg;
+    uint8_t sc = (uint8_t)data;
 
     /* Handle key releases (scancode >= 0x80) */
     if (sc >= 0x80) {
@@ -148,8 +137,6 @@ void keyboard_handler(struct interrupt_frame *f) {
         if (sc == 0x1D) { /* Ctrl */
             ctrl_pressed = 0;
         }
-        
-        PIC_sendEOI(1);
         return;
     }
 
@@ -158,21 +145,18 @@ void keyboard_handler(struct interrupt_frame *f) {
     /* Shift keys */
     if (sc == 0x2A || sc == 0x36) { /* Left/Right Shift */
         shift_pressed = 1;
-        PIC_sendEOI(1);
         return;
     }
     
     /* Caps Lock toggle */
     if (sc == 0x3A) {
         caps_lock = !caps_lock;
-        PIC_sendEOI(1);
         return;
     }
     
     /* Ctrl key */
     if (sc == 0x1D) {
         ctrl_pressed = 1;
-        PIC_sendEOI(1);
         return;
     }
 
@@ -206,11 +190,19 @@ void keyboard_handler(struct interrupt_frame *f) {
             if (nxt != kb_tail) {
                 kb_buf[kb_head] = c;
                 kb_head = nxt;
+                wake_up(&kb_wait);
             }
         }
     }
-    
+}
+
+/* Top half: grab the scancode and get out */
+__attribute__((interrupt))
+void keyboard_handler(struct interrupt_frame *f) {
+    (void)f;
+    defer_queue(keyboard_bottom_half, 0, inb(0x60));
     PIC_sendEOI(1);
+    defer_irq_exit();
 }
 
 /* ------------------- PIC Functions ------------------- */
@@ -267,6 +259,9 @@ void init_idt() {
     for (int i = 0; i < 256; i++)
         idt_set_gate(i, (uint32_t)stub_isr, 0x08, 0x8E);
 
+    /* Page faults: demand paging for vm_reserve() regions */
+    idt_set_gate(14, (uint32_t)page_fault_handler, 0x08, 0x8E);
+
     /* Hook PIT (IRQ0) + keyboard (IRQ1) */
     idt_set_gate(32, (uint32_t)pit_handler, 0x08, 0x8E);
     idt_set_gate(33, (uint32_t)keyboard_handler, 0x08, 0x8E);
@@ -275,64 +270,113 @@ void init_idt() {
     idt_ptr.limit = sizeof(idt_entries) - 1;
     idt_ptr.base = (uint32_t)&idt_entries;
 
-    /* Load IDT using inline assembly */
+    load_idt();
+}
+
+/* Every CPU shares the one IDT */
+void load_idt(void) {
     __asm__ __volatile__("lidt %0" : : "m"(idt_ptr));
 }
 
 /* ------------------- load_gdt (inline assembly version) ------------------- */
 
-/* GDT structure */
-struct gdt_entry {
-    uint16_t limit_low;
-    uint16_t base_low;
-    uint8_t  base_middle;
-    uint8_t  access;
-    uint8_t  granularity;
-    uint8_t  base_high;
-} __attribute__((packed));
-
-struct gdt_ptr_struct {
-    uint16_t limit;
-    uint32_t base;
-} __attribute__((packed));
-
-/* Simple 3-entry GDT: null, code, data */
-static struct gdt_entry gdt[3] = {
-    {0, 0, 0, 0, 0, 0},                    // Null segment
-    {0xFFFF, 0, 0, 0x9A, 0xCF, 0},        // Code segment
-    {0xFFFF, 0, 0, 0x92, 0xCF, 0}         // Data segment
-};
+static void gdt_set(struct gdt_entry *e, uint32_t base, uint32_t limit,
+                    uint8_t access, uint8_t gran) {
+    e->limit_low   = limit & 0xFFFF;
+    e->base_low    = base & 0xFFFF;
+    e->base_middle = (base >> 16) & 0xFF;
+    e->access      = access;
+    e->granularity = (uint8_t)((gran & 0xF0) | ((limit >> 16) & 0x0F));
+    e->base_high   = (base >> 24) & 0xFF;
+}
 
-static struct gdt_ptr_struct gdt_ptr;
+/* Per-CPU GDT: null, flat code, flat data, a small data segment over the
+   CPU's struct cpu (loaded into %gs), the CPU's TSS and the TSS of its
+   double-fault task */
+void load_gdt_cpu(struct cpu *c) {
+    struct gdt_ptr_struct ptr;
+
+    gdt_set(&c->gdt[0], 0, 0, 0, 0);
+    gdt_set(&c->gdt[1], 0, 0xFFFFF, 0x9A, 0xC0);
+    gdt_set(&c->gdt[2], 0, 0xFFFFF, 0x92, 0xC0);
+    gdt_set(&c->gdt[3], (uint32_t)c, sizeof(*c) - 1, 0x92, 0x40);
+    gdt_set(&c->gdt[4], (uint32_t)&c->tss, sizeof(c->tss) - 1, 0x89, 0x00);
+    gdt_set(&c->gdt[5], (uint32_t)&c->df_tss, sizeof(c->df_tss) - 1, 0x89, 0x00);
+
+    memset((char*)&c->tss, 0, sizeof(c->tss));
+    c->tss.ss0 = GDT_KERNEL_DS;
+    c->tss.esp0 = c->stack_top;
+    c->tss.iomap_base = sizeof(c->tss);   // no I/O bitmap
+
+    ptr.limit = sizeof(c->gdt) - 1;
+    ptr.base = (uint32_t)&c->gdt;
 
-void load_gdt(void) {
-    gdt_ptr.limit = sizeof(gdt) - 1;
-    gdt_ptr.base = (uint32_t)&gdt;
-    
     __asm__ __volatile__(
         "lgdt %0\n"
-        "mov $0x10, %%ax\n"   // Data segment selector
+        "mov %1, %%ax\n"
         "mov %%ax, %%ds\n"
         "mov %%ax, %%es\n"
         "mov %%ax, %%fs\n"
-        "mov %%ax, %%gs\n"
         "mov %%ax, %%ss\n"
-        "ljmp $0x08, $1f\n"   // Far jump to code segment
+        "mov %2, %%ax\n"
+        "mov %%ax, %%gs\n"
+        "ljmp %3, $1f\n"      // Far jump to code segment
         "1:\n"
-        : : "m"(gdt_ptr) : "eax"
+        "mov %4, %%ax\n"
+        "ltr %%ax\n"
+        : : "m"(ptr), "i"(GDT_KERNEL_DS), "i"(GDT_PERCPU), "i"(GDT_KERNEL_CS), "i"(GDT_TSS)
+        : "eax", "memory"
     );
 }
 
+/* A page fault on an overflowed stack cannot push its frame, and neither
+   can the double fault that follows through an ordinary gate, which ends
+   in a triple fault and a reset. So vector 8 is a task gate: the CPU
+   saves the faulting state in c->tss and loads c->df_tss, whose stack is
+   known good. */
+static uint8_t df_stacks[SMP_MAX_CPUS][SMP_DF_STACK_SIZE] __attribute__((aligned(16)));
+
+void df_task_init(struct cpu *c) {
+    struct tss_entry *t = &c->df_tss;
+    uint32_t cr3;
+    __asm__ __volatile__("mov %%cr3, %0" : "=r"(cr3));
+
+    memset((char*)t, 0, sizeof(*t));
+    t->cr3 = cr3;
+    t->eip = (uint32_t)double_fault_task;
+    t->eflags = 0x002;                  // interrupts off
+    t->esp = (uint32_t)&df_stacks[c->id][SMP_DF_STACK_SIZE];
+    t->cs = GDT_KERNEL_CS;
+    t->ds = t->es = t->fs = t->ss = GDT_KERNEL_DS;
+    t->gs = GDT_PERCPU;
+    t->iomap_base = sizeof(*t);
+
+    // Task gate: only the selector counts
+    idt_set_gate(8, 0, GDT_DF_TSS, 0x85);
+}
+
+/* The bootstrap processor is cpus[0]; its stack is the image's .stack */
+void load_gdt(void) {
+    extern char _end_stack;
+    struct cpu *c = &cpus[0];
+
+    c->self = c;
+    c->id = 0;
+    c->online = 1;
+    c->stack_top = (uint32_t)&_end_stack;
+    load_gdt_cpu(c);
+}
+
 /* ------------------- PIC remap ------------------- */
 
 void remap_pic(void) {
     outb(PIC_1_CTRL, 0x11);
     outb(PIC_2_CTRL, 0x11);
 
-    outb(PIC_1_DATA, 0x20);
-    outb(PIC_2_DATA, 0x28);
-    outb(PIC_1_DATA, 0x00);
-    outb(PIC_2_DATA, 0x00);
+    outb(PIC_1_DATA, IRQ_VECTOR(0));
+    outb(PIC_2_DATA, IRQ_VECTOR(8));
+    outb(PIC_1_DATA, 0x04);   /* slave on IRQ2 */
+    outb(PIC_2_DATA, 0x02);   /* cascade identity */
     outb(PIC_1_DATA, 0x01);
     outb(PIC_2_DATA, 0x01);
 
@@ -13,6 +13,9 @@
 #define PIC_1_DATA 0x21
 #define PIC_2_DATA 0xA1
 
+/* IDT vector of PIC line n after remap_pic() */
+#define IRQ_VECTOR(n) (0x20 + (n))
+
 /* Interrupt frame structure */
 struct interrupt_frame {
     uint32_t ip;
@@ -68,6 +71,23 @@ struct tss_entry {
     uint16_t iomap_base;
 } __attribute__((packed));
 
+/* GDT entry structure */
+struct gdt_entry {
+    uint16_t limit_low;
+    uint16_t base_low;
+    uint8_t  base_middle;
+    uint8_t  access;
+    uint8_t  granularity;
+    uint8_t  base_high;
+} __attribute__((packed));
+
+struct gdt_ptr_struct {
+    uint16_t limit;
+    uint32_t base;
+} __attribute__((packed));
+
+struct cpu;
+
 /* Core interrupt functions */
 void PIC_sendEOI(unsigned char irq);
 void IRQ_clear_mask(unsigned char IRQline);
@@ -76,9 +96,18 @@ void init_idt(void);
 void load_gdt(void);
 void remap_pic(void);
 
-/* Timer API */
-void pit_init(uint32_t hz);
-uint32_t timer_ticks(void);
+/* Build and load the per-CPU GDT (code, data, %gs, TSS) of cpu c */
+void load_gdt_cpu(struct cpu *c);
+
+/* Fill in the double-fault task of cpu c and route vector 8 to it. Call
+   on c once its GDT is loaded and paging is on (the task takes CR3). */
+void df_task_init(struct cpu *c);
+
+/* Load the shared IDT on the calling CPU */
+void load_idt(void);
+
+/* Point vector num at an __attribute__((interrupt)) handler */
+void idt_install(uint8_t num, void *handler);
 
 /* Keyboard API - Basic */
 int  keyboard_getchar(void);
@@ -0,0 +1,33 @@
+#ifndef IO_H
+#define IO_H
+
+#include <stdint.h>
+
+/* x86 port I/O. The byte-wide pair is defined in interrupt.c; the wider
+   ones are only ever used by drivers and PCI config access, so they stay
+   inline here. */
+
+void outb(uint16_t port, uint8_t val);
+uint8_t inb(uint16_t port);
+
+static inline void outw(uint16_t port, uint16_t val) {
+    __asm__ __volatile__("outw %0,%1" : : "a"(val), "dN"(port) : "memory");
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    __asm__ __volatile__("outl %0,%1" : : "a"(val), "dN"(port) : "memory");
+}
+
+static inline uint16_t inw(uint16_t port) {
+    uint16_t v;
+    __asm__ __volatile__("inw %1,%0" : "=a"(v) : "dN"(port));
+    return v;
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t v;
+    __asm__ __volatile__("inl %1,%0" : "=a"(v) : "dN"(port));
+    return v;
+}
+
+#endif /* IO_H */
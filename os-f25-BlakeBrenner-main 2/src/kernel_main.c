@@ -4,6 +4,17 @@
 #include "paging.h"
 #include "interrupt.h"
 #include "shell.h"
+#include "multiboot.h"
+#include "smp.h"
+#include "sched.h"
+#include "timer.h"
+#include "clock.h"
+#include "ide.h"
+#include "pci.h"
+#include "blk.h"
+#include "virtio_blk.h"
+#include "disk.h"
+#include "fat.h"
 
 #define VIDEO_ADDR 0xB8000
 #define VGA_WIDTH 80
@@ -39,7 +50,7 @@ static void vga_scroll(void) {
     cursor_y = VGA_HEIGHT - 1;
 }
 
-int putc(int ch) {
+static int vga_putc(int ch) {
     if (ch == '\n') {
         cursor_x = 0;
         cursor_y++;
@@ -94,6 +105,14 @@ int putc(int ch) {
     return ch;
 }
 
+/* Threads print concurrently; keep the cursor update atomic */
+int putc(int ch) {
+    preempt_disable();
+    vga_putc(ch);
+    preempt_enable();
+    return ch;
+}
+
 /* ==================== PAGING HELPERS ==================== */
 
 extern char _end_kernel;
@@ -104,7 +123,10 @@ uint32_t align_down_page(uint32_t x) {
 
 /* ==================== MAIN KERNEL ENTRY POINT ==================== */
 
-void main(void) {
+/* Used when the bootloader gives us no memory information at all */
+static const struct mem_region fallback_region = { 0x00100000u, 15u * 1024u * 1024u };
+
+void main(uint32_t magic, uint32_t mbi_addr) {
     // Clear screen first
     vga_clear();
     
@@ -116,37 +138,97 @@ void main(void) {
     load_gdt();    
     init_idt();    
 
-    /* ---------- paging setup ---------- */
-    esp_printf(putc,"Setting up paging...\n");
+    /* ---------- page-frame allocator ---------- */
+    /* Built before paging so the boot information and the descriptor
+       array can be accessed physically. */
+    esp_printf(putc,"Initializing memory allocator...\n");
+    int nregions = multiboot_parse(magic, mbi_addr);
+    const struct mem_region *regions = multiboot_regions();
+    if (nregions == 0) {
+        esp_printf(putc,"No memory map from bootloader, assuming 16 MiB\n");
+        regions = &fallback_region;
+        nregions = 1;
+    }
+    init_pfa_list(regions, nregions);
 
-    identity_map_range(0x00100000u, (uint32_t)&_end_kernel);
+    /* The MP table sits in low memory / the BIOS ROM; read it physically */
+    smp_detect();
 
-    uint32_t esp_val; 
-    __asm__("mov %%esp,%0":"=r"(esp_val));
-    uint32_t lo = align_down_page(esp_val) - 7*PAGE_SIZE;
-    uint32_t hi = align_down_page(esp_val) + PAGE_SIZE;
-    identity_map_range(lo, hi);
+    /* ---------- paging setup ---------- */
+    esp_printf(putc,"Setting up paging...\n");
 
-    identity_map_range(0x000B8000u, 0x000B8000u + PAGE_SIZE);
+    /* The boot stack lives in the image's .stack section */
+    uint32_t meta_lo, meta_hi;
+    pfa_metadata_range(&meta_lo, &meta_hi);
+
+    /* Low memory and the kernel image, rounded out to 4 MiB. Page 0 stays
+       unmapped so NULL dereferences fault; everything below 1 MiB that is
+       used with paging on lies above it (the AP trampoline at 0x8000,
+       VGA at 0xB8000). The BIOS data area and the MP table are only read
+       by smp_detect(), before paging. */
+    uint32_t low_end = ((uint32_t)&_end_kernel + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+
+    if (identity_map_range(PAGE_SIZE, low_end) ||
+        identity_map_range(meta_lo, meta_hi) ||
+        paging_init_recursive(kernel_pd)) {
+        esp_printf(putc,"Out of memory for page tables, halting.\n");
+        while (1) {
+            __asm__("cli; hlt");
+        }
+    }
 
-    paging_init_recursive(kernel_pd);
     loadPageDirectory(kernel_pd);
     enablePaging();
+    df_task_init(&cpus[0]);
 
     esp_printf(putc,"Paging enabled.\n");
-
-    /* ---------- page-frame allocator ---------- */
-    esp_printf(putc,"Initializing memory allocator...\n");
-    init_pfa_list();
-    esp_printf(putc,"Free frames: %d\n", (int)pfa_free_count());
+    esp_printf(putc,"Free frames: %d / %d (4 KiB)\n",
+               (int)pfa_free_count(), (int)pfa_total_count());
 
     /* ---------- PIT ---------- */
     esp_printf(putc,"Starting timer...\n");
-    pit_init(100);
+    timer_init();
+    clock_init();
+    if (clock_tsc_khz())
+        esp_printf(putc,"TSC: %d kHz\n", (int)clock_tsc_khz());
 
     /* enable interrupts */
     __asm__("sti");
-    esp_printf(putc,"Interrupts enabled.\n\n");
+    esp_printf(putc,"Interrupts enabled.\n");
+
+    /* ---------- application processors ---------- */
+    if (smp_cpu_count() > 1) {
+        esp_printf(putc,"Starting %d application processors...\n", (int)smp_cpu_count() - 1);
+        smp_init();
+    }
+    esp_printf(putc,"CPUs online: %d\n", (int)smp_online_count());
+
+    /* ---------- disk ---------- */
+    esp_printf(putc,"PCI: %d functions\n", pci_init());
+    if (virtio_blk_init() == 0) {
+        const struct virtio_blk_info *vi = virtio_blk_get_info();
+        esp_printf(putc,"virtio-blk: %d MiB, queue %d, irq %d%s\n", (int)(vi->sectors >> 11),
+                   (int)vi->queue_size, (int)vi->irq, vi->ro ? ", read-only" : "");
+    }
+    if (ide_init() == 0) {
+        const struct ide_info *di = ide_get_info();
+        esp_printf(putc,"ATA: %s, %d MiB%s%s\n", di->model, (int)(di->sectors >> 11),
+                   di->lba48 ? ", LBA48" : "", di->dma ? ", DMA" : "");
+    } else
+        esp_printf(putc,"ATA: no drive on the primary channel\n");
+    if (disk_init() == 0)
+        esp_printf(putc,"Disk: %s\n\n", disk_get()->name);
+    else
+        esp_printf(putc,"Disk: none\n\n");
+
+    /* ---------- threads ---------- */
+    sched_init("shell");
+    if (blk_init() == 0) {
+        if (fatInit() == 0)
+            esp_printf(putc,"FAT16 volume mounted\n");
+        else
+            esp_printf(putc,"FAT: no FAT16 volume on the disk\n");
+    }
 
     /* ---------- shell ---------- */
     shell_run();
@@ -155,4 +237,4 @@ void main(void) {
     while (1) {
         __asm__("hlt");
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,245 @@
+#include "kmalloc.h"
+#include "page.h"
+#include "paging.h"
+#include "sched.h"
+
+_Static_assert(CONFIG_HEAP_SIZE % PAGE_SIZE == 0, "CONFIG_HEAP_SIZE must be a multiple of 4 KiB");
+
+#define SLAB_MAGIC  0x51AB0000u
+#define LARGE_MAGIC 0x1A26E000u
+
+/* Header at the start of every heap page (slab) or page run (large) */
+struct heap_page {
+    uint32_t magic;
+    uint32_t cls;          // size class, or block order for large allocations
+    struct ppage *block;   // backing buddy block (NULL for the static arena)
+    uint32_t reserved;
+};
+#define HDR_SIZE ((uint32_t)sizeof(struct heap_page))
+
+/* Sizes are chosen so each class packs a 4 KiB page minus the header */
+static const uint32_t class_size[KMALLOC_NCLASSES] = {
+    16, 32, 64, 128, 256, 504, 1016, 2040
+};
+
+struct free_chunk {
+    struct free_chunk *next;
+};
+
+static struct free_chunk *class_free[KMALLOC_NCLASSES];
+static uint32_t class_pages[KMALLOC_NCLASSES];
+static uint32_t class_in_use[KMALLOC_NCLASSES];
+static uint32_t class_free_count[KMALLOC_NCLASSES];
+
+/* Initial arena: used before any frame is pulled from the page allocator */
+static uint8_t heap_initial[CONFIG_HEAP_SIZE] __attribute__((aligned(4096)));
+static uint32_t initial_used = 0;
+
+/* Heap VA grows upward from KHEAP_BASE; freed large runs are recycled by order */
+static uint32_t heap_brk = KHEAP_BASE;
+static uint32_t large_pages = 0;
+
+struct va_span {
+    struct va_span *next;
+    uint32_t va;
+};
+static struct va_span *large_va_free[PFA_MAX_ORDER];
+
+/* ---------- Virtual address space ---------- */
+
+static uint32_t va_reserve(unsigned int order) {
+    struct va_span *s = large_va_free[order];
+    if (s) {
+        large_va_free[order] = s->next;
+        uint32_t va = s->va;
+        kfree(s);
+        return va;
+    }
+
+    uint32_t bytes = PAGE_SIZE << order;
+    if (KHEAP_LIMIT - heap_brk < bytes)
+        return 0;
+    uint32_t va = heap_brk;
+    heap_brk += bytes;
+    return va;
+}
+
+static void va_release(uint32_t va, unsigned int order) {
+    struct va_span *s = kmalloc(sizeof(*s));
+    if (!s)
+        return;   // the VA range is leaked, the frames are not
+    s->va = va;
+    s->next = large_va_free[order];
+    large_va_free[order] = s;
+}
+
+/* Map every frame of a buddy block at va in one batch */
+static int map_block(uint32_t va, struct ppage *blk) {
+    return map_range(va, (uint32_t)blk->physical_addr, PAGE_SIZE << blk->order, 0x003);
+}
+
+/* Get a fresh, mapped run of (1 << order) heap pages */
+static struct heap_page *heap_pages_alloc(unsigned int order) {
+    if (order == 0 && initial_used + PAGE_SIZE <= CONFIG_HEAP_SIZE) {
+        struct heap_page *hp = (struct heap_page *)&heap_initial[initial_used];
+        initial_used += PAGE_SIZE;
+        hp->block = NULL;
+        return hp;
+    }
+
+    struct ppage *blk = pfa_alloc_block(order);
+    if (!blk)
+        return NULL;
+
+    uint32_t va = va_reserve(order);
+    if (!va) {
+        pfa_free_block(blk);
+        return NULL;
+    }
+    if (map_block(va, blk)) {
+        va_release(va, order);
+        pfa_free_block(blk);
+        return NULL;
+    }
+
+    struct heap_page *hp = (struct heap_page *)va;
+    hp->block = blk;
+    return hp;
+}
+
+/* ---------- Size classes ---------- */
+
+static int size_to_class(uint32_t size) {
+    for (int c = 0; c < KMALLOC_NCLASSES; c++)
+        if (size <= class_size[c])
+            return c;
+    return -1;
+}
+
+static int class_refill(int cls) {
+    struct heap_page *hp = heap_pages_alloc(0);
+    if (!hp)
+        return -1;
+
+    hp->magic = SLAB_MAGIC;
+    hp->cls = (uint32_t)cls;
+    hp->reserved = 0;
+
+    uint32_t sz = class_size[cls];
+    uint8_t *obj = (uint8_t *)hp + HDR_SIZE;
+    uint8_t *end = (uint8_t *)hp + PAGE_SIZE;
+    for (; obj + sz <= end; obj += sz) {
+        struct free_chunk *fc = (struct free_chunk *)obj;
+        fc->next = class_free[cls];
+        class_free[cls] = fc;
+        class_free_count[cls]++;
+    }
+    class_pages[cls]++;
+    return 0;
+}
+
+/* ---------- Public API ---------- */
+
+static void *heap_alloc(uint32_t size) {
+    if (size == 0)
+        return NULL;
+
+    int cls = size_to_class(size);
+    if (cls >= 0) {
+        if (!class_free[cls] && class_refill(cls))
+            return NULL;
+        struct free_chunk *fc = class_free[cls];
+        class_free[cls] = fc->next;
+        class_free_count[cls]--;
+        class_in_use[cls]++;
+        return fc;
+    }
+
+    // Large: a dedicated buddy block, header in its first page
+    if (size > (PAGE_SIZE << (PFA_MAX_ORDER - 1)) - HDR_SIZE)
+        return NULL;
+    unsigned int order = 0;
+    while ((PAGE_SIZE << order) < size + HDR_SIZE)
+        order++;
+
+    struct heap_page *hp = heap_pages_alloc(order);
+    if (!hp)
+        return NULL;
+    hp->magic = LARGE_MAGIC;
+    hp->cls = order;
+    hp->reserved = 0;
+    large_pages += 1u << order;
+    return (uint8_t *)hp + HDR_SIZE;
+}
+
+static void heap_free(void *ptr) {
+    if (!ptr)
+        return;
+
+    struct heap_page *hp = (struct heap_page *)((uint32_t)ptr & ~(PAGE_SIZE - 1u));
+
+    if (hp->magic == SLAB_MAGIC) {
+        int cls = (int)hp->cls;
+        struct free_chunk *fc = (struct free_chunk *)ptr;
+        fc->next = class_free[cls];
+        class_free[cls] = fc;
+        class_free_count[cls]++;
+        class_in_use[cls]--;
+        return;
+    }
+
+    if (hp->magic == LARGE_MAGIC) {
+        unsigned int order = hp->cls;
+        struct ppage *blk = hp->block;
+        uint32_t va = (uint32_t)hp;
+
+        hp->magic = 0;
+        unmap_range(va, PAGE_SIZE << order);
+        pfa_free_block(blk);
+        va_release(va, order);
+        large_pages -= 1u << order;
+    }
+}
+
+/* The free lists and heap page tables are not reentrant: no thread switch
+   while they are being changed */
+void *kmalloc(uint32_t size) {
+    preempt_disable();
+    void *p = heap_alloc(size);
+    preempt_enable();
+    return p;
+}
+
+void kfree(void *ptr) {
+    preempt_disable();
+    heap_free(ptr);
+    preempt_enable();
+}
+
+uint32_t ksize(void *ptr) {
+    if (!ptr)
+        return 0;
+    struct heap_page *hp = (struct heap_page *)((uint32_t)ptr & ~(PAGE_SIZE - 1u));
+    if (hp->magic == SLAB_MAGIC)
+        return class_size[hp->cls];
+    if (hp->magic == LARGE_MAGIC)
+        return (PAGE_SIZE << hp->cls) - HDR_SIZE;
+    return 0;
+}
+
+void kmalloc_class_stats(int cls, struct kmalloc_class_stats *out) {
+    if (cls < 0 || cls >= KMALLOC_NCLASSES)
+        return;
+    out->size   = class_size[cls];
+    out->pages  = class_pages[cls];
+    out->in_use = class_in_use[cls];
+    out->free   = class_free_count[cls];
+}
+
+uint32_t kmalloc_large_pages(void) {
+    return large_pages;
+}
+
+uint32_t kmalloc_heap_top(void) {
+    return heap_brk;
+}
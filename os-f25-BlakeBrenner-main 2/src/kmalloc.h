@@ -0,0 +1,40 @@
+#ifndef KMALLOC_H
+#define KMALLOC_H
+
+#include <stdint.h>
+
+/* Kernel heap. Small requests are served from segregated size classes
+   carved out of 4 KiB slab pages; requests larger than the biggest class
+   get a physically contiguous buddy block of their own. The heap starts
+   with a static CONFIG_HEAP_SIZE arena and grows by mapping frames from
+   the page allocator at KHEAP_BASE. Requires paging to be enabled. */
+
+#ifndef CONFIG_HEAP_SIZE
+#define CONFIG_HEAP_SIZE 4096
+#endif
+
+#define KHEAP_BASE   0xD0000000u
+#define KHEAP_LIMIT  0xE0000000u
+
+#define KMALLOC_NCLASSES 8
+
+struct kmalloc_class_stats {
+    uint32_t size;        // object size of this class
+    uint32_t pages;       // slab pages owned by the class
+    uint32_t in_use;      // live objects
+    uint32_t free;        // objects on the free list
+};
+
+void *kmalloc(uint32_t size);
+void  kfree(void *ptr);
+
+/* Usable size of an allocation returned by kmalloc() */
+uint32_t ksize(void *ptr);
+
+void kmalloc_class_stats(int cls, struct kmalloc_class_stats *out);
+
+/* Large (page-backed) allocations currently live, and heap VA in use */
+uint32_t kmalloc_large_pages(void);
+uint32_t kmalloc_heap_top(void);
+
+#endif /* KMALLOC_H */
@@ -0,0 +1,74 @@
+#include "multiboot.h"
+
+/* Copied out of the boot information so that GRUB's structure can be
+   overwritten once the frame allocator starts handing out memory. */
+static struct mem_region regions[MEM_REGION_MAX];
+static int nregions = 0;
+
+static void add_region(uint64_t addr, uint64_t len) {
+    const uint64_t limit = 0x100000000ULL;   // only the 32-bit physical space is reachable
+
+    if (addr >= limit || len == 0 || nregions >= MEM_REGION_MAX)
+        return;
+    if (addr + len > limit)
+        len = limit - addr;
+
+    // Trim to whole 4 KiB frames
+    uint64_t start = (addr + 0xFFFu) & ~0xFFFULL;
+    uint64_t end   = (addr + len) & ~0xFFFULL;
+    if (end <= start)
+        return;
+    if (end == limit)
+        end -= 0x1000u;   // keep base + length representable in 32 bits
+
+    regions[nregions].base   = (uint32_t)start;
+    regions[nregions].length = (uint32_t)(end - start);
+    nregions++;
+}
+
+int multiboot_parse(uint32_t magic, uint32_t mbi_addr) {
+    nregions = 0;
+    if (magic != MULTIBOOT2_BOOTLOADER_MAGIC || !mbi_addr)
+        return 0;
+
+    struct multiboot_tag_basic_meminfo *meminfo = 0;
+    int have_mmap = 0;
+
+    // Tags follow the 8-byte fixed part (total_size, reserved)
+    uint32_t total = *(uint32_t *)mbi_addr;
+    uint32_t p = mbi_addr + 8;
+    while (p < mbi_addr + total) {
+        struct multiboot_tag *tag = (struct multiboot_tag *)p;
+        if (tag->type == MULTIBOOT_TAG_TYPE_END)
+            break;
+
+        if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
+            struct multiboot_tag_mmap *mm = (struct multiboot_tag_mmap *)tag;
+            uint32_t e = (uint32_t)mm->entries;
+            for (; e + mm->entry_size <= p + tag->size; e += mm->entry_size) {
+                struct multiboot_mmap_entry *ent = (struct multiboot_mmap_entry *)e;
+                if (ent->type == MULTIBOOT_MEMORY_AVAILABLE)
+                    add_region(ent->addr, ent->len);
+            }
+            have_mmap = 1;
+        } else if (tag->type == MULTIBOOT_TAG_TYPE_BASIC_MEMINFO) {
+            meminfo = (struct multiboot_tag_basic_meminfo *)tag;
+        }
+
+        p += (tag->size + 7u) & ~7u;
+    }
+
+    if (!have_mmap && meminfo) {
+        add_region(0, (uint64_t)meminfo->mem_lower * 1024u);
+        add_region(0x100000u, (uint64_t)meminfo->mem_upper * 1024u);
+    }
+    return nregions;
+}
+
+const struct mem_region *multiboot_regions(void) {
+    return regions;
+}
+
+int multiboot_region_count(void) {
+    return nregions;
+}
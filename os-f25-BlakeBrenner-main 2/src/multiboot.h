@@ -0,0 +1,62 @@
+#ifndef MULTIBOOT_H
+#define MULTIBOOT_H
+
+#include <stdint.h>
+
+/* Value GRUB leaves in EAX when it hands control to a multiboot2 kernel */
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36D76289u
+
+/* Boot information tag types we care about */
+#define MULTIBOOT_TAG_TYPE_END          0
+#define MULTIBOOT_TAG_TYPE_BASIC_MEMINFO 4
+#define MULTIBOOT_TAG_TYPE_MMAP         6
+
+/* Memory map entry types */
+#define MULTIBOOT_MEMORY_AVAILABLE      1
+
+/* Every tag starts with this header and is padded to 8 bytes */
+struct multiboot_tag {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct multiboot_tag_basic_meminfo {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mem_lower;   // KiB below 1 MiB
+    uint32_t mem_upper;   // KiB above 1 MiB
+};
+
+struct multiboot_mmap_entry {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t zero;
+} __attribute__((packed));
+
+struct multiboot_tag_mmap {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot_mmap_entry entries[];
+};
+
+/* A usable span of physical RAM below 4 GiB */
+struct mem_region {
+    uint32_t base;
+    uint32_t length;
+};
+
+#define MEM_REGION_MAX 32
+
+/* Walk the boot information at mbi_addr and record usable RAM.
+   Falls back to the basic meminfo tag when there is no memory map.
+   Returns the number of regions found (0 if the boot info is unusable). */
+int multiboot_parse(uint32_t magic, uint32_t mbi_addr);
+
+/* Regions recorded by multiboot_parse() */
+const struct mem_region *multiboot_regions(void);
+int multiboot_region_count(void);
+
+#endif /* MULTIBOOT_H */
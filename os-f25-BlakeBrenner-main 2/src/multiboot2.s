@@ -8,8 +8,37 @@ multiboot2_header_start:
     dd multiboot2_header_end - multiboot2_header_start
     dd -(0xE85250D6 + 0 + (multiboot2_header_end - multiboot2_header_start))
 
+    ; Information request tag: ask for the memory map and basic meminfo
+    align 8
+    dw 1    ; type
+    dw 1    ; flags (optional: boot even if a tag is unavailable)
+    dd 16   ; size
+    dd 6    ; MULTIBOOT_TAG_TYPE_MMAP
+    dd 4    ; MULTIBOOT_TAG_TYPE_BASIC_MEMINFO
+
     ; End tag
+    align 8
     dw 0    ; type
     dw 0    ; flags
     dd 8    ; size
-multiboot2_header_end:
\ No newline at end of file
+multiboot2_header_end:
+
+; Kernel entry point. GRUB leaves the multiboot2 magic in EAX and the
+; physical address of the boot information in EBX; pass both to main().
+section .text
+    [BITS 32]
+    global _start
+    extern main
+_start:
+    mov esp, stack_top
+    push ebx                     ; mbi_addr
+    push eax                     ; magic
+    call main
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+section .stack nobits alloc write align=16
+    resb 16384
+stack_top:
@@ -1,10 +1,37 @@
 #include "page.h"
+#include "paging.h"
+#include "multiboot.h"
+#include "spinlock.h"
+#include "sched.h"
 
-// Static descriptor array (128 * 2 MiB = 256 MiB of pages)
-static struct ppage physical_page_array[128];
+extern char _end_kernel;
 
-// Global free list head
-struct ppage *free_list_head = NULL;
+// Nothing below 1 MiB (IVT, BIOS data, VGA, option ROMs) is handed out
+#define PFA_LOW_LIMIT 0x100000u
+
+// Descriptor array, one entry per 4 KiB frame from pfa_base_pfn up to the
+// top of usable RAM. It is carved out of RAM right after the kernel image,
+// so its size scales with installed memory.
+static struct ppage *physical_page_array = NULL;
+static uint32_t pfa_base_pfn = 0;
+static uint32_t pfa_nframes = 0;
+static uint32_t pfa_usable = 0;
+static uint32_t meta_start = 0, meta_end = 0;
+
+// Per-order free lists of block heads
+static struct ppage *free_area[PFA_MAX_ORDER];
+static unsigned int free_area_count[PFA_MAX_ORDER];
+static unsigned int free_frames = 0;
+
+// Order-0 frames already cleared by the idle loop. They are off the buddy
+// lists but still count as free; allocations fall back to them (and, for
+// larger orders, give them back) before reporting out of memory.
+static struct ppage *zero_pool = NULL;
+static unsigned int zero_pool_count = 0;
+
+// Guards the free lists, the zero pool and reference counts. Interrupts
+// stay off while it is held so the fault handler can allocate.
+static spinlock_t pfa_lock = SPINLOCK_INIT;
 
 /* ---------- Internal helpers ---------- */
 
@@ -16,42 +43,302 @@ static void list_push_front(struct ppage **head, struct ppage *node) {
     *head = node;
 }
 
-static struct ppage *list_pop_front(struct ppage **head) {
-    if (!*head)
-        return NULL;
-    struct ppage *n = *head;
-    *head = n->next;
-    if (*head)
-        (*head)->prev = NULL;
-    n->next = n->prev = NULL;
-    return n;
+static void list_remove(struct ppage **head, struct ppage *node) {
+    if (node->prev)
+        node->prev->next = node->next;
+    else
+        *head = node->next;
+    if (node->next)
+        node->next->prev = node->prev;
+    node->next = node->prev = NULL;
+}
+
+static inline unsigned int page_index(struct ppage *pp) {
+    return (unsigned int)(pp - physical_page_array);
+}
+
+static void free_area_add(struct ppage *pp, unsigned int order) {
+    pp->order = (uint8_t)order;
+    pp->flags |= PPAGE_FREE;
+    list_push_front(&free_area[order], pp);
+    free_area_count[order]++;
+    free_frames += 1u << order;
+}
+
+static void free_area_del(struct ppage *pp, unsigned int order) {
+    list_remove(&free_area[order], pp);
+    pp->flags &= ~PPAGE_FREE;
+    free_area_count[order]--;
+    free_frames -= 1u << order;
 }
 
-static struct ppage *list_tail(struct ppage *head) {
-    while (head && head->next)
-        head = head->next;
-    return head;
+static inline uint32_t align_up(uint32_t x, uint32_t a) { return (x + a - 1u) & ~(a - 1u); }
+
+/* Hand frames [s, e) (physical frame numbers) to the free lists as the
+   largest naturally aligned blocks that fit. */
+static void seed_range(uint32_t s, uint32_t e) {
+    while (s < e) {
+        uint32_t idx = s - pfa_base_pfn;
+        unsigned int order = PFA_MAX_ORDER - 1;
+        while (order && ((idx & ((1u << order) - 1)) || s + (1u << order) > e))
+            order--;
+        free_area_add(&physical_page_array[idx], order);
+        pfa_usable += 1u << order;
+        s += 1u << order;
+    }
 }
 
-static unsigned int list_length(struct ppage *head) {
-    unsigned int count = 0;
-    while (head) {
-        count++;
-        head = head->next;
+/* Pick a spot for nbytes of descriptors: right after the kernel if that lies
+   in usable RAM, otherwise the first usable region above it that fits. */
+static uint32_t place_metadata(const struct mem_region *regions, int nregions,
+                               uint32_t kernel_end, uint32_t nbytes) {
+    for (int i = 0; i < nregions; i++) {
+        uint32_t rs = regions[i].base;
+        uint32_t re = regions[i].base + regions[i].length;
+        uint32_t cand = rs > kernel_end ? align_up(rs, PFA_PAGE_BYTES) : kernel_end;
+        if (cand >= rs && cand < re && re - cand >= nbytes)
+            return cand;
     }
-    return count;
+    return 0;
 }
 
 /* ---------- Public API ---------- */
 
-void init_pfa_list(void) {
-    free_list_head = NULL;
-    for (unsigned int i = 0; i < (sizeof(physical_page_array) / sizeof(physical_page_array[0])); ++i) {
+void init_pfa_list(const struct mem_region *regions, int nregions) {
+    for (unsigned int k = 0; k < PFA_MAX_ORDER; ++k) {
+        free_area[k] = NULL;
+        free_area_count[k] = 0;
+    }
+    free_frames = 0;
+    pfa_usable = 0;
+    pfa_nframes = 0;
+
+    // Span of usable RAM above the low-memory cutoff
+    uint32_t lo = 0xFFFFFFFFu, hi = 0;
+    for (int i = 0; i < nregions; i++) {
+        uint32_t rs = regions[i].base;
+        uint32_t re = regions[i].base + regions[i].length;
+        if (re <= PFA_LOW_LIMIT)
+            continue;
+        if (rs < PFA_LOW_LIMIT)
+            rs = PFA_LOW_LIMIT;
+        if (rs < lo) lo = rs;
+        if (re > hi) hi = re;
+    }
+    if (hi <= lo)
+        return;
+
+    // Index from a max-order boundary so buddy pairs are physically aligned
+    pfa_base_pfn = (lo >> 12) & ~((1u << (PFA_MAX_ORDER - 1)) - 1);
+    pfa_nframes = (hi >> 12) - pfa_base_pfn;
+
+    uint32_t kernel_end = align_up((uint32_t)&_end_kernel, PFA_PAGE_BYTES);
+    uint32_t meta_bytes = align_up(pfa_nframes * sizeof(struct ppage), PFA_PAGE_BYTES);
+    meta_start = place_metadata(regions, nregions, kernel_end, meta_bytes);
+    if (!meta_start) {
+        pfa_nframes = 0;
+        return;
+    }
+    meta_end = meta_start + meta_bytes;
+    physical_page_array = (struct ppage *)meta_start;
+
+    // Every frame starts out reserved; only usable RAM is seeded below
+    for (uint32_t i = 0; i < pfa_nframes; ++i) {
         struct ppage *pp = &physical_page_array[i];
         pp->next = pp->prev = NULL;
-        pp->physical_addr = (void *)(uintptr_t)(i * (uintptr_t)PFA_PAGE_BYTES);
-        list_push_front(&free_list_head, pp);
+        pp->physical_addr = (void *)(uintptr_t)((pfa_base_pfn + i) << 12);
+        pp->order = 0;
+        pp->flags = 0;
+        pp->refcount = 0;
+    }
+
+    // Seed usable RAM, skipping low memory + the kernel image and the descriptors
+    for (int i = 0; i < nregions; i++) {
+        uint32_t rs = regions[i].base;
+        uint32_t re = regions[i].base + regions[i].length;
+        if (rs < kernel_end) rs = kernel_end;
+        if (re <= rs)
+            continue;
+
+        if (meta_start < re && meta_end > rs) {
+            if (rs < meta_start)
+                seed_range(rs >> 12, meta_start >> 12);
+            if (meta_end < re)
+                seed_range(meta_end >> 12, re >> 12);
+        } else {
+            seed_range(rs >> 12, re >> 12);
+        }
+    }
+}
+
+void pfa_metadata_range(uint32_t *start, uint32_t *end) {
+    *start = meta_start;
+    *end = meta_end;
+}
+
+static struct ppage *zero_pool_pop(void) {
+    struct ppage *pp = zero_pool;
+    if (pp) {
+        zero_pool = pp->next;
+        zero_pool_count--;
+        pp->next = NULL;
+    }
+    return pp;
+}
+
+static void buddy_free(struct ppage *block);
+
+static struct ppage *buddy_alloc(unsigned int order) {
+    if (order >= PFA_MAX_ORDER)
+        return NULL;
+
+    // Find the smallest non-empty order that can satisfy the request
+    unsigned int k = order;
+    while (k < PFA_MAX_ORDER && !free_area[k])
+        k++;
+    if (k == PFA_MAX_ORDER) {
+        if (!zero_pool)
+            return NULL;
+        if (order == 0)
+            return zero_pool_pop();
+        // Pre-cleared frames may be what keeps a larger block from forming
+        while (zero_pool)
+            buddy_free(zero_pool_pop());
+        return buddy_alloc(order);
     }
+
+    struct ppage *pp = free_area[k];
+    free_area_del(pp, k);
+
+    // Split down, returning the upper halves to the free lists
+    while (k > order) {
+        k--;
+        free_area_add(&physical_page_array[page_index(pp) + (1u << k)], k);
+    }
+
+    pp->order = (uint8_t)order;
+    pp->refcount = 1;
+    pp->next = pp->prev = NULL;
+    return pp;
+}
+
+static void buddy_free(struct ppage *block) {
+    if (!block || (block->flags & PPAGE_FREE))
+        return;
+
+    unsigned int idx = page_index(block);
+    unsigned int order = block->order;
+    block->refcount = 0;
+
+    // Coalesce with the buddy while it heads a free block of the same order
+    while (order + 1 < PFA_MAX_ORDER) {
+        unsigned int buddy_idx = idx ^ (1u << order);
+        if (buddy_idx >= pfa_nframes)
+            break;
+        struct ppage *buddy = &physical_page_array[buddy_idx];
+        if (!(buddy->flags & PPAGE_FREE) || buddy->order != order)
+            break;
+        free_area_del(buddy, order);
+        idx &= ~(1u << order);
+        order++;
+    }
+
+    free_area_add(&physical_page_array[idx], order);
+}
+
+struct ppage *pfa_alloc_block(unsigned int order) {
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    struct ppage *pp = buddy_alloc(order);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+    return pp;
+}
+
+void pfa_free_block(struct ppage *block) {
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    buddy_free(block);
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+struct ppage *pfa_alloc_frame(unsigned int flags) {
+    struct ppage *pp = NULL;
+    uint32_t irq = spin_lock_irqsave(&pfa_lock);
+    if (flags & PFA_ZERO)
+        pp = zero_pool_pop();
+    int dirty = !pp;
+    if (!pp)
+        pp = buddy_alloc(0);
+    spin_unlock_irqrestore(&pfa_lock, irq);
+
+    if (pp && dirty && (flags & PFA_ZERO)) {
+        // The slot belongs to this CPU: stay on it, and keep other
+        // threads here out of it, until it is unmapped
+        preempt_disable();
+        void *va = kmap(pp->physical_addr, KMAP_SLOT_ZERO);
+        if (va) {
+            page_clear(va);
+            kunmap(KMAP_SLOT_ZERO);
+        }
+        preempt_enable();
+        if (!va) {
+            pfa_free_block(pp);
+            return NULL;
+        }
+    }
+    return pp;
+}
+
+int pfa_zero_idle(void) {
+    // Only take frames that are already loose on the order-0 list:
+    // splitting a larger block here would fragment memory that a
+    // multi-page allocation could have used, just to fill the pool
+    uint32_t irq = spin_lock_irqsave(&pfa_lock);
+    struct ppage *pp = NULL;
+    if (zero_pool_count < PFA_ZERO_POOL_TARGET && free_area[0])
+        pp = buddy_alloc(0);
+    spin_unlock_irqrestore(&pfa_lock, irq);
+    if (!pp)
+        return 0;
+
+    // Cleared without the lock held; the frame is ours until it is pooled.
+    // Not preemptible meanwhile, as in pfa_alloc_frame()
+    preempt_disable();
+    void *va = kmap(pp->physical_addr, KMAP_SLOT_ZERO_IDLE);
+    if (va) {
+        page_clear(va);
+        kunmap(KMAP_SLOT_ZERO_IDLE);
+    }
+    preempt_enable();
+    if (!va) {
+        pfa_free_block(pp);
+        return 0;
+    }
+
+    irq = spin_lock_irqsave(&pfa_lock);
+    pp->next = zero_pool;
+    zero_pool = pp;
+    zero_pool_count++;
+    spin_unlock_irqrestore(&pfa_lock, irq);
+    return 1;
+}
+
+void pfa_get(struct ppage *block) {
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    if (block && !(block->flags & PPAGE_FREE))
+        block->refcount++;
+    spin_unlock_irqrestore(&pfa_lock, flags);
+}
+
+unsigned int pfa_put(struct ppage *block) {
+    unsigned int left = 0;
+    uint32_t flags = spin_lock_irqsave(&pfa_lock);
+    if (block && !(block->flags & PPAGE_FREE)) {
+        if (block->refcount > 1)
+            left = --block->refcount;
+        else
+            buddy_free(block);
+    }
+    spin_unlock_irqrestore(&pfa_lock, flags);
+    return left;
 }
 
 struct ppage *allocate_physical_pages(unsigned int npages) {
@@ -60,41 +347,70 @@ struct ppage *allocate_physical_pages(unsigned int npages) {
 
     struct ppage *alloc_head = NULL;
     struct ppage *alloc_tail = NULL;
+    unsigned int order = PFA_MAX_ORDER - 1;
 
-    for (unsigned int i = 0; i < npages; ++i) {
-        struct ppage *page = list_pop_front(&free_list_head);
-        if (!page) {
-            // Roll back already allocated pages
-            if (alloc_head)
+    // Carve npages into the largest blocks available, falling back to
+    // smaller orders when the free lists are fragmented
+    while (npages) {
+        while ((1u << order) > npages)
+            order--;
+
+        struct ppage *block = pfa_alloc_block(order);
+        if (!block) {
+            if (order == 0) {
+                // Roll back already allocated blocks
                 free_physical_pages(alloc_head);
-            return NULL;
+                return NULL;
+            }
+            order--;
+            continue;
         }
 
         if (!alloc_head)
-            alloc_head = alloc_tail = page;
+            alloc_head = alloc_tail = block;
         else {
-            alloc_tail->next = page;
-            page->prev = alloc_tail;
-            alloc_tail = page;
+            alloc_tail->next = block;
+            block->prev = alloc_tail;
+            alloc_tail = block;
         }
+        npages -= 1u << order;
     }
 
     return alloc_head;
 }
 
 void free_physical_pages(struct ppage *ppage_list) {
-    if (!ppage_list)
-        return;
-
-    struct ppage *tail = list_tail(ppage_list);
-    tail->next = free_list_head;
-    if (free_list_head)
-        free_list_head->prev = tail;
+    while (ppage_list) {
+        struct ppage *next = ppage_list->next;
+        ppage_list->next = ppage_list->prev = NULL;
+        pfa_free_block(ppage_list);
+        ppage_list = next;
+    }
+}
 
-    ppage_list->prev = NULL;
-    free_list_head = ppage_list;
+struct ppage *pfa_page_of(void *physaddr) {
+    uint32_t pfn = (uint32_t)(uintptr_t)physaddr >> 12;
+    if (pfn < pfa_base_pfn || pfn - pfa_base_pfn >= pfa_nframes)
+        return NULL;
+    return &physical_page_array[pfn - pfa_base_pfn];
 }
 
 unsigned int pfa_free_count(void) {
-    return list_length(free_list_head);
+    return free_frames + zero_pool_count;
+}
+
+unsigned int pfa_zeroed_count(void) {
+    return zero_pool_count;
+}
+
+unsigned int pfa_total_count(void) {
+    return pfa_usable;
+}
+
+unsigned int pfa_free_blocks(unsigned int order) {
+    return order < PFA_MAX_ORDER ? free_area_count[order] : 0;
+}
+
+struct ppage *pfa_free_list(unsigned int order) {
+    return order < PFA_MAX_ORDER ? free_area[order] : NULL;
 }
@@ -4,29 +4,90 @@
 #include <stddef.h>   // for size_t, NULL
 #include <stdint.h>   // for uintptr_t, uint32_t
 
-// Each page is 2 MiB
-#define PFA_PAGE_BYTES (2u * 1024u * 1024u)
+// Each page is one 4 KiB frame
+#define PFA_PAGE_BYTES 4096u
+
+// Number of buddy orders: a block of order k spans (1 << k) contiguous frames.
+// The largest block (order 10) is 4 MiB.
+#define PFA_MAX_ORDER 11
+
+// ppage.flags
+#define PPAGE_FREE 0x01   // descriptor heads a block on a free list
+
+// pfa_alloc_frame() flags
+#define PFA_ZERO 0x01     // frame contents must be cleared
+
+// Frames kept pre-cleared by pfa_zero_idle()
+#define PFA_ZERO_POOL_TARGET 64
 
 // Page descriptor structure
 struct ppage {
     struct ppage *next;   // next page in list
     struct ppage *prev;   // previous page in list
     void *physical_addr;  // physical start address of this page
+    uint8_t order;        // block order (valid for block heads)
+    uint8_t flags;        // PPAGE_* bits
+    uint32_t refcount;    // mappings sharing the block (1 once allocated)
 };
 
-// Global head of the free list (defined in page.c)
-extern struct ppage *free_list_head;
+struct mem_region;
+
+// Initializes the allocator over the usable RAM regions reported by the
+// bootloader, excluding low memory, the kernel image and the descriptor array.
+// Must run before paging is enabled (descriptors are written physically).
+void init_pfa_list(const struct mem_region *regions, int nregions);
 
-// Initializes the allocator and builds the free list
-void init_pfa_list(void);
+// Physical range holding the descriptor array (to be identity mapped)
+void pfa_metadata_range(uint32_t *start, uint32_t *end);
 
-// Allocates npages from the free list
+// The allocation functions below may be called from any CPU and from the
+// page-fault handler; they serialise on one spinlock.
+
+// Allocates npages frames as a list of buddy blocks (sizes sum to npages)
 struct ppage *allocate_physical_pages(unsigned int npages);
 
-// Frees a list of physical pages
+// Frees a list of blocks returned by allocate_physical_pages()
 void free_physical_pages(struct ppage *ppage_list);
 
-// Returns the number of pages currently on the free list
+// Allocates one physically contiguous block of (1 << order) frames
+struct ppage *pfa_alloc_block(unsigned int order);
+
+// Frees a single block, merging it with its buddies
+void pfa_free_block(struct ppage *block);
+
+// Allocates a single frame. With PFA_ZERO the frame is taken from the
+// pre-cleared pool, or cleared through kmap() when the pool is empty
+// (which requires paging to be enabled).
+struct ppage *pfa_alloc_frame(unsigned int flags);
+
+// Clears one free frame into the zero pool if it is below its target and
+// an order-0 block is free (it never splits a larger one). Meant for idle
+// loops; returns non-zero if it did any work.
+int pfa_zero_idle(void);
+
+// Returns the number of frames in the pre-cleared pool
+unsigned int pfa_zeroed_count(void);
+
+// Takes an extra reference on an allocated block (e.g. a second mapping)
+void pfa_get(struct ppage *block);
+
+// Drops a reference; the block is freed when the last one goes away.
+// Returns the references left.
+unsigned int pfa_put(struct ppage *block);
+
+// Returns the descriptor of the frame containing physaddr (NULL if unmanaged)
+struct ppage *pfa_page_of(void *physaddr);
+
+// Returns the number of frames currently free, pre-cleared ones included (O(1))
 unsigned int pfa_free_count(void);
 
+// Returns the number of usable frames managed by the allocator
+unsigned int pfa_total_count(void);
+
+// Returns the number of free blocks of the given order
+unsigned int pfa_free_blocks(unsigned int order);
+
+// Returns the head of the free list for the given order (for introspection)
+struct ppage *pfa_free_list(unsigned int order);
+
 #endif // PAGE_H
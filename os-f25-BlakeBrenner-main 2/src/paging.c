@@ -1,87 +1,410 @@
 #include "paging.h"
+#include "smp.h"
+#include "sched.h"
+#include "spinlock.h"
+
+_Static_assert(SMP_MAX_CPUS * KMAP_SLOTS <= PT_ENTRIES, "kmap window too small for SMP_MAX_CPUS");
 
 /* ===== Global paging structures (must be global + 4096-aligned) ===== */
 struct page_directory_entry kernel_pd[PD_ENTRIES] __attribute__((aligned(4096)));
-struct page kernel_pt_pool[PT_POOL_COUNT][PT_ENTRIES] __attribute__((aligned(4096)));
+
+/* Page tables are frames from the page allocator. pt_live[pdi] counts the
+   present PTEs in the table behind kernel_pd[pdi] so an emptied table can
+   be handed back. */
+static uint16_t pt_live[PD_ENTRIES];
 static uint32_t kernel_pt_count = 0;
+static uint32_t kernel_large_count = 0;
+static int paging_enabled = 0;
+static int pse_state = -1;   // -1 = not probed yet
 
 /* ===== Helpers ===== */
 static inline uint32_t align_down(uint32_t x, uint32_t a) { return x & ~(a - 1u); }
 static inline uint32_t vaddr_pdi(uint32_t v) { return (v >> 22) & 0x3FFu; }
 static inline uint32_t vaddr_pti(uint32_t v) { return (v >> 12) & 0x3FFu; }
 
-static void bzero_bytes(void *dst, uint32_t bytes) {
-    uint32_t *p = (uint32_t*)dst;
-    for (uint32_t n = bytes >> 2; n; --n) { *p++ = 0; }
-    uint8_t *q = (uint8_t*)p;
-    for (uint32_t i = 0; i < (bytes & 3u); ++i) q[i] = 0;
-}
-
 static inline void invlpg(void *addr) {
     __asm__ __volatile__("invlpg (%0)" :: "r"(addr) : "memory");
 }
 
-/* Create (& zero) a new page table from the static pool; return NULL if pool exhausted. */
-static struct page* alloc_pt_from_pool(void) {
-    if (kernel_pt_count >= PT_POOL_COUNT) return 0;
-    struct page *pt = &kernel_pt_pool[kernel_pt_count++][0];
-    bzero_bytes(pt, sizeof(kernel_pt_pool[0]));
-    return pt;
+static inline void flush_tlb(void) {
+    __asm__ __volatile__("mov %%cr3, %%eax\n"
+                         "mov %%eax, %%cr3\n" ::: "eax", "memory");
+}
+
+/* Above this many pages a full CR3 reload is cheaper than one invlpg each */
+#define TLB_FLUSH_THRESHOLD 32u
+#define TLB_FLUSH_ALL       0xFFFFF000u   /* as a size: reload CR3 */
+
+/* Invalidate the translations for [va, va + size) once, after a batch of
+   PTE updates. */
+static void tlb_flush_range(uint32_t va, uint32_t size) {
+    if (!paging_enabled) return;
+    uint32_t npages = size >> 12;
+    if (npages > TLB_FLUSH_THRESHOLD) {
+        flush_tlb();
+        return;
+    }
+    for (uint32_t i = 0; i < npages; i++)
+        invlpg((void*)(va + i * PAGE_SIZE));
+}
+
+/* Every CPU caches translations of the one kernel_pd, so a present entry
+   that changes must be invalidated on all of them before the old frame
+   (or page table) can be reused. One shootdown runs at a time; the CPUs
+   still owing it a flush have their bit in shoot_pending. */
+static spinlock_t shoot_lock = SPINLOCK_INIT;
+static volatile uint32_t shoot_va, shoot_size;
+static volatile uint32_t shoot_pending;
+
+void paging_tlb_ipi(void) {
+    uint32_t bit = 1u << smp_cpu_id();
+    if (!(shoot_pending & bit))
+        return;
+    tlb_flush_range(shoot_va, shoot_size);
+    atomic_and(&shoot_pending, ~bit);
+}
+
+/* tlb_flush_range() here and on every other online CPU; returns once they
+   all have. Callers stay on this CPU (preemption or interrupts off). */
+static void tlb_shootdown(uint32_t va, uint32_t size) {
+    tlb_flush_range(va, size);
+
+    uint32_t me = smp_cpu_id(), mask = 0;
+    for (uint32_t i = 0; i < SMP_MAX_CPUS; i++)
+        if (i != me && cpus[i].online)
+            mask |= 1u << i;
+    if (!mask || !paging_enabled)
+        return;
+
+    // Interrupts stay off while waiting, so another CPU shooting down at
+    // the same time is served by polling rather than by its IPI
+    uint32_t flags = irq_save();
+    while (!spin_trylock(&shoot_lock)) {
+        paging_tlb_ipi();
+        cpu_relax();
+    }
+    shoot_va = va;
+    shoot_size = size;
+    smp_mb();
+    shoot_pending = mask;
+    smp_broadcast_ipi(IPI_TLB_VECTOR);
+    while (shoot_pending)
+        cpu_relax();
+    spin_unlock(&shoot_lock);
+    irq_restore(flags);
+}
+
+/* CPUID.1:EDX bit 3 advertises 4 MiB pages (CR4.PSE) */
+int paging_pse_supported(void) {
+    if (pse_state < 0) {
+        uint32_t eax = 1, ebx, ecx, edx;
+        __asm__ __volatile__("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+        pse_state = (edx >> 3) & 1u;
+    }
+    return pse_state;
+}
+
+/* PDE[SCRATCH_PDI] is kept free so a detached page table can be edited
+   through its recursive window before it is wired into the directory. */
+static struct page* scratch_attach(uint32_t pt_phys) {
+    struct page *w = (struct page*)(0xFFC00000u + SCRATCH_PDI * PAGE_SIZE);
+    *(volatile uint32_t*)&kernel_pd[SCRATCH_PDI] = pt_phys | 0x003u;
+    invlpg(w);
+    return w;
+}
+
+static void scratch_detach(void) {
+    *(volatile uint32_t*)&kernel_pd[SCRATCH_PDI] = 0;
+    invlpg((void*)(0xFFC00000u + SCRATCH_PDI * PAGE_SIZE));
+}
+
+/* Where the CPU lets us touch the PT behind pd[pdi]: physically before
+   paging is on, through the recursive window (0xFFC00000) afterwards. */
+static inline struct page* pt_window(struct page_directory_entry *pd, uint32_t pdi) {
+    if (paging_enabled && pd == kernel_pd)
+        return (struct page*)(0xFFC00000u + pdi * PAGE_SIZE);
+    return (struct page*)((uint32_t)pd[pdi].frame << 12);  // prior to paging, identity assumption is fine
 }
 
 /* Ensure a PT exists for the given PDE index.
-   If absent, allocate one from the pool and wire the PDE for 4KiB pages. */
+   If absent, take a frame from the page allocator, wire the PDE for 4KiB
+   pages and zero the new table. Returns NULL when out of memory. */
+static struct page* split_large(struct page_directory_entry *pd, uint32_t pdi);
+
 static struct page* ensure_pt(struct page_directory_entry *pd, uint32_t pdi) {
-    if (pd[pdi].present) {
-        uint32_t pt_phys = pd[pdi].frame << 12;
-        return (struct page*)pt_phys;  // prior to paging, identity assumption is fine
-    }
-    struct page *pt = alloc_pt_from_pool();
-    if (!pt) return 0;
-
-    pd[pdi].present       = 1;
-    pd[pdi].rw            = 1;
-    pd[pdi].user          = 0;
-    pd[pdi].writethru     = 0;
-    pd[pdi].cachedisabled = 0;
-    pd[pdi].accessed      = 0;
-    pd[pdi].pagesize      = 0;                 // 4 KiB pages
-    pd[pdi].ignored       = 0;
-    pd[pdi].os_specific   = 0;
-    pd[pdi].frame         = ((uint32_t)(uintptr_t)pt) >> 12; // physical >> 12
+    if (pd[pdi].present && pd[pdi].pagesize)
+        return split_large(pd, pdi);
+    if (pd[pdi].present)
+        return pt_window(pd, pdi);
 
+    // A pre-cleared frame saves clearing the table here
+    int cleared = paging_enabled && pfa_zeroed_count();
+    struct ppage *frame = cleared ? pfa_alloc_frame(PFA_ZERO) : pfa_alloc_block(0);
+    if (!frame) return 0;
+
+    // present | rw, supervisor, 4 KiB pages
+    *(volatile uint32_t*)&pd[pdi] = (uint32_t)(uintptr_t)frame->physical_addr | 0x003u;
+
+    struct page *pt = pt_window(pd, pdi);
+    if (paging_enabled)
+        invlpg(pt);   // drop any stale translation of the window slot
+    if (!cleared)
+        page_clear(pt);
+    if (pd == kernel_pd)
+        pt_live[pdi] = 0;
+    kernel_pt_count++;
     return pt;
 }
 
-/* Map a single 4 KiB page: VA -> PA (helper for map_pages) */
-static void map_4k(struct page_directory_entry *pd, uint32_t va, uint32_t pa) {
+/* Replace the 4 MiB mapping in pd[pdi] by a page table with the same 1024
+   translations, so a single 4 KiB page inside it can be changed. */
+static struct page* split_large(struct page_directory_entry *pd, uint32_t pdi) {
+    struct ppage *frame = pfa_alloc_block(0);
+    if (!frame) return 0;
+
+    uint32_t pde = *(volatile uint32_t*)&pd[pdi];
+    uint32_t pt_phys = (uint32_t)(uintptr_t)frame->physical_addr;
+    uint32_t base = pde & 0xFFC00000u;
+    uint32_t flags = pde & 0x01Fu;   // P, RW, US, PWT, PCD carry over
+
+    // The region may hold the code doing the split, so the new table is
+    // filled completely before the PDE is switched over to it.
+    int live = paging_enabled && pd == kernel_pd;
+    uint32_t *pt = live ? (uint32_t*)scratch_attach(pt_phys) : (uint32_t*)pt_phys;
+    for (uint32_t i = 0; i < PT_ENTRIES; i++)
+        pt[i] = (base + i * PAGE_SIZE) | flags;
+    if (live) scratch_detach();
+
+    *(volatile uint32_t*)&pd[pdi] = pt_phys | flags;   // PS cleared
+    if (paging_enabled) flush_tlb();
+
+    if (pd == kernel_pd)
+        pt_live[pdi] = PT_ENTRIES;
+    kernel_pt_count++;
+    kernel_large_count--;
+    return pt_window(pd, pdi);
+}
+
+/* Map a single 4 KiB page: VA -> PA (helper for map_pages on a directory
+   other than the live kernel_pd). Returns 0, or -1 if no page table could
+   be allocated. */
+static int map_4k(struct page_directory_entry *pd, uint32_t va, uint32_t pa) {
     uint32_t pdi = vaddr_pdi(va);
     uint32_t pti = vaddr_pti(va);
 
     struct page *pt = ensure_pt(pd, pdi);
-    if (!pt) return; // out of PTs, silently drop
+    if (!pt) return -1;
+
+    if (!pt[pti].present && pd == kernel_pd)
+        pt_live[pdi]++;
+    ((volatile uint32_t*)pt)[pti] = (pa & ~0xFFFu) | 0x003u;
+    return 0;
+}
+
+/* ===== Batched range API ===== */
+
+/* A whole 4 MiB chunk, aligned in VA and PA, with no page table in the
+   way, is mapped with one large PDE */
+static inline int chunk_is_large(uint32_t va, uint32_t chunk_end, uint32_t pa, int pse, uint32_t pde) {
+    return pse && chunk_end - va == LARGE_PAGE_SIZE && !(pa & (LARGE_PAGE_SIZE - 1)) &&
+           !((pde & 0x001u) && !(pde & PDE_PS));
+}
+
+/* Undo the page tables a failed map_range() created; they are still empty */
+static void drop_new_pts(const uint32_t *created) {
+    for (uint32_t pdi = 0; pdi < PD_ENTRIES; pdi++) {
+        if (!(created[pdi / 32] & (1u << (pdi % 32))))
+            continue;
+        volatile uint32_t *pde = (volatile uint32_t*)&kernel_pd[pdi];
+        struct ppage *frame = pfa_page_of((void*)(*pde & ~0xFFFu));
+        *pde = 0;
+        if (paging_enabled)
+            invlpg((void*)(0xFFC00000u + pdi * PAGE_SIZE));   // recursive window slot
+        pt_live[pdi] = 0;
+        kernel_pt_count--;
+        if (frame)
+            pfa_free_block(frame);
+    }
+}
+
+static int do_map_range(uint32_t va, uint32_t pa, uint32_t size, unsigned int flags) {
+    if ((va | pa | size) & (PAGE_SIZE - 1)) return -1;
+    if (!size) return 0;
+    uint32_t start = va, end = va + size;
+    if (end < va || vaddr_pdi(end - 1) >= KMAP_PDI) return -1;
+
+    uint32_t entry_flags = (flags & 0xFFFu) | 0x001u;
+    int pse = paging_pse_supported();
+    int stale = 0;   // overwrote a present translation => TLB must be flushed
+
+    // First make sure every page table exists, so running out of memory
+    // leaves the existing mappings exactly as they were: only the tables
+    // created here are taken back. Splitting a large page keeps its
+    // translations, so that needs no undoing.
+    uint32_t created[PD_ENTRIES / 32] = { 0 };
+    for (uint32_t v = start, p = pa; v < end; ) {
+        uint32_t pdi = vaddr_pdi(v);
+        uint32_t chunk_end = (v | (LARGE_PAGE_SIZE - 1)) + 1;
+        if (chunk_end > end || chunk_end == 0) chunk_end = end;
+        uint32_t pde = *(volatile uint32_t*)&kernel_pd[pdi];
+        if (!chunk_is_large(v, chunk_end, p, pse, pde)) {
+            if (!ensure_pt(kernel_pd, pdi)) {
+                drop_new_pts(created);
+                return -2;
+            }
+            if (!(pde & 0x001u))
+                created[pdi / 32] |= 1u << (pdi % 32);
+        }
+        p += chunk_end - v;
+        v = chunk_end;
+    }
+
+    while (va < end) {
+        uint32_t pdi = vaddr_pdi(va);
+        uint32_t chunk_end = (va | (LARGE_PAGE_SIZE - 1)) + 1;
+        if (chunk_end > end || chunk_end == 0) chunk_end = end;
+        volatile uint32_t *pde = (volatile uint32_t*)&kernel_pd[pdi];
+
+        if (chunk_is_large(va, chunk_end, pa, pse, *pde)) {
+            if (*pde & 0x001u) stale = 1;
+            else kernel_large_count++;
+            *pde = (pa & 0xFFC00000u) | (entry_flags & 0x01Fu) | PDE_PS;
+            va = chunk_end;
+            pa += LARGE_PAGE_SIZE;
+            continue;
+        }
+
+        // One word store per entry; the table exists since the first pass
+        volatile uint32_t *pt = (volatile uint32_t*)pt_window(kernel_pd, pdi);
+        uint32_t live = pt_live[pdi];
+        for (uint32_t i = vaddr_pti(va); va < chunk_end; i++, va += PAGE_SIZE, pa += PAGE_SIZE) {
+            if (pt[i] & 0x001u) stale = 1;
+            else live++;
+            pt[i] = pa | entry_flags;
+        }
+        pt_live[pdi] = (uint16_t)live;
+    }
+
+    // Entries that were not present cannot be cached, so a fresh mapping
+    // needs no invalidation at all
+    if (stale)
+        tlb_shootdown(start, size);
+    return 0;
+}
+
+static void do_unmap_range(uint32_t va, uint32_t size) {
+    uint32_t start = align_down(va, PAGE_SIZE);
+    uint32_t end = (va + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if (end <= start) return;
+    if (vaddr_pdi(end - 1) >= KMAP_PDI) end = KMAP_PDI << 22;
 
-    pt[pti].present  = 1;
-    pt[pti].rw       = 1;
-    pt[pti].user     = 0;
-    pt[pti].accessed = 0;
-    pt[pti].dirty    = 0;
-    pt[pti].unused   = 0;
-    pt[pti].frame    = (pa >> 12);
+    struct ppage *dead = 0;   // emptied page tables, freed after the flush
+    int flushed_any = 0;
+
+    for (va = start; va < end; ) {
+        uint32_t pdi = vaddr_pdi(va);
+        uint32_t chunk_end = (va | (LARGE_PAGE_SIZE - 1)) + 1;
+        if (chunk_end > end || chunk_end == 0) chunk_end = end;
+        volatile uint32_t *pde = (volatile uint32_t*)&kernel_pd[pdi];
+
+        if (!(*pde & 0x001u)) {
+            va = chunk_end;
+            continue;
+        }
+
+        if (*pde & PDE_PS) {
+            if (chunk_end - va == LARGE_PAGE_SIZE) {
+                *pde = 0;
+                kernel_large_count--;
+                flushed_any = 1;
+                va = chunk_end;
+                continue;
+            }
+            // Punching a hole in a 4 MiB page: fall back to a page table first
+            if (!split_large(kernel_pd, pdi)) {
+                va = chunk_end;
+                continue;
+            }
+        }
+
+        volatile uint32_t *pt = (volatile uint32_t*)pt_window(kernel_pd, pdi);
+        uint32_t live = pt_live[pdi];
+        for (uint32_t i = vaddr_pti(va); va < chunk_end; i++, va += PAGE_SIZE) {
+            if (pt[i] & 0x001u) {
+                pt[i] = 0;
+                live--;
+                flushed_any = 1;
+            }
+        }
+        pt_live[pdi] = (uint16_t)live;
+
+        if (!live) {
+            struct ppage *frame = pfa_page_of((void*)(*pde & ~0xFFFu));
+            *pde = 0;
+            if (paging_enabled)
+                invlpg((void*)(0xFFC00000u + pdi * PAGE_SIZE));   // recursive window slot
+            if (frame) {
+                frame->next = dead;
+                dead = frame;
+            }
+            kernel_pt_count--;
+        }
+    }
+
+    // A freed table may still be cached behind its recursive window slot
+    // elsewhere, so dropping one flushes everything
+    if (dead)
+        tlb_shootdown(0, TLB_FLUSH_ALL);
+    else if (flushed_any)
+        tlb_shootdown(start, end - start);
+
+    while (dead) {
+        struct ppage *next = dead->next;
+        dead->next = 0;
+        pfa_free_block(dead);
+        dead = next;
+    }
+}
+
+/* Page tables are shared by every thread: no switch while one is half
+   edited */
+int map_range(uint32_t va, uint32_t pa, uint32_t size, unsigned int flags) {
+    preempt_disable();
+    int rc = do_map_range(va, pa, size, flags);
+    preempt_enable();
+    return rc;
+}
+
+void unmap_range(uint32_t va, uint32_t size) {
+    preempt_disable();
+    do_unmap_range(va, size);
+    preempt_enable();
 }
 
 /* ===== Assignment function: map a linked list of physical pages at vaddr ===== */
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd) {
-    uint32_t va = align_down((uint32_t)(uintptr_t)vaddr, PAGE_SIZE);
+    uint32_t base = align_down((uint32_t)(uintptr_t)vaddr, PAGE_SIZE);
+    uint32_t va = base;
 
     for (struct ppage *cur = pglist; cur; cur = cur->next) {
-        uint32_t pa_base = (uint32_t)(uintptr_t)cur->physical_addr;
-        for (uint32_t off = 0; off < PFA_PAGE_BYTES; off += PAGE_SIZE) {
-            map_4k(pd, va, pa_base + off);
-            va += PAGE_SIZE;
+        uint32_t pa = (uint32_t)(uintptr_t)cur->physical_addr;
+        uint32_t bytes = PFA_PAGE_BYTES << cur->order;   // buddy block size
+
+        if (pd == kernel_pd) {
+            if (map_range(va, pa, bytes, 0x003)) {
+                // Out of memory for page tables: undo the partial mapping
+                unmap_range(base, va - base);
+                return 0;
+            }
+            va += bytes;
+            continue;
         }
+
+        for (uint32_t off = 0; off < bytes; off += PAGE_SIZE, va += PAGE_SIZE)
+            if (map_4k(pd, va, pa + off))
+                return 0;
     }
-    return (void*)align_down((uint32_t)(uintptr_t)vaddr, PAGE_SIZE);
+    return (void*)base;
 }
 
 /* ===== Control registers ===== */
@@ -89,6 +412,15 @@ void loadPageDirectory(struct page_directory_entry *pd) {
     __asm__ __volatile__("mov %0, %%cr3" :: "r"(pd) : "memory");
 }
 void enablePaging(void) {
+    if (paging_pse_supported()) {
+        __asm__ __volatile__(
+            "mov %%cr4, %%eax\n"
+            "or  $0x10, %%eax\n"       /* CR4.PSE: honour PDE.PS */
+            "mov %%eax, %%cr4\n"
+            ::: "eax", "memory"
+        );
+    }
+    paging_enabled = 1;
     __asm__ __volatile__(
         "mov %%cr0, %%eax\n"
         "or  $0x80000001, %%eax\n"  /* CR0.PE | CR0.PG */
@@ -98,17 +430,13 @@ void enablePaging(void) {
 }
 
 /* ===== Recursive paging: set PDE[1023] to point to PD itself ===== */
-void paging_init_recursive(struct page_directory_entry *pd) {
-    pd[1023].present       = 1;
-    pd[1023].rw            = 1;
-    pd[1023].user          = 0;
-    pd[1023].writethru     = 0;
-    pd[1023].cachedisabled = 0;
-    pd[1023].accessed      = 0;
-    pd[1023].pagesize      = 0; // 4 KiB pages
-    pd[1023].ignored       = 0;
-    pd[1023].os_specific   = 0;
-    pd[1023].frame         = ((uint32_t)(uintptr_t)pd) >> 12; // PD maps itself
+int paging_init_recursive(struct page_directory_entry *pd) {
+    // present | rw, 4 KiB pages; the PD maps itself
+    *(volatile uint32_t*)&pd[1023] = ((uint32_t)(uintptr_t)pd & ~0xFFFu) | 0x003u;
+
+    // Wired now, while tables are reached physically, so kmap() never
+    // allocates and is safe on every CPU
+    return ensure_pt(pd, KMAP_PDI) ? 0 : -1;
 }
 
 /* ===== Functions that use the recursive mapping =====
@@ -125,6 +453,10 @@ void *get_physaddr(void *virtualaddr) {
     volatile unsigned long *pd = (unsigned long *)0xFFFFF000; // PD via recursive map
     if (!is_present(pd[pdindex])) return (void*)0;
 
+    // 4 MiB page: the PDE holds the frame directly
+    if (pd[pdindex] & PDE_PS)
+        return (void *)((pd[pdindex] & 0xFFC00000UL) + (va & 0x3FFFFFUL));
+
     volatile unsigned long *pt = (unsigned long *)0xFFC00000 + (0x400 * pdindex);
     if (!is_present(pt[ptindex])) return (void*)0;
 
@@ -133,9 +465,16 @@ void *get_physaddr(void *virtualaddr) {
     return (void *)(frame + off);
 }
 
+uint32_t get_pte(void *virtualaddr) {
+    uint32_t va = (uint32_t)(uintptr_t)virtualaddr;
+    uint32_t pde = ((volatile uint32_t *)0xFFFFF000u)[va >> 22];
+    if (!is_present(pde) || (pde & PDE_PS)) return 0;
+    return ((volatile uint32_t *)0xFFC00000u)[va >> 12];
+}
+
 /* Map exactly one 4 KiB page: physaddr -> virtualaddr with low 12-bit flags.
-   If the PT is missing, allocate from the static pool and wire the PDE. */
-int map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
+   If the PT is missing, allocate a frame for it and wire the PDE. */
+static int do_map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
     unsigned long pa = (unsigned long)physaddr;
     unsigned long va = (unsigned long)virtualaddr;
 
@@ -143,87 +482,106 @@ int map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
 
     unsigned long pdindex = va >> 22;
     unsigned long ptindex = (va >> 12) & 0x03FF;
+    if (pdindex >= KMAP_PDI) return -1;              // kmap, scratch + recursive slots
 
-    // Access PD via recursive map
-    volatile unsigned long *pd = (unsigned long *)0xFFFFF000;
-
-    // If PDE is absent, create a new PT from our pool and wire it
-    if (!is_present(pd[pdindex])) {
-        struct page *newpt = alloc_pt_from_pool();
-        if (!newpt) return -2; // out of PTs
-        // Zero already done in allocator; now wire PDE (present|rw, user=0, 4KiB)
-        pd[pdindex] = (((unsigned long)(uintptr_t)newpt) & ~0xFFFUL) | 0x003UL;
-        // After this write, that PT appears at 0xFFC00000 + pdindex*0x1000 immediately
-    }
-
-    volatile unsigned long *pt = (unsigned long *)0xFFC00000 + (0x400 * pdindex);
+    // If PDE is absent, a new zeroed PT appears at 0xFFC00000 + pdindex*0x1000
+    volatile unsigned long *pt = (volatile unsigned long *)ensure_pt(kernel_pd, pdindex);
+    if (!pt) return -2; // out of memory for page tables
 
     // If an existing mapping is present, you can choose to overwrite or error
     // if (is_present(pt[ptindex])) return -3; // uncomment to disallow remap
+    int stale = is_present(pt[ptindex]);
+    if (!stale)
+        pt_live[pdindex]++;
 
     pt[ptindex] = (pa & ~0xFFFUL) | (flags & 0xFFFUL) | 0x001UL; // set Present
-    invlpg((void*)va);
+    // Replacing a translation (COW break, write-protect) must reach the
+    // other CPUs before the caller frees or reuses the old frame
+    if (stale)
+        tlb_shootdown(va, PAGE_SIZE);
+    else
+        invlpg((void*)va);
     return 0;
 }
+
+int map_page(void *physaddr, void *virtualaddr, unsigned int flags) {
+    preempt_disable();
+    int rc = do_map_page(physaddr, virtualaddr, flags);
+    preempt_enable();
+    return rc;
+}
+
+/* Clear the PTE for one 4 KiB page; unmap_range() frees the page table
+   if that was its last mapping. */
+void *unmap_page(void *virtualaddr) {
+    unsigned long va = (unsigned long)virtualaddr & ~0xFFFUL;
+    preempt_disable();
+    void *pa = get_physaddr((void*)va);
+    if (pa && (va >> 22) < KMAP_PDI)
+        do_unmap_range(va, PAGE_SIZE);
+    else
+        pa = (void*)0;
+    preempt_enable();
+    return pa;
+}
+
+/* ===== kmap window =====
+   The page table behind PDE[KMAP_PDI] is wired by paging_init_recursive()
+   and never freed; map_range()/unmap_range() refuse to touch it, so its
+   entries are only ever written here, each CPU in its own slots. */
+void *kmap(void *physaddr, unsigned int slot) {
+    if (slot >= KMAP_SLOTS || !paging_enabled) return (void*)0;
+    volatile uint32_t *pt = (volatile uint32_t*)pt_window(kernel_pd, KMAP_PDI);
+
+    uint32_t idx = smp_cpu_id() * KMAP_SLOTS + slot;
+    uint32_t va = KMAP_BASE + idx * PAGE_SIZE;
+    pt[idx] = ((uint32_t)(uintptr_t)physaddr & ~0xFFFu) | 0x003u;
+    invlpg((void*)va);
+    return (void*)va;
+}
+
+void kunmap(unsigned int slot) {
+    if (slot >= KMAP_SLOTS || !paging_enabled) return;
+    volatile uint32_t *pt = (volatile uint32_t*)pt_window(kernel_pd, KMAP_PDI);
+
+    uint32_t idx = smp_cpu_id() * KMAP_SLOTS + slot;
+    pt[idx] = 0;
+    invlpg((void*)(KMAP_BASE + idx * PAGE_SIZE));
+}
+
 /* Identity map a range of physical addresses (phys addr = virt addr)
-   Used during early boot before higher-half kernel */
-void identity_map_range(uint32_t start, uint32_t end) {
+   Used during early boot before higher-half kernel.
+   Returns 0 on success, -1 if a page table could not be allocated. */
+int identity_map_range(uint32_t start, uint32_t end) {
     // Align start down to page boundary
     start = start & ~(PAGE_SIZE - 1);
     
     // Align end up to page boundary  
     end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
     
-    // Map each 4KB page in the range
-    for (uint32_t addr = start; addr < end; addr += PAGE_SIZE) {
-        uint32_t pdi = (addr >> 22) & 0x3FF;  // Page directory index
-        uint32_t pti = (addr >> 12) & 0x3FF;  // Page table index
-        
-        // Ensure page table exists for this PDE
-        if (!kernel_pd[pdi].present) {
-            // Allocate a page table from the static pool
-            if (kernel_pt_count >= PT_POOL_COUNT) {
-                // Out of page tables - silently fail for now
-                // In a real system, you'd panic or handle this
-                continue;
-            }
-            
-            struct page *pt = &kernel_pt_pool[kernel_pt_count++][0];
-            
-            // Zero out the page table
-            for (int i = 0; i < PT_ENTRIES; i++) {
-                pt[i].present = 0;
-                pt[i].rw = 0;
-                pt[i].user = 0;
-                pt[i].accessed = 0;
-                pt[i].dirty = 0;
-                pt[i].unused = 0;
-                pt[i].frame = 0;
-            }
-            
-            // Setup the page directory entry
-            kernel_pd[pdi].present = 1;
-            kernel_pd[pdi].rw = 1;
-            kernel_pd[pdi].user = 0;
-            kernel_pd[pdi].writethru = 0;
-            kernel_pd[pdi].cachedisabled = 0;
-            kernel_pd[pdi].accessed = 0;
-            kernel_pd[pdi].pagesize = 0;  // 4KB pages
-            kernel_pd[pdi].ignored = 0;
-            kernel_pd[pdi].os_specific = 0;
-            kernel_pd[pdi].frame = ((uint32_t)pt) >> 12;
-        }
-        
-        // Get the page table (before paging is enabled, physical = virtual)
-        struct page *pt = (struct page*)(kernel_pd[pdi].frame << 12);
-        
-        // Setup the page table entry for identity mapping (phys = virt)
-        pt[pti].present = 1;
-        pt[pti].rw = 1;
-        pt[pti].user = 0;
-        pt[pti].accessed = 0;
-        pt[pti].dirty = 0;
-        pt[pti].unused = 0;
-        pt[pti].frame = addr >> 12;  // Identity: virt addr = phys addr
+    // Map 4 MiB chunk by chunk so chunks already covered by an identity
+    // large page (e.g. low memory) are left alone instead of being split
+    for (uint32_t addr = start; addr < end; ) {
+        uint32_t pdi = vaddr_pdi(addr);
+        uint32_t chunk_end = (addr | (LARGE_PAGE_SIZE - 1)) + 1;
+        if (chunk_end > end || chunk_end == 0) chunk_end = end;
+
+        uint32_t pde = *(volatile uint32_t*)&kernel_pd[pdi];
+        int covered = (pde & 0x001u) && (pde & PDE_PS) &&
+                      (pde & 0xFFC00000u) == (addr & 0xFFC00000u);
+
+        if (!covered && map_range(addr, addr, chunk_end - addr, 0x003))
+            return -1;
+        if (chunk_end == end) break;
+        addr = chunk_end;
     }
+    return 0;
+}
+
+uint32_t paging_pt_count(void) {
+    return kernel_pt_count;
+}
+
+uint32_t paging_large_count(void) {
+    return kernel_large_count;
 }
@@ -13,7 +13,7 @@ struct page_directory_entry
    uint32_t writethru     : 1;   // Cache this directory as write-thru only
    uint32_t cachedisabled : 1;   // Disable cache on this page table?
    uint32_t accessed      : 1;   // Accessed
-   uint32_t pagesize      : 1;   // 0 => 4 KiB pages
+   uint32_t pagesize      : 1;   // 0 => 4 KiB pages, 1 => 4 MiB page (CR4.PSE)
    uint32_t ignored       : 2;
    uint32_t os_specific   : 3;
    uint32_t frame         : 20;  // physical address >> 12 of the page table
@@ -21,19 +21,43 @@ struct page_directory_entry
 
 struct page
 {
-   uint32_t present  : 1;   // Page present in memory
-   uint32_t rw       : 1;   // Read-only if clear, readwrite if set
-   uint32_t user     : 1;   // Supervisor level only if clear
-   uint32_t accessed : 1;   // Has the page been accessed
-   uint32_t dirty    : 1;   // Has the page been written
-   uint32_t unused   : 7;
-   uint32_t frame    : 20;  // physical address >> 12 of the 4 KiB frame
+   uint32_t present       : 1;   // Page present in memory
+   uint32_t rw            : 1;   // Read-only if clear, readwrite if set
+   uint32_t user          : 1;   // Supervisor level only if clear
+   uint32_t writethru     : 1;   // Write-through caching for this page
+   uint32_t cachedisabled : 1;   // Disable caching for this page
+   uint32_t accessed      : 1;   // Has the page been accessed
+   uint32_t dirty         : 1;   // Has the page been written
+   uint32_t pat           : 1;
+   uint32_t global        : 1;
+   uint32_t os_specific   : 3;   // Ignored by the CPU, see PTE_COW
+   uint32_t frame         : 20;  // physical address >> 12 of the 4 KiB frame
 };
 
 /* ===== Constants ===== */
 #define PAGE_SIZE    4096u
 #define PD_ENTRIES   1024u
 #define PT_ENTRIES   1024u
+#define LARGE_PAGE_SIZE (4u * 1024u * 1024u)   /* one PDE with PS set */
+#define PDE_PS       0x080u
+
+/* PDE 1021 holds the kmap() window, 1022 is reserved for editing detached
+   page tables, 1023 is the recursive slot */
+#define KMAP_PDI     1021u
+#define SCRATCH_PDI  1022u
+
+/* PTE flag bits (whole-word form of struct page) */
+#define PTE_PRESENT  0x001u
+#define PTE_RW       0x002u
+#define PTE_COW      0x200u   /* os_specific bit 0: read-only, copy on write */
+
+/* kmap() window: every CPU gets KMAP_SLOTS slots of 4 KiB of its own, so
+   temporary mappings never need a cross-CPU TLB flush */
+#define KMAP_BASE    (KMAP_PDI << 22)
+#define KMAP_SLOTS   4u
+#define KMAP_SLOT_COPY_SRC  0u   /* page-fault handler, copy-on-write source */
+#define KMAP_SLOT_ZERO      1u   /* pfa_alloc_frame(PFA_ZERO) with an empty pool */
+#define KMAP_SLOT_ZERO_IDLE 2u   /* pfa_zero_idle() */
 
 /* If your frame allocator returns >4KiB blocks (e.g., 2MiB), define PFA_PAGE_BYTES in page.h.
    Otherwise we default to 4 KiB. */
@@ -41,42 +65,96 @@ struct page
 #define PFA_PAGE_BYTES PAGE_SIZE
 #endif
 
+/* Clear one mapped 4 KiB page */
+static inline void page_clear(void *va) {
+    uint32_t n = PAGE_SIZE / 4, d = (uint32_t)(uintptr_t)va;
+    __asm__ __volatile__("cld; rep stosl" : "+c"(n), "+D"(d) : "a"(0) : "memory");
+}
+
 /* ===== Global, 4096-byte aligned paging structures ===== */
 extern struct page_directory_entry kernel_pd[PD_ENTRIES] __attribute__((aligned(4096)));
 
-/* Small static pool of page tables for on-demand creation (each 4 KiB aligned) */
-#ifndef PT_POOL_COUNT
-#define PT_POOL_COUNT 64
-#endif
-extern struct page kernel_pt_pool[PT_POOL_COUNT][PT_ENTRIES] __attribute__((aligned(4096)));
-
 /* ===== Assignment API ===== */
 
 /* Map a linked list of physical pages (pglist) starting at vaddr.
-   Returns the (page-aligned) virtual address mapped. */
+   Each node is a buddy block spanning PFA_PAGE_BYTES << node->order bytes.
+   Runs that are 4 MiB-aligned in both VA and PA are mapped with large PDEs.
+   Page tables are allocated from the frame allocator as needed; once paging
+   is enabled pd must be kernel_pd (tables are reached via the recursive map).
+   Returns the (page-aligned) virtual address mapped, or NULL if a page table
+   could not be allocated (nothing is left mapped in that case). */
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd);
 
 /* Load CR3 (PD base, must be physical & 4KiB aligned) */
 void loadPageDirectory(struct page_directory_entry *pd);
 
-/* Enable paging: set CR0.PE (bit 0) and CR0.PG (bit 31) */
+/* Enable paging: set CR0.PE (bit 0) and CR0.PG (bit 31), plus CR4.PSE when available */
 void enablePaging(void);
 
 /* ===== Recursive paging support =====
    Call this ONCE during paging setup (before loadPageDirectory) to set PDE[1023] to point to PD.
-   After enabling paging, the PD is visible at 0xFFFFF000 and PT[i] at 0xFFC00000 + i*0x1000. */
-void paging_init_recursive(struct page_directory_entry *pd);
+   After enabling paging, the PD is visible at 0xFFFFF000 and PT[i] at 0xFFC00000 + i*0x1000.
+   Also creates the kmap() page table. Returns 0, or -1 if out of memory. */
+int paging_init_recursive(struct page_directory_entry *pd);
 
 /* ===== Convenience functions that rely on recursive mapping =====
    These match the style you asked for. They require paging enabled and PDE[1023] set. */
 
-/* Translate a virtual address to a physical address; returns NULL if not present. */
+/* Translate a virtual address to a physical address (4 KiB or 4 MiB pages);
+   returns NULL if not present. */
 void *get_physaddr(void *virtualaddr);
 
+/* Raw 32-bit PTE behind a 4 KiB mapping (0 if no page table or a 4 MiB page) */
+uint32_t get_pte(void *virtualaddr);
+
 /* Map a single 4KiB page: physaddr -> virtualaddr with low 12-bit flags (e.g., 0x003 for R/W|Present).
-   Allocates a page table from the static pool if the PDE is not present.
-   Returns 0 on success, negative on error. */
+   Allocates a page table from the frame allocator if the PDE is not present.
+   Returns 0 on success, -1 on bad arguments, -2 when out of memory. */
 int map_page(void *physaddr, void *virtualaddr, unsigned int flags);
 
-void identity_map_range(uint32_t start, uint32_t end);
+/* ===== Batched range API =====
+   Both operate on kernel_pd, write whole 32-bit entries and invalidate the
+   TLB once per call: per-page invlpg for small ranges, a CR3 reload for
+   large ones, and nothing at all when only absent entries were filled. */
+
+/* Map [va, va+size) -> [pa, pa+size) with low 12-bit PTE flags. 4 MiB chunks
+   aligned in VA and PA become large PDEs. All arguments must be page aligned.
+   Returns 0, -1 on bad arguments, -2 when out of memory (existing mappings
+   are left exactly as they were). */
+int map_range(uint32_t va, uint32_t pa, uint32_t size, unsigned int flags);
+
+/* Unmap [va, va+size), freeing page tables that become empty. */
+void unmap_range(uint32_t va, uint32_t size);
+
+/* Remove the 4 KiB mapping at virtualaddr (no-op if absent) and flush its TLB entry.
+   A 4 MiB page is split into a page table first. A page table whose last
+   entry is cleared goes back to the frame allocator.
+   Returns the physical address that was mapped, or NULL. */
+void *unmap_page(void *virtualaddr);
+
+/* Map the frame at physaddr read/write at slot `slot` of the calling CPU's
+   kmap window and return its address. The slot stays valid until
+   kunmap(slot) on the same CPU; callers own their slot, no locking is
+   done, so hold preempt_disable() (or keep interrupts off) from kmap()
+   to kunmap(): another thread on this CPU may use the same slot.
+   Returns NULL for a bad slot or before paging is enabled. */
+void *kmap(void *physaddr, unsigned int slot);
+void kunmap(unsigned int slot);
+
+/* IPI_TLB_VECTOR handler body: carry out this CPU's part of a pending
+   TLB shootdown. map_range(), unmap_range(), map_page() and unmap_page()
+   return only after every online CPU has dropped the translations they
+   replaced or removed. */
+void paging_tlb_ipi(void);
+
+/* Identity map [start, end), using 4 MiB pages for fully covered aligned chunks.
+   Returns 0, or -1 if out of memory for page tables. */
+int identity_map_range(uint32_t start, uint32_t end);
+
+/* Number of page tables / 4 MiB PDEs currently in kernel_pd */
+uint32_t paging_pt_count(void);
+uint32_t paging_large_count(void);
+
+/* Non-zero if the CPU supports 4 MiB pages */
+int paging_pse_supported(void);
 #endif /* PAGING_H */
@@ -0,0 +1,116 @@
+#include "pci.h"
+#include "io.h"
+
+#define PCI_CONFIG_ADDRESS  0xCF8
+#define PCI_CONFIG_DATA     0xCFC
+
+static struct pci_device devices[PCI_MAX_DEVICES];
+static uint32_t ndevices;
+
+static inline void select(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off) {
+    outl(PCI_CONFIG_ADDRESS, 0x80000000u | ((uint32_t)bus << 16) |
+                             ((uint32_t)(dev & 0x1F) << 11) |
+                             ((uint32_t)(func & 0x07) << 8) | (off & 0xFC));
+}
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off) {
+    select(bus, dev, func, off);
+    return inl(PCI_CONFIG_DATA);
+}
+
+uint16_t pci_config_read16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off) {
+    return pci_config_read32(bus, dev, func, off) >> ((off & 2) * 8);
+}
+
+uint8_t pci_config_read8(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off) {
+    return pci_config_read32(bus, dev, func, off) >> ((off & 3) * 8);
+}
+
+/* A 16-bit write to the matching half of the data port, so the other half
+   (the write-1-to-clear status register, next to COMMAND) is untouched */
+void pci_config_write16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off, uint16_t val) {
+    select(bus, dev, func, off);
+    outw(PCI_CONFIG_DATA + (off & 2), val);
+}
+
+static void scan_bus(uint8_t bus);
+
+static void add_function(uint8_t bus, uint8_t dev, uint8_t func) {
+    uint32_t cr = pci_config_read32(bus, dev, func, PCI_CLASS_REVISION);
+    uint8_t class_code = cr >> 24, subclass = cr >> 16;
+
+    if (ndevices < PCI_MAX_DEVICES) {
+        struct pci_device *d = &devices[ndevices++];
+        uint32_t id = pci_config_read32(bus, dev, func, PCI_VENDOR_ID);
+        d->bus = bus;
+        d->dev = dev;
+        d->func = func;
+        d->vendor = id & 0xFFFF;
+        d->device = id >> 16;
+        d->class_code = class_code;
+        d->subclass = subclass;
+        d->prog_if = cr >> 8;
+        d->irq_line = pci_config_read8(bus, dev, func, PCI_INTERRUPT_LINE);
+        // Header type 0 has six BARs; bridges use the space for bus numbers
+        uint8_t header = pci_config_read8(bus, dev, func, PCI_HEADER_TYPE) & 0x7F;
+        for (int i = 0; i < 6; i++)
+            d->bar[i] = header == 0 ? pci_config_read32(bus, dev, func, PCI_BAR0 + 4 * i) : 0;
+    }
+
+    if (class_code == PCI_CLASS_BRIDGE && subclass == PCI_SUBCLASS_PCI) {
+        uint8_t secondary = pci_config_read8(bus, dev, func, PCI_SECONDARY_BUS);
+        if (secondary > bus)   // unconfigured bridges report 0
+            scan_bus(secondary);
+    }
+}
+
+static void scan_bus(uint8_t bus) {
+    for (uint8_t dev = 0; dev < 32; dev++) {
+        if (pci_config_read16(bus, dev, 0, PCI_VENDOR_ID) == 0xFFFF)
+            continue;
+        add_function(bus, dev, 0);
+        // Header type bit 7: the other seven functions may be populated
+        if (!(pci_config_read8(bus, dev, 0, PCI_HEADER_TYPE) & 0x80))
+            continue;
+        for (uint8_t func = 1; func < 8; func++)
+            if (pci_config_read16(bus, dev, func, PCI_VENDOR_ID) != 0xFFFF)
+                add_function(bus, dev, func);
+    }
+}
+
+int pci_init(void) {
+    ndevices = 0;
+    // Mechanism #1 is there if the address register holds what was written
+    outl(PCI_CONFIG_ADDRESS, 0x80000000u);
+    if (inl(PCI_CONFIG_ADDRESS) != 0x80000000u)
+        return 0;
+    scan_bus(0);
+    return ndevices;
+}
+
+uint32_t pci_count(void) {
+    return ndevices;
+}
+
+const struct pci_device *pci_get(uint32_t i) {
+    return i < ndevices ? &devices[i] : 0;
+}
+
+const struct pci_device *pci_find_class(uint8_t class_code, uint8_t subclass) {
+    for (uint32_t i = 0; i < ndevices; i++)
+        if (devices[i].class_code == class_code && devices[i].subclass == subclass)
+            return &devices[i];
+    return 0;
+}
+
+void pci_enable_bus_master(const struct pci_device *d) {
+    uint16_t cmd = pci_config_read16(d->bus, d->dev, d->func, PCI_COMMAND);
+    cmd |= PCI_COMMAND_IO | PCI_COMMAND_MASTER;
+    pci_config_write16(d->bus, d->dev, d->func, PCI_COMMAND, cmd);
+}
+
+uint16_t pci_bar_io(const struct pci_device *d, int n) {
+    if (n < 0 || n > 5 || !(d->bar[n] & PCI_BAR_IO))
+        return 0;
+    return d->bar[n] & 0xFFFC;
+}
@@ -0,0 +1,62 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include <stdint.h>
+
+/* PCI configuration space through mechanism #1 (ports 0xCF8/0xCFC).
+   pci_init() walks bus 0 and every bus behind a PCI-to-PCI bridge once
+   and keeps what it found in a small table; drivers then look devices up
+   by class instead of probing ports themselves. */
+
+#define PCI_MAX_DEVICES     32
+
+/* Configuration space offsets */
+#define PCI_VENDOR_ID       0x00
+#define PCI_DEVICE_ID       0x02
+#define PCI_COMMAND         0x04
+#define PCI_CLASS_REVISION  0x08   /* class, subclass, prog-if, revision */
+#define PCI_HEADER_TYPE     0x0E
+#define PCI_BAR0            0x10   /* six BARs, 4 bytes apart */
+#define PCI_SECONDARY_BUS   0x19   /* bridges only */
+#define PCI_INTERRUPT_LINE  0x3C
+
+#define PCI_COMMAND_IO      0x0001
+#define PCI_COMMAND_MEMORY  0x0002
+#define PCI_COMMAND_MASTER  0x0004
+
+#define PCI_BAR_IO          0x01   /* BAR bit 0: I/O space */
+
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+#define PCI_CLASS_BRIDGE    0x06
+#define PCI_SUBCLASS_PCI    0x04
+
+struct pci_device {
+    uint8_t bus, dev, func;
+    uint8_t class_code, subclass, prog_if;
+    uint16_t vendor, device;
+    uint8_t irq_line;
+    uint32_t bar[6];
+};
+
+/* Scan the buses; returns the number of functions found */
+int pci_init(void);
+
+uint32_t pci_count(void);
+const struct pci_device *pci_get(uint32_t i);
+
+/* First function of the given class/subclass, or NULL */
+const struct pci_device *pci_find_class(uint8_t class_code, uint8_t subclass);
+
+uint32_t pci_config_read32(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off);
+uint16_t pci_config_read16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off);
+uint8_t  pci_config_read8(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off);
+void pci_config_write16(uint8_t bus, uint8_t dev, uint8_t func, uint8_t off, uint16_t val);
+
+/* Turn on I/O decoding and bus mastering in the command register */
+void pci_enable_bus_master(const struct pci_device *d);
+
+/* I/O port base of an I/O BAR; 0 if the BAR is memory or unset */
+uint16_t pci_bar_io(const struct pci_device *d, int n);
+
+#endif /* PCI_H */
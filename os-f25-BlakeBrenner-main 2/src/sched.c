@@ -0,0 +1,361 @@
+#include "sched.h"
+#include "defer.h"
+#include "interrupt.h"
+#include "kmalloc.h"
+#include "page.h"
+#include "paging.h"
+#include "spinlock.h"
+#include "vm.h"
+
+extern void switch_context(uint32_t *save_esp, uint32_t next_esp);
+
+/* Everything below is touched with interrupts off: the PIT handler is the
+   only other party, and it runs on this CPU. */
+static struct thread *current = 0;
+static struct thread *idle_thread = 0;
+static struct thread *rq_head = 0, *rq_tail = 0;   // FIFO of READY threads
+static struct thread *zombies = 0;                   // DEAD, stack not freed yet
+static struct thread *all_threads = 0;
+static uint32_t next_tid = 0;
+static uint32_t slice_left = 0;
+
+/* ---------- Run queue ---------- */
+
+static void rq_push(struct thread *t) {
+    t->next = 0;
+    if (rq_tail)
+        rq_tail->next = t;
+    else
+        rq_head = t;
+    rq_tail = t;
+}
+
+static struct thread *rq_pop(void) {
+    struct thread *t = rq_head;
+    if (t) {
+        rq_head = t->next;
+        if (!rq_head)
+            rq_tail = 0;
+        t->next = 0;
+    }
+    return t;
+}
+
+/* ---------- Switching ---------- */
+
+void schedule(void) {
+    struct thread *prev = current;
+    this_cpu()->need_resched = 0;
+
+    struct thread *next = rq_pop();
+    if (!next) {
+        if (prev->state == THREAD_RUNNING) {
+            slice_left = SCHED_QUANTUM;   // nobody else wants the CPU
+            return;
+        }
+        next = idle_thread;
+    }
+
+    // The idle thread is never queued; it runs when the queue is empty
+    if (prev->state == THREAD_RUNNING) {
+        prev->state = THREAD_READY;
+        if (prev != idle_thread)
+            rq_push(prev);
+    }
+
+    next->state = THREAD_RUNNING;
+    current = next;
+    slice_left = SCHED_QUANTUM;
+    if (next != prev)
+        switch_context(&prev->esp, next->esp);
+}
+
+void sched_tick(uint32_t ticks) {
+    if (!current)
+        return;
+    current->ticks += ticks;
+
+    slice_left = ticks < slice_left ? slice_left - ticks : 0;
+    if (slice_left == 0 || (current == idle_thread && rq_head)) {
+        struct cpu *c = this_cpu();
+        if (c->preempt_count)
+            c->need_resched = 1;
+        else
+            schedule();
+    }
+}
+
+int sched_wants_tick(void) {
+    return rq_head != 0;
+}
+
+/* The outermost preempt_enable() after a deferred tick or deferred work.
+   A fault handler (interrupts off) leaves both to the next tick. */
+void preempt_resched(void) {
+    defer_run();
+    uint32_t flags = irq_save();
+    if ((flags & 0x200u) && current && !this_cpu()->preempt_count)
+        schedule();
+    irq_restore(flags);
+}
+
+void thread_yield(void) {
+    if (!current)
+        return;
+    uint32_t flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+/* Timer callback, interrupts off */
+static void sleep_expired(void *arg) {
+    struct thread *t = arg;
+    t->state = THREAD_READY;
+    rq_push(t);
+}
+
+static void boot_sleep_expired(void *arg) {
+    *(volatile int *)arg = 1;
+}
+
+void thread_sleep(uint32_t ticks) {
+    if (!current) {
+        // Before sched_init(): just halt until the timer fires
+        struct timer t = { 0 };
+        volatile int done = 0;
+        timer_add(&t, ticks, boot_sleep_expired, (void *)&done);
+        while (!done)
+            __asm__ __volatile__("hlt");
+        return;
+    }
+
+    uint32_t flags = irq_save();
+    current->state = THREAD_SLEEPING;
+    timer_add(&current->sleep_timer, ticks, sleep_expired, current);
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_exit(void) {
+    irq_save();
+    current->state = THREAD_DEAD;
+    current->next = zombies;
+    zombies = current;
+    schedule();
+    for (;;)   // not reached: a dead thread is never picked again
+        __asm__ __volatile__("cli; hlt");
+}
+
+/* ---------- Wait queues ---------- */
+
+static void wq_remove(struct wait_queue *wq, struct thread *t) {
+    struct thread *prev = 0;
+    for (struct thread *w = wq->head; w; prev = w, w = w->next) {
+        if (w != t)
+            continue;
+        if (prev)
+            prev->next = t->next;
+        else
+            wq->head = t->next;
+        if (wq->tail == t)
+            wq->tail = prev;
+        t->next = 0;
+        return;
+    }
+}
+
+static void wake_thread(struct thread *t) {
+    t->wq = 0;
+    t->state = THREAD_READY;
+    rq_push(t);
+}
+
+/* Timer callback, interrupts off */
+static void wait_expired(void *arg) {
+    struct thread *t = arg;
+    if (t->state != THREAD_BLOCKED)
+        return;
+    wq_remove(t->wq, t);
+    t->timed_out = 1;
+    wake_thread(t);
+}
+
+int wait_queue_sleep(struct wait_queue *wq, uint32_t timeout) {
+    if (!current) {
+        __asm__ __volatile__("sti; hlt; cli" ::: "memory");   // sti;hlt is atomic
+        return 1;
+    }
+
+    struct thread *t = current;
+    t->state = THREAD_BLOCKED;
+    t->wq = wq;
+    t->timed_out = 0;
+    t->next = 0;
+    if (wq->tail)
+        wq->tail->next = t;
+    else
+        wq->head = t;
+    wq->tail = t;
+
+    if (timeout)
+        timer_add(&t->sleep_timer, timeout, wait_expired, t);
+    schedule();
+    if (timeout)
+        timer_cancel(&t->sleep_timer);
+    return !t->timed_out;
+}
+
+void wake_up(struct wait_queue *wq) {
+    uint32_t flags = irq_save();
+    struct thread *t = wq->head;
+    wq->head = wq->tail = 0;
+    if (t) {
+        while (t) {
+            struct thread *next = t->next;
+            wake_thread(t);
+            t = next;
+        }
+        timer_kick();
+    }
+    irq_restore(flags);
+}
+
+void wake_up_one(struct wait_queue *wq) {
+    uint32_t flags = irq_save();
+    struct thread *t = wq->head;
+    if (t) {
+        wq->head = t->next;
+        if (!wq->head)
+            wq->tail = 0;
+        wake_thread(t);
+        timer_kick();
+    }
+    irq_restore(flags);
+}
+
+/* ---------- Creation / teardown ---------- */
+
+/* A dead thread cannot free the stack it is running on; whoever comes
+   next does it */
+static void reap_zombies(void) {
+    uint32_t flags = irq_save();
+    struct thread *z = zombies;
+    zombies = 0;
+    for (struct thread *t = z; t; t = t->next) {
+        struct thread **link = &all_threads;
+        while (*link != t)
+            link = &(*link)->all_next;
+        *link = t->all_next;
+    }
+    irq_restore(flags);
+
+    while (z) {
+        struct thread *next = z->next;
+        vm_release(z->stack);
+        kfree(z);
+        z = next;
+    }
+}
+
+/* First code run by a new thread: schedule() switched here with
+   interrupts off */
+static void thread_start(void) {
+    struct thread *t = current;
+    __asm__ __volatile__("sti");
+    t->entry(t->arg);
+    thread_exit();
+}
+
+static struct thread *thread_alloc(const char *name, void (*fn)(void *), void *arg) {
+    struct thread *t = kmalloc(sizeof(*t));
+    if (!t)
+        return 0;
+
+    // Frames for the whole stack up front, with an unmapped guard page below
+    void *stack = vm_reserve(THREAD_STACK_SIZE + PAGE_SIZE, VM_WRITE | VM_POPULATE | VM_GUARD, "stack");
+    if (!stack) {
+        kfree(t);
+        return 0;
+    }
+
+    // Frame consumed by switch_context(): edi, esi, ebx, ebp, return address
+    uint32_t *sp = (uint32_t *)((uint8_t *)stack + PAGE_SIZE + THREAD_STACK_SIZE);
+    *--sp = 0;                          // thread_start() never returns
+    *--sp = (uint32_t)thread_start;
+    for (int i = 0; i < 4; i++)
+        *--sp = 0;
+
+    t->esp = (uint32_t)sp;
+    t->stack = stack;
+    t->entry = fn;
+    t->arg = arg;
+    t->state = THREAD_READY;
+    t->ticks = 0;
+    t->next = 0;
+    t->sleep_timer.pprev = 0;
+    t->wq = 0;
+    int i = 0;
+    for (; name && name[i] && i < (int)sizeof(t->name) - 1; i++)
+        t->name[i] = name[i];
+    t->name[i] = 0;
+
+    uint32_t flags = irq_save();
+    t->id = next_tid++;
+    t->all_next = all_threads;
+    all_threads = t;
+    irq_restore(flags);
+    return t;
+}
+
+struct thread *thread_create(const char *name, void (*fn)(void *), void *arg) {
+    reap_zombies();
+    struct thread *t = thread_alloc(name, fn, arg);
+    if (!t)
+        return 0;
+
+    uint32_t flags = irq_save();
+    rq_push(t);
+    timer_kick();   // restart time slicing if the timer went quiet
+    irq_restore(flags);
+    return t;
+}
+
+static void idle_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        reap_zombies();
+        if (rq_head)
+            thread_yield();
+        else if (!pfa_zero_idle())
+            __asm__ __volatile__("hlt");
+    }
+}
+
+void sched_init(const char *name) {
+    static struct thread boot;
+
+    boot.state = THREAD_RUNNING;
+    boot.stack = 0;
+    boot.id = next_tid++;
+    int i = 0;
+    for (; name[i] && i < (int)sizeof(boot.name) - 1; i++)
+        boot.name[i] = name[i];
+    boot.name[i] = 0;
+    boot.all_next = all_threads;
+    all_threads = &boot;
+
+    idle_thread = thread_alloc("idle", idle_main, 0);
+
+    uint32_t flags = irq_save();
+    slice_left = SCHED_QUANTUM;
+    current = &boot;   // from here on the PIT preempts
+    irq_restore(flags);
+}
+
+struct thread *thread_current(void) {
+    return current;
+}
+
+struct thread *thread_list(void) {
+    return all_threads;
+}
@@ -0,0 +1,132 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include "smp.h"
+#include "timer.h"
+#include "spinlock.h"
+
+/* Preemptive kernel threads on the bootstrap processor. Timer interrupts
+   drive round-robin time slices of SCHED_QUANTUM ticks while threads are
+   waiting for the CPU; a thread that sleeps, yields or exits gives up the
+   rest of its slice. When nothing is runnable the idle thread clears
+   frames for the zero pool or halts, and the timer stops ticking.
+
+   Code that is not reentrant (the heap, page tables, vm regions, the
+   console) brackets itself with preempt_disable()/preempt_enable(); a
+   tick that lands inside such a section defers the switch until the
+   outermost preempt_enable(). */
+
+#define SCHED_QUANTUM       2        /* ticks per time slice */
+#define THREAD_STACK_SIZE   16384u   /* plus one unmapped guard page below */
+
+enum thread_state {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_SLEEPING,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+};
+
+struct thread;
+
+/* Threads blocked on an event, woken in FIFO order */
+struct wait_queue {
+    struct thread *head, *tail;
+};
+
+#define WAIT_QUEUE_INIT { 0, 0 }
+
+struct thread {
+    struct thread *next;      // run queue / wait queue / zombie list
+    struct thread *all_next;  // every live thread, for introspection
+    uint32_t esp;             // saved stack pointer while switched out
+    uint32_t id;
+    enum thread_state state;
+    struct timer sleep_timer; // THREAD_SLEEPING, or a timed THREAD_BLOCKED
+    struct wait_queue *wq;    // THREAD_BLOCKED: the queue it is on
+    int timed_out;
+    uint32_t ticks;           // ticks spent running
+    void (*entry)(void *arg);
+    void *arg;
+    void *stack;              // vm region holding the stack (NULL: boot stack)
+    char name[16];
+};
+
+/* Turn the boot flow into the first thread and create the idle thread.
+   Call once, with interrupts enabled, before anything else here. */
+void sched_init(const char *name);
+
+/* Start fn(arg) in a new thread; returns NULL when out of memory */
+struct thread *thread_create(const char *name, void (*fn)(void *), void *arg);
+
+void thread_yield(void);
+void thread_sleep(uint32_t ticks);
+void thread_exit(void) __attribute__((noreturn));
+struct thread *thread_current(void);
+
+/* Head of the list of live threads */
+struct thread *thread_list(void);
+
+/* Called by the PIT handler after the EOI with the number of whole ticks
+   since its previous call (0 or more) */
+void sched_tick(uint32_t ticks);
+
+/* Non-zero while threads are waiting for the CPU, so the timer has to keep
+   a periodic tick for time slicing */
+int sched_wants_tick(void);
+
+/* Give the CPU to the next runnable thread. Interrupts must be off. */
+void schedule(void);
+
+/* Block the current thread on wq until woken or, if timeout is not 0,
+   until that many ticks pass. Interrupts must be off (they are off again
+   on return) and preemption enabled. Returns 0 on timeout. Before
+   sched_init() it just halts until the next interrupt. */
+int wait_queue_sleep(struct wait_queue *wq, uint32_t timeout);
+
+/* Make every / the first waiter runnable. Safe from interrupt handlers
+   and bottom halves. */
+void wake_up(struct wait_queue *wq);
+void wake_up_one(struct wait_queue *wq);
+
+/* Sleep on wq until cond holds. The check and the sleep happen with
+   interrupts off, so a wake_up() from an IRQ in between is not lost. */
+#define wait_event(wq, cond) do {                                   \
+        uint32_t __flags = irq_save();                              \
+        while (!(cond))                                             \
+            wait_queue_sleep((wq), 0);                              \
+        irq_restore(__flags);                                       \
+    } while (0)
+
+/* As wait_event(), giving up after `ticks`; evaluates to cond's final
+   truth value */
+#define wait_event_timeout(wq, cond, ticks) ({                      \
+        uint32_t __flags = irq_save();                              \
+        uint64_t __end = timer_ticks64() + (ticks);                 \
+        int __ok;                                                   \
+        while (!(__ok = !!(cond))) {                                \
+            uint64_t __now = timer_ticks64();                       \
+            if (__now >= __end)                                     \
+                break;                                              \
+            wait_queue_sleep((wq), (uint32_t)(__end - __now));      \
+        }                                                           \
+        irq_restore(__flags);                                       \
+        __ok;                                                       \
+    })
+
+static inline void preempt_disable(void) {
+    this_cpu()->preempt_count++;
+    __asm__ __volatile__("" ::: "memory");
+}
+
+void preempt_resched(void);
+
+static inline void preempt_enable(void) {
+    struct cpu *c = this_cpu();
+    __asm__ __volatile__("" ::: "memory");
+    if (--c->preempt_count == 0 && c->need_resched)
+        preempt_resched();
+}
+
+#endif /* SCHED_H */
@@ -4,9 +4,25 @@
 #include "paging.h"
 #include "interrupt.h"
 #include "shell.h"
+#include "multiboot.h"
+#include "kmalloc.h"
+#include "vm.h"
+#include "smp.h"
+#include "taskpool.h"
+#include "sched.h"
+#include "timer.h"
+#include "clock.h"
+#include "defer.h"
+#include "ide.h"
+#include "pci.h"
+#include "blk.h"
+#include "virtio_blk.h"
+#include "disk.h"
+#include "fat.h"
 
 extern int putc(int ch);
 extern void vga_clear(void);
+extern void memset(char *s, char c, unsigned n);
 
 /* ---------- Helpers ---------- */
 
@@ -78,6 +94,32 @@ static int parse_hex32(const char *s, uint32_t *out) {
     return 0;
 }
 
+/* esp_printf has no 64-bit conversions */
+static char *fmt_u64(char *buf, uint64_t v) {
+    char tmp[21];
+    int n = 0;
+    do {
+        uint32_t digit;
+        v = div64_32(v, 10, &digit);
+        tmp[n++] = '0' + digit;
+    } while (v);
+    for (int i = 0; i < n; i++)
+        buf[i] = tmp[n - 1 - i];
+    buf[n] = 0;
+    return buf;
+}
+
+/* Print ns as seconds with microsecond precision */
+static void print_seconds(uint64_t ns) {
+    uint32_t us_rem, sec_rem;
+    char buf[21];
+    uint64_t us = div64_32(ns, 1000, &us_rem);
+    uint64_t sec = div64_32(us, 1000000, &sec_rem);
+    esp_printf(putc, "%s.", fmt_u64(buf, sec));
+    for (uint32_t d = 100000; d; d /= 10)
+        esp_printf(putc, "%c", '0' + (sec_rem / d) % 10);
+}
+
 int strcmp(const char *a, const char *b) {
     while (*a && (*a == *b)) { a++; b++; }
     return (unsigned char)*a - (unsigned char)*b;
@@ -93,17 +135,39 @@ static void cmd_help(void) {
         "  echo <text>       - print text\n"
         "  meminfo           - show memory statistics\n"
         "  frames            - list free page frames\n"
+        "  memmap            - show usable RAM from the boot memory map\n"
         "  alloc <n>         - allocate n pages (test)\n"
+        "  heap              - show kernel heap size classes\n"
+        "  vmreserve <size>  - reserve demand-paged memory\n"
+        "  vmrelease <addr>  - release a reservation\n"
+        "  vmclone <addr>    - copy-on-write clone of a region\n"
+        "  vmlist            - list reserved regions\n"
         "  v2p <addr>        - translate virtual to physical\n"
         "  ptdump            - dump page directory/tables\n"
         "  read32 <addr>     - read 32-bit value from address\n"
         "  write32 <a> <v>   - write value to address\n"
         "  hexdump <a> [len] - hex dump memory region\n"
         "  map <pa> <va>     - map physical to virtual page\n"
+        "  unmap <va>        - remove a virtual page mapping\n"
         "  uptime            - show system uptime\n"
         "  sleep <sec>       - sleep for N seconds\n"
         "  info              - kernel information\n"
         "  kbtest            - test keyboard buffer\n"
+        "  cpus              - list processors and task pool counters\n"
+        "  checksum <a> <n>  - word sum/xor of memory, on all CPUs\n"
+        "  memscan <a> <n> <v> - count 32-bit words equal to v, on all CPUs\n"
+        "  zerofill          - fill the pre-cleared frame pool on all CPUs\n"
+        "  lspci             - list PCI functions found at boot\n"
+        "  diskinfo          - show what the ATA drive reported\n"
+        "  diskread <lba> [n] - read n sectors (hex), dump the first 64 bytes\n"
+        "  diskwrite <lba> <byte> [n] - fill n sectors with a byte (write-back)\n"
+        "  sync              - write dirty sectors and flush the drive cache\n"
+        "  ls                - list the root directory of the FAT volume\n"
+        "  cat <file>        - print a file from the FAT volume\n"
+        "  fsbench <file> [kb] - read a file sequentially in kb-sized chunks\n"
+        "  time <cmd...>     - run a command and report wall time and cycles\n"
+        "  ps                - list kernel threads\n"
+        "  bg <cmd...>       - run a command in a new thread\n"
     );
 }
 
@@ -120,35 +184,47 @@ static void cmd_echo(int argc,char *argv[]) {
 }
 
 static void cmd_meminfo(void) {
-    extern struct ppage *free_list_head;
-    
-    // Count manually to debug
-    int manual_count = 0;
-    struct ppage *p = free_list_head;
-    while (p) {
-        manual_count++;
-        p = p->next;
-    }
-    
     unsigned free = pfa_free_count();
-    unsigned total = 128;
+    unsigned total = pfa_total_count();
     esp_printf(putc, "total frames: %d\n", (int)total);
     esp_printf(putc, "free frames : %d\n", (int)free);
-    esp_printf(putc, "manual count: %d\n", manual_count);
-    
-    if (free_list_head == 0) {
-        esp_printf(putc, "WARNING: free_list_head is NULL!\n");
-    }
+    esp_printf(putc, "pre-cleared : %d\n", (int)pfa_zeroed_count());
+
+    esp_printf(putc, "free blocks by order:\n");
+    for (unsigned k = 0; k < PFA_MAX_ORDER; k++)
+        esp_printf(putc, "  order %d (%d frames): %d\n",
+                   (int)k, (int)(1u << k), (int)pfa_free_blocks(k));
 }
 
 static void cmd_frames(void) {
-    extern struct ppage *free_list_head;
-    struct ppage *p = free_list_head;
     int i = 0;
-    for (; p && i < 64; p = p->next, i++)
-        esp_printf(putc, "#%02d: phys=0x%08x\n", i,
-                   (uint32_t)p->physical_addr);
-    if (p) esp_printf(putc, "(truncated)\n");
+    for (unsigned k = 0; k < PFA_MAX_ORDER; k++) {
+        for (struct ppage *p = pfa_free_list(k); p; p = p->next, i++) {
+            if (i >= 64) {
+                esp_printf(putc, "(truncated)\n");
+                return;
+            }
+            esp_printf(putc, "#%02d: phys=0x%08x order=%d\n", i,
+                       (uint32_t)p->physical_addr, (int)k);
+        }
+    }
+}
+
+static void cmd_memmap(void) {
+    const struct mem_region *r = multiboot_regions();
+    int n = multiboot_region_count();
+    uint32_t total_kb = 0;
+
+    for (int i = 0; i < n; i++) {
+        esp_printf(putc, "  0x%08x - 0x%08x (%d KiB)\n", r[i].base,
+                   r[i].base + r[i].length - 1, (int)(r[i].length >> 10));
+        total_kb += r[i].length >> 10;
+    }
+    esp_printf(putc, "usable RAM: %d KiB in %d region(s)\n", (int)total_kb, n);
+
+    uint32_t lo, hi;
+    pfa_metadata_range(&lo, &hi);
+    esp_printf(putc, "frame descriptors: 0x%08x - 0x%08x\n", lo, hi);
 }
 
 static void cmd_v2p(int argc,char *argv[]) {
@@ -159,8 +235,10 @@ static void cmd_v2p(int argc,char *argv[]) {
         return;
     }
     void *pa = get_physaddr((void*)va);
+    uint32_t pde = ((volatile uint32_t*)0xFFFFF000)[va >> 22];
     if (!pa) esp_printf(putc,"not mapped\n");
-    else     esp_printf(putc,"0x%08x -> 0x%08x\n",va,(uint32_t)pa);
+    else     esp_printf(putc,"0x%08x -> 0x%08x%s\n",va,(uint32_t)pa,
+                        (pde & PDE_PS) ? " (4 MiB page)" : "");
 }
 
 static void cmd_ptdump(void) {
@@ -171,6 +249,10 @@ static void cmd_ptdump(void) {
         unsigned long pde = pd[i];
         if (!(pde & 1)) continue;
 
+        if (pde & PDE_PS) {
+            esp_printf(putc,"PDE %d: 0x%08x (4 MiB page)\n", (int)i,(uint32_t)pde);
+            continue;
+        }
         esp_printf(putc,"PDE %d: 0x%08x\n", (int)i,(uint32_t)pde);
 
         unsigned long *pt = (unsigned long*)(0xFFC00000 + i*0x1000);
@@ -190,19 +272,21 @@ static void cmd_read32(int argc,char *argv[]) {
     uint32_t va;
     if (parse_hex32(argv[1],&va)) { esp_printf(putc,"invalid hex\n"); return; }
     void *pa = get_physaddr((void*)va);
-    if (!pa) {
+    if (!pa && !vm_find(va)) {
         esp_printf(putc,"not mapped\n");
         return;
     }
-    uint32_t val = *(volatile uint32_t*)va;
+    uint32_t val = *(volatile uint32_t*)va;   // may demand-fault a reserved page in
+    pa = get_physaddr((void*)va);
     esp_printf(putc,"VA=0x%08x PA=0x%08x val=0x%08x\n",
                va,(uint32_t)pa,val);
 }
 
 static void cmd_uptime(void) {
     uint32_t t = timer_ticks();
-    uint32_t seconds = t / 100;
-    esp_printf(putc,"ticks=%d seconds=%d\n", (int)t, (int)seconds);
+    esp_printf(putc,"ticks=%d seconds=", (int)t);
+    print_seconds(clock_ns());
+    esp_printf(putc," timer irqs=%d\n", (int)timer_irq_count());
 }
 
 /* ==================== NEW COMMANDS ==================== */
@@ -224,12 +308,13 @@ static void cmd_write32(int argc, char *argv[]) {
     }
     
     void *pa = get_physaddr((void*)va);
-    if (!pa) {
+    if (!pa && !vm_find(va)) {
         esp_printf(putc, "not mapped\n");
         return;
     }
     
-    *(volatile uint32_t*)va = val;
+    *(volatile uint32_t*)va = val;   // may demand-fault a reserved page in
+    pa = get_physaddr((void*)va);
     esp_printf(putc, "wrote 0x%08x to VA=0x%08x (PA=0x%08x)\n",
                val, va, (uint32_t)pa);
 }
@@ -261,7 +346,7 @@ static void cmd_hexdump(int argc, char *argv[]) {
     
     for (uint32_t addr = start; addr < end; addr += 16) {
         void *pa = get_physaddr((void*)addr);
-        if (!pa) {
+        if (!pa && !vm_find(addr)) {
             esp_printf(putc, "0x%08x: [not mapped]\n", addr);
             continue;
         }
@@ -318,7 +403,8 @@ static void cmd_alloc(int argc, char *argv[]) {
     struct ppage *p = pages;
     int i = 0;
     while (p && i < 10) {
-        esp_printf(putc, "  [%d] phys=0x%08x\n", i, (uint32_t)p->physical_addr);
+        esp_printf(putc, "  [%d] phys=0x%08x order=%d\n", i,
+                   (uint32_t)p->physical_addr, (int)p->order);
         p = p->next;
         i++;
     }
@@ -328,32 +414,113 @@ static void cmd_alloc(int argc, char *argv[]) {
     esp_printf(putc, "pages freed (test successful)\n");
 }
 
+static void cmd_heap(void) {
+    esp_printf(putc, "class   size  pages  in-use  free\n");
+    for (int c = 0; c < KMALLOC_NCLASSES; c++) {
+        struct kmalloc_class_stats st;
+        kmalloc_class_stats(c, &st);
+        esp_printf(putc, "  %d    %4d  %5d  %6d  %4d\n", c, (int)st.size,
+                   (int)st.pages, (int)st.in_use, (int)st.free);
+    }
+    esp_printf(putc, "large pages in use: %d\n", (int)kmalloc_large_pages());
+    esp_printf(putc, "heap VA: 0x%08x - 0x%08x\n", KHEAP_BASE, kmalloc_heap_top());
+}
+
+static void cmd_vmreserve(int argc, char *argv[]) {
+    if (argc != 2) {
+        esp_printf(putc, "usage: vmreserve <size>\n");
+        return;
+    }
+
+    uint32_t size;
+    if (parse_hex32(argv[1], &size) || size == 0) {
+        esp_printf(putc, "invalid size\n");
+        return;
+    }
+
+    void *va = vm_reserve(size, VM_WRITE, "shell");
+    if (!va) {
+        esp_printf(putc, "reservation failed (out of address space)\n");
+        return;
+    }
+    esp_printf(putc, "reserved 0x%08x - 0x%08x (backed on first touch)\n",
+               (uint32_t)va, (uint32_t)va + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)));
+}
+
+static void cmd_vmrelease(int argc, char *argv[]) {
+    if (argc != 2) {
+        esp_printf(putc, "usage: vmrelease <addr>\n");
+        return;
+    }
+
+    uint32_t va;
+    if (parse_hex32(argv[1], &va)) {
+        esp_printf(putc, "invalid address\n");
+        return;
+    }
+    if (vm_release((void*)va))
+        esp_printf(putc, "no region starts at 0x%08x\n", va);
+    else
+        esp_printf(putc, "released\n");
+}
+
+static void cmd_vmclone(int argc, char *argv[]) {
+    if (argc != 2) {
+        esp_printf(putc, "usage: vmclone <addr>\n");
+        return;
+    }
+
+    uint32_t va;
+    if (parse_hex32(argv[1], &va)) {
+        esp_printf(putc, "invalid address\n");
+        return;
+    }
+    void *copy = vm_clone((void*)va);
+    if (!copy)
+        esp_printf(putc, "clone failed (no region at 0x%08x or out of memory)\n", va);
+    else
+        esp_printf(putc, "cloned to 0x%08x (copy-on-write)\n", (uint32_t)copy);
+}
+
+static void cmd_vmlist(void) {
+    int n = 0;
+    for (struct vm_region *r = vm_regions(); r; r = r->next, n++) {
+        esp_printf(putc, "  0x%08x - 0x%08x %s resident=%d/%d zero=%d %s\n", r->start, r->end,
+                   (r->flags & VM_DEVICE) ? "io" : (r->flags & VM_WRITE) ? "rw" : "ro", (int)r->resident,
+                   (int)((r->end - r->start) / PAGE_SIZE), (int)r->zero_mapped,
+                   r->name ? r->name : "");
+    }
+    if (!n) esp_printf(putc, "no regions\n");
+}
+
 static void cmd_info(void) {
     extern char _end_kernel;
-    extern struct ppage *free_list_head;
-    
-    // Count manually
-    int manual_count = 0;
-    struct ppage *p = free_list_head;
-    while (p) {
-        manual_count++;
-        p = p->next;
-    }
     
     esp_printf(putc, "Kernel Information:\n");
     esp_printf(putc, "  Kernel end: 0x%08x\n", (uint32_t)&_end_kernel);
     esp_printf(putc, "  Page size:  %d bytes\n", (int)PAGE_SIZE);
     esp_printf(putc, "  PD address: 0x%08x\n", (uint32_t)kernel_pd);
+    esp_printf(putc, "  Page tables: %d (+%d 4 MiB PDEs)\n",
+               (int)paging_pt_count(), (int)paging_large_count());
     
     unsigned free = pfa_free_count();
-    unsigned total = 128;
+    unsigned total = pfa_total_count();
     unsigned used = total - free;
     
     esp_printf(putc, "  Memory:     %d / %d frames used\n", (int)used, (int)total);
-    esp_printf(putc, "  Free count: %d (manual: %d)\n", (int)free, manual_count);
+    esp_printf(putc, "  Free count: %d\n", (int)free);
     
     uint32_t t = timer_ticks();
-    esp_printf(putc, "  Uptime:     %d seconds\n", (int)(t / 100));
+    esp_printf(putc, "  Uptime:     %d seconds\n", (int)(t / TIMER_HZ));
+    if (clock_tsc_khz())
+        esp_printf(putc, "  TSC:        %d kHz\n", (int)clock_tsc_khz());
+    else
+        esp_printf(putc, "  TSC:        none (PIT clock)\n");
+
+    struct defer_stats ds;
+    defer_get_stats(&ds);
+    esp_printf(putc, "  Deferred:   %d queued, %d run, %d dropped, max depth %d\n",
+               (int)ds.queued, (int)ds.run, (int)ds.dropped, (int)ds.max_depth);
 }
 
 static void cmd_sleep(int argc, char *argv[]) {
@@ -373,14 +540,8 @@ static void cmd_sleep(int argc, char *argv[]) {
         return;
     }
     
-    uint32_t start = timer_ticks();
-    uint32_t target = start + (seconds * 100);
-    
     esp_printf(putc, "sleeping for %d seconds...\n", (int)seconds);
-    
-    while (timer_ticks() < target) {
-        __asm__ __volatile__("hlt");
-    }
+    thread_sleep(seconds * TIMER_HZ);
     
     esp_printf(putc, "awake!\n");
 }
@@ -424,6 +585,462 @@ static void cmd_map(int argc, char *argv[]) {
     }
 }
 
+static void cmd_unmap(int argc, char *argv[]) {
+    if (argc != 2) {
+        esp_printf(putc, "usage: unmap <virt_addr>\n");
+        return;
+    }
+
+    uint32_t va;
+    if (parse_hex32(argv[1], &va)) {
+        esp_printf(putc, "invalid virtual address\n");
+        return;
+    }
+
+    void *pa = unmap_page((void*)(va & ~0xFFF));
+    if (!pa) {
+        esp_printf(putc, "not mapped\n");
+        return;
+    }
+    esp_printf(putc, "unmapped VA=0x%08x (was PA=0x%08x), page tables: %d\n",
+               va & ~0xFFF, (uint32_t)pa, (int)paging_pt_count());
+}
+
+/* ---------- Parallel jobs (task pool) ---------- */
+
+#define PAR_MAX_TASKS 64
+
+struct scan_chunk {
+    const volatile uint32_t *p;
+    uint32_t words;
+    uint32_t key;       // memscan: value searched for
+    uint32_t sum;       // checksum: 32-bit word sum
+    uint32_t xor;       // checksum: 32-bit word xor
+    uint32_t hits;      // memscan: matching words
+};
+
+/* One per command: with bg, several can be in flight at once */
+struct par_job {
+    struct task tasks[PAR_MAX_TASKS];
+    struct scan_chunk chunks[PAR_MAX_TASKS];
+};
+
+static void checksum_task(void *arg) {
+    struct scan_chunk *c = arg;
+    uint32_t sum = 0, x = 0;
+    for (uint32_t i = 0; i < c->words; i++) {
+        uint32_t w = c->p[i];
+        sum += w;
+        x ^= w;
+    }
+    c->sum = sum;
+    c->xor = x;
+}
+
+static void memscan_task(void *arg) {
+    struct scan_chunk *c = arg;
+    uint32_t hits = 0;
+    for (uint32_t i = 0; i < c->words; i++)
+        if (c->p[i] == c->key)
+            hits++;
+    c->hits = hits;
+}
+
+/* Split [va, va+len) into word-aligned chunks of job, one task each. Every
+   page must already be mapped: tasks on other CPUs cannot take page
+   faults. Returns the number of chunks, 0 on bad arguments. */
+static int par_split(struct par_job *job, int argc, char *argv[], const char *usage, uint32_t *key) {
+    uint32_t va, len;
+    if (argc != (key ? 4 : 3) || parse_hex32(argv[1], &va) || parse_hex32(argv[2], &len) ||
+        (key && parse_hex32(argv[3], key))) {
+        esp_printf(putc, "usage: %s\n", usage);
+        return 0;
+    }
+    va &= ~3u;
+    len &= ~3u;
+    if (!len || va + len < va) {
+        esp_printf(putc, "invalid range\n");
+        return 0;
+    }
+    uint32_t npages = ((va & (PAGE_SIZE - 1)) + len + PAGE_SIZE - 1) / PAGE_SIZE;
+    for (uint32_t i = 0; i < npages; i++) {
+        uint32_t pg = (va & ~(PAGE_SIZE - 1)) + i * PAGE_SIZE;
+        if (!get_physaddr((void*)pg)) {
+            esp_printf(putc, "0x%08x is not mapped\n", pg);
+            return 0;
+        }
+    }
+
+    // At least 4 KiB per task, at most PAR_MAX_TASKS tasks
+    uint32_t words = len / 4;
+    uint32_t per = (words + PAR_MAX_TASKS - 1) / PAR_MAX_TASKS;
+    if (per < PAGE_SIZE / 4) per = PAGE_SIZE / 4;
+
+    int n = 0;
+    for (uint32_t off = 0; off < words; off += per, n++) {
+        struct scan_chunk *c = &job->chunks[n];
+        c->p = (const volatile uint32_t*)va + off;
+        c->words = (words - off < per) ? words - off : per;
+        c->key = key ? *key : 0;
+        c->sum = c->xor = c->hits = 0;
+    }
+    return n;
+}
+
+static void par_run(struct par_job *job, int n, void (*fn)(void *)) {
+    struct task_group g = { 0 };
+    for (int i = 0; i < n; i++)
+        task_submit(&g, &job->tasks[i], fn, &job->chunks[i]);
+    task_wait(&g);
+}
+
+static struct par_job *par_job_alloc(void) {
+    struct par_job *job = kmalloc(sizeof(*job));
+    if (!job)
+        esp_printf(putc, "out of memory\n");
+    return job;
+}
+
+static void cmd_checksum(int argc, char *argv[]) {
+    struct par_job *job = par_job_alloc();
+    if (!job) return;
+    int n = par_split(job, argc, argv, "checksum <addr> <len>", 0);
+    if (n) {
+        par_run(job, n, checksum_task);
+
+        uint32_t sum = 0, x = 0;
+        for (int i = 0; i < n; i++) {
+            sum += job->chunks[i].sum;
+            x ^= job->chunks[i].xor;
+        }
+        esp_printf(putc, "sum32=0x%08x xor32=0x%08x (%d tasks)\n", sum, x, n);
+    }
+    kfree(job);
+}
+
+static void cmd_memscan(int argc, char *argv[]) {
+    struct par_job *job = par_job_alloc();
+    if (!job) return;
+    uint32_t key;
+    int n = par_split(job, argc, argv, "memscan <addr> <len> <value>", &key);
+    if (n) {
+        par_run(job, n, memscan_task);
+
+        uint32_t hits = 0;
+        for (int i = 0; i < n; i++)
+            hits += job->chunks[i].hits;
+        esp_printf(putc, "0x%08x found %d times (%d tasks)\n", key, (int)hits, n);
+    }
+    kfree(job);
+}
+
+static void zerofill_task(void *arg) {
+    (void)arg;
+    while (pfa_zero_idle())
+        ;
+}
+
+static void cmd_zerofill(void) {
+    struct task tasks[SMP_MAX_CPUS];
+    uint32_t before = pfa_zeroed_count();
+    uint32_t n = smp_online_count();
+    struct task_group g = { 0 };
+    for (uint32_t i = 0; i < n && i < SMP_MAX_CPUS; i++)
+        task_submit(&g, &tasks[i], zerofill_task, 0);
+    task_wait(&g);
+    esp_printf(putc, "pre-cleared frames: %d -> %d\n", (int)before, (int)pfa_zeroed_count());
+}
+
+static void cmd_cpus(void) {
+    esp_printf(putc, "%d of %d CPUs online\n", (int)smp_online_count(), (int)smp_cpu_count());
+    for (uint32_t i = 0; i < smp_cpu_count(); i++) {
+        struct taskpool_stats st;
+        taskpool_stats(i, &st);
+        esp_printf(putc, "  cpu%d apic=%d %s tasks=%d stolen=%d\n", (int)i, (int)cpus[i].apic_id,
+                   cpus[i].online ? "online " : "offline", (int)st.executed, (int)st.stolen);
+    }
+}
+
+static void cmd_diskinfo(void) {
+    const struct disk *dk = disk_get();
+    if (!dk) {
+        esp_printf(putc, "no disk\n");
+        return;
+    }
+    esp_printf(putc, "  disk:     %s, %d MiB, %d sectors per request\n", dk->name,
+               (int)(dk->sectors >> 11), (int)dk->max_sectors);
+
+    const struct virtio_blk_info *vi = virtio_blk_get_info();
+    if (vi) {
+        struct virtio_blk_stats vs;
+        virtio_blk_get_stats(&vs);
+        esp_printf(putc, "  virtio:   port 0x%04x, irq %d, queue %d%s%s\n", (int)vi->iobase, (int)vi->irq,
+                   (int)vi->queue_size, vi->flush ? ", flush" : "", vi->ro ? ", read-only" : "");
+        esp_printf(putc, "  requests: %d, %d notifies, %d interrupts, %d waited for the ring, %d failed\n",
+                   (int)vs.requests, (int)vs.notifies, (int)vs.irqs, (int)vs.ring_full, (int)vs.errors);
+        esp_printf(putc, "  merging:  %d requests joined the one before, %d retried alone\n", (int)vs.merged,
+                   (int)vs.retries);
+    }
+
+    const struct ide_info *di = ide_get_info();
+    if (di) {
+        esp_printf(putc, "  model:    %s\n", di->model);
+        esp_printf(putc, "  sectors:  0x%08x%08x (%d MiB)\n", (uint32_t)(di->sectors >> 32),
+                   (uint32_t)di->sectors, (int)(di->sectors >> 11));
+        esp_printf(putc, "  LBA48:    %s\n", di->lba48 ? "yes" : "no");
+        if (di->multiple)
+            esp_printf(putc, "  multiple: %d sectors per interrupt\n", (int)di->multiple);
+        else
+            esp_printf(putc, "  multiple: not supported\n");
+        esp_printf(putc, "  transfer: %s\n", di->dma ? "bus-master DMA" : "PIO");
+        esp_printf(putc, "  max xfer: %d sectors per command\n", (int)ide_max_sectors());
+        struct ide_stats st;
+        ide_get_stats(&st);
+        esp_printf(putc, "  commands: %d DMA, %d PIO, %d flushes, %d failed\n", (int)st.dma, (int)st.pio,
+                   (int)st.flushes, (int)st.errors);
+        esp_printf(putc, "  elevator: %d requests merged, %d merged commands retried\n", (int)st.merged,
+                   (int)st.retries);
+    }
+
+    struct blk_stats bs;
+    blk_get_stats(&bs);
+    esp_printf(putc, "  cache:    %d hits, %d misses, %d evictions, %d read ahead\n", (int)bs.hits,
+               (int)bs.misses, (int)bs.evictions, (int)bs.readahead);
+    esp_printf(putc, "  writeback: %d dirty, %d sectors written (%d absorbed), %d batches\n",
+               (int)bs.dirty, (int)bs.written, (int)bs.absorbed, (int)bs.batches);
+    if (bs.stalls || bs.errors)
+        esp_printf(putc, "             %d stalls, %d errors\n", (int)bs.stalls, (int)bs.errors);
+}
+
+static void cmd_lspci(void) {
+    if (!pci_count()) {
+        esp_printf(putc, "no PCI devices\n");
+        return;
+    }
+    for (uint32_t i = 0; i < pci_count(); i++) {
+        const struct pci_device *d = pci_get(i);
+        esp_printf(putc, "  %02x:%02x.%d %04x:%04x class %02x.%02x.%02x", (int)d->bus, (int)d->dev,
+                   (int)d->func, (int)d->vendor, (int)d->device, (int)d->class_code,
+                   (int)d->subclass, (int)d->prog_if);
+        if (d->irq_line && d->irq_line != 0xFF)
+            esp_printf(putc, " irq %d", (int)d->irq_line);
+        esp_printf(putc, "\n");
+    }
+}
+
+static void cmd_diskread(int argc, char *argv[]) {
+    uint32_t lba, n = 1;
+    if (argc < 2 || argc > 3 || parse_hex32(argv[1], &lba) ||
+        (argc == 3 && (parse_hex32(argv[2], &n) || n == 0 || n > 0x80))) {
+        esp_printf(putc, "usage: diskread <lba> [sectors, max 80]\n");
+        return;
+    }
+    uint8_t *buf = kmalloc(n * SECTOR_SIZE);
+    if (!buf) {
+        esp_printf(putc, "out of memory\n");
+        return;
+    }
+    if (blk_read(lba, buf, n)) {
+        esp_printf(putc, "read error\n");
+    } else {
+        for (int row = 0; row < 4; row++) {
+            esp_printf(putc, "  %03x: ", row * 16);
+            for (int i = 0; i < 16; i++)
+                esp_printf(putc, "%02x ", buf[row * 16 + i]);
+            esp_printf(putc, "\n");
+        }
+    }
+    kfree(buf);
+}
+
+static void cmd_diskwrite(int argc, char *argv[]) {
+    uint32_t lba, byte, n = 1;
+    if (argc < 3 || argc > 4 || parse_hex32(argv[1], &lba) || parse_hex32(argv[2], &byte) ||
+        byte > 0xFF || (argc == 4 && (parse_hex32(argv[3], &n) || n == 0 || n > 0x80))) {
+        esp_printf(putc, "usage: diskwrite <lba> <byte> [sectors, max 80]\n");
+        return;
+    }
+    uint8_t *buf = kmalloc(n * SECTOR_SIZE);
+    if (!buf) {
+        esp_printf(putc, "out of memory\n");
+        return;
+    }
+    memset((char *)buf, (char)byte, n * SECTOR_SIZE);
+    if (blk_write(lba, buf, n))
+        esp_printf(putc, "write error\n");
+    kfree(buf);
+}
+
+static void cmd_sync(void) {
+    uint64_t t0 = clock_ns();
+    int err = blk_sync();
+    uint32_t us = (uint32_t)div64_32(clock_ns() - t0, 1000, 0);
+    esp_printf(putc, "%s in %d us\n", err ? "sync failed" : "synced", (int)us);
+}
+
+static void cmd_ls(void) {
+    struct root_directory_entry e;
+    for (uint32_t pos = 0; fatReadDir(&pos, &e) == 0; ) {
+        char name[13];
+        int n = 0;
+        for (int k = 0; k < 8 && e.file_name[k] != ' '; k++)
+            name[n++] = e.file_name[k];
+        if (e.file_extension[0] != ' ') {
+            name[n++] = '.';
+            for (int k = 0; k < 3 && e.file_extension[k] != ' '; k++)
+                name[n++] = e.file_extension[k];
+        }
+        name[n] = 0;
+        if (e.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)
+            esp_printf(putc, "  %s/\n", name);
+        else
+            esp_printf(putc, "  %s  %d\n", name, (int)e.file_size);
+    }
+}
+
+static void cmd_cat(int argc, char *argv[]) {
+    if (argc != 2) {
+        esp_printf(putc, "usage: cat <file>\n");
+        return;
+    }
+    struct file *f = fatOpen(argv[1]);
+    if (!f) {
+        esp_printf(putc, "%s: not found\n", argv[1]);
+        return;
+    }
+    char buf[256];
+    int n;
+    while ((n = fatRead(f, buf, sizeof(buf))) > 0)
+        for (int i = 0; i < n; i++)
+            putc(buf[i]);
+    if (n < 0)
+        esp_printf(putc, "\nread error\n");
+    fatClose(f);
+}
+
+/* Commands the disk has been given so far, whichever driver it is */
+static uint32_t disk_commands(void) {
+    struct ide_stats st;
+    struct virtio_blk_stats vs;
+    ide_get_stats(&st);
+    virtio_blk_get_stats(&vs);
+    return st.dma + st.pio + vs.requests;
+}
+
+/* Sequential read of a whole file; the counters show how much of it came
+   in through readahead */
+static void cmd_fsbench(int argc, char *argv[]) {
+    uint32_t kb = 4;
+    if (argc < 2 || argc > 3 || (argc == 3 && (parse_hex32(argv[2], &kb) || kb == 0 || kb > 0x100))) {
+        esp_printf(putc, "usage: fsbench <file> [chunk kb, hex, max 100]\n");
+        return;
+    }
+    struct file *f = fatOpen(argv[1]);
+    if (!f) {
+        esp_printf(putc, "%s: not found\n", argv[1]);
+        return;
+    }
+    uint8_t *buf = kmalloc(kb * 1024);
+    if (!buf) {
+        fatClose(f);
+        esp_printf(putc, "out of memory\n");
+        return;
+    }
+
+    struct blk_stats b0, b1;
+    blk_get_stats(&b0);
+    uint32_t c0 = disk_commands();
+    uint64_t t0 = clock_ns();
+    uint32_t total = 0;
+    int n;
+    while ((n = fatRead(f, buf, kb * 1024)) > 0)
+        total += n;
+    uint64_t t1 = clock_ns();
+    blk_get_stats(&b1);
+    uint32_t c1 = disk_commands();
+    kfree(buf);
+    fatClose(f);
+
+    if (n < 0)
+        esp_printf(putc, "read error after %d bytes\n", (int)total);
+    uint32_t us = (uint32_t)div64_32(t1 - t0, 1000, 0);
+    uint32_t kbps = us ? (uint32_t)div64_32((uint64_t)total * 1000, us, 0) : 0;
+    esp_printf(putc, "%d bytes in %d us, %d KB/s\n", (int)total, (int)us, (int)kbps);
+    esp_printf(putc, "  %d commands, %d sectors read ahead, %d hits, %d misses\n",
+               (int)(c1 - c0), (int)(b1.readahead - b0.readahead),
+               (int)(b1.hits - b0.hits), (int)(b1.misses - b0.misses));
+}
+
+static void cmd_ps(void) {
+    static const char *state_names[] = { "ready", "run", "sleep", "block", "dead" };
+    esp_printf(putc, "  id  state  ticks  name\n");
+    for (struct thread *t = thread_list(); t; t = t->all_next)
+        esp_printf(putc, "  %d  %s  %d  %s%s\n", (int)t->id, state_names[t->state], (int)t->ticks,
+                   t->name, t == thread_current() ? " *" : "");
+}
+
+static void handle_cmd(int argc,char *argv[]);
+
+static void cmd_time(int argc, char *argv[]) {
+    if (argc < 2) {
+        esp_printf(putc, "usage: time <cmd...>\n");
+        return;
+    }
+    uint64_t c0 = cycles();
+    uint64_t t0 = clock_ns();
+    handle_cmd(argc - 1, argv + 1);
+    uint64_t t1 = clock_ns();
+    uint64_t c1 = cycles();
+
+    char buf[21];
+    esp_printf(putc, "real ");
+    print_seconds(t1 - t0);
+    esp_printf(putc, " s, %s %s\n", fmt_u64(buf, c1 - c0), clock_tsc_khz() ? "cycles" : "PIT counts");
+}
+
+/* A background command owns a copy of its words; the shell reuses its
+   line buffer as soon as bg returns */
+struct bg_job {
+    int argc;
+    char *argv[8];
+    char line[128];
+};
+
+static void bg_main(void *arg) {
+    struct bg_job *job = arg;
+    handle_cmd(job->argc, job->argv);
+    kfree(job);
+}
+
+static void cmd_bg(int argc, char *argv[]) {
+    if (argc < 2) {
+        esp_printf(putc, "usage: bg <cmd...>\n");
+        return;
+    }
+    struct bg_job *job = kmalloc(sizeof(*job));
+    if (!job) {
+        esp_printf(putc, "out of memory\n");
+        return;
+    }
+
+    uint32_t n = 0;
+    job->argc = 0;
+    for (int i = 1; i < argc; i++) {
+        job->argv[job->argc++] = &job->line[n];
+        for (const char *s = argv[i]; *s; s++)
+            job->line[n++] = *s;
+        job->line[n++] = 0;
+    }
+
+    struct thread *t = thread_create(argv[1], bg_main, job);
+    if (!t) {
+        kfree(job);
+        esp_printf(putc, "out of memory\n");
+        return;
+    }
+    esp_printf(putc, "[%d] %s\n", (int)t->id, argv[1]);
+}
+
 /* ---------- Command Dispatcher ---------- */
 
 static void handle_cmd(int argc,char *argv[]) {
@@ -434,17 +1051,39 @@ static void handle_cmd(int argc,char *argv[]) {
     else if (!strcmp(argv[0],"echo")) cmd_echo(argc,argv);
     else if (!strcmp(argv[0],"meminfo")) cmd_meminfo();
     else if (!strcmp(argv[0],"frames")) cmd_frames();
+    else if (!strcmp(argv[0],"memmap")) cmd_memmap();
     else if (!strcmp(argv[0],"v2p")) cmd_v2p(argc,argv);
     else if (!strcmp(argv[0],"ptdump")) cmd_ptdump();
     else if (!strcmp(argv[0],"read32")) cmd_read32(argc,argv);
     else if (!strcmp(argv[0],"write32")) cmd_write32(argc,argv);
     else if (!strcmp(argv[0],"hexdump")) cmd_hexdump(argc,argv);
     else if (!strcmp(argv[0],"alloc")) cmd_alloc(argc,argv);
+    else if (!strcmp(argv[0],"heap")) cmd_heap();
+    else if (!strcmp(argv[0],"vmreserve")) cmd_vmreserve(argc,argv);
+    else if (!strcmp(argv[0],"vmrelease")) cmd_vmrelease(argc,argv);
+    else if (!strcmp(argv[0],"vmclone")) cmd_vmclone(argc,argv);
+    else if (!strcmp(argv[0],"vmlist")) cmd_vmlist();
     else if (!strcmp(argv[0],"info")) cmd_info();
     else if (!strcmp(argv[0],"sleep")) cmd_sleep(argc,argv);
     else if (!strcmp(argv[0],"kbtest")) cmd_kbtest();
     else if (!strcmp(argv[0],"map")) cmd_map(argc,argv);
+    else if (!strcmp(argv[0],"unmap")) cmd_unmap(argc,argv);
     else if (!strcmp(argv[0],"uptime")) cmd_uptime();
+    else if (!strcmp(argv[0],"cpus")) cmd_cpus();
+    else if (!strcmp(argv[0],"checksum")) cmd_checksum(argc,argv);
+    else if (!strcmp(argv[0],"memscan")) cmd_memscan(argc,argv);
+    else if (!strcmp(argv[0],"zerofill")) cmd_zerofill();
+    else if (!strcmp(argv[0],"lspci")) cmd_lspci();
+    else if (!strcmp(argv[0],"diskinfo")) cmd_diskinfo();
+    else if (!strcmp(argv[0],"diskread")) cmd_diskread(argc,argv);
+    else if (!strcmp(argv[0],"diskwrite")) cmd_diskwrite(argc,argv);
+    else if (!strcmp(argv[0],"sync")) cmd_sync();
+    else if (!strcmp(argv[0],"ls")) cmd_ls();
+    else if (!strcmp(argv[0],"cat")) cmd_cat(argc,argv);
+    else if (!strcmp(argv[0],"fsbench")) cmd_fsbench(argc,argv);
+    else if (!strcmp(argv[0],"time")) cmd_time(argc,argv);
+    else if (!strcmp(argv[0],"ps")) cmd_ps();
+    else if (!strcmp(argv[0],"bg")) cmd_bg(argc,argv);
     else esp_printf(putc,"unknown command\n");
 }
 
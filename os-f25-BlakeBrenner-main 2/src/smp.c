@@ -0,0 +1,302 @@
+#include "rprintf.h"
+#include "smp.h"
+#include "paging.h"
+#include "kmalloc.h"
+#include "vm.h"
+#include "taskpool.h"
+#include "timer.h"
+#include "spinlock.h"
+
+extern int putc(int ch);
+extern uint8_t inb(uint16_t port);
+
+struct cpu cpus[SMP_MAX_CPUS];
+
+/* ---------- MP configuration table (Intel MP spec 1.4) ---------- */
+
+struct mp_floating {
+    char signature[4];            // "_MP_"
+    uint32_t config;              // physical address of the configuration table
+    uint8_t length;               // in 16-byte units
+    uint8_t spec_rev;
+    uint8_t checksum;
+    uint8_t features[5];          // features[0] != 0: default configuration, no table
+} __attribute__((packed));
+
+struct mp_config {
+    char signature[4];            // "PCMP"
+    uint16_t length;
+    uint8_t spec_rev;
+    uint8_t checksum;
+    char oem[8];
+    char product[12];
+    uint32_t oem_table;
+    uint16_t oem_size;
+    uint16_t entries;
+    uint32_t lapic_addr;
+    uint16_t ext_length;
+    uint8_t ext_checksum;
+    uint8_t reserved;
+} __attribute__((packed));
+
+struct mp_processor {
+    uint8_t type;                 // MP_ENTRY_PROCESSOR
+    uint8_t apic_id;
+    uint8_t apic_version;
+    uint8_t flags;                // MP_CPU_*
+    uint32_t signature;
+    uint32_t features;
+    uint32_t reserved[2];
+} __attribute__((packed));
+
+#define MP_ENTRY_PROCESSOR 0
+#define MP_CPU_ENABLED     0x01
+#define MP_CPU_BSP         0x02
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000u
+
+/* ---------- Local APIC registers ---------- */
+
+#define LAPIC_ID       0x020
+#define LAPIC_EOI      0x0B0
+#define LAPIC_SVR      0x0F0
+#define LAPIC_ICR_LO   0x300
+#define LAPIC_ICR_HI   0x310
+
+#define ICR_INIT       0x00000500u
+#define ICR_STARTUP    0x00000600u
+#define ICR_ASSERT     0x00004000u
+#define ICR_PENDING    0x00001000u   // delivery status
+#define ICR_ALL_BUT_SELF 0x000C0000u
+
+static uint32_t lapic_phys = LAPIC_DEFAULT_BASE;
+static volatile uint32_t *lapic = 0;
+
+static uint32_t ncpus = 1;
+static volatile uint32_t nonline = 1;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t val) {
+    lapic[reg / 4] = val;
+    (void)lapic[LAPIC_ID / 4];   // read back to post the write
+}
+
+static void lapic_icr(uint32_t apic_id, uint32_t cmd) {
+    while (lapic_read(LAPIC_ICR_LO) & ICR_PENDING)
+        ;
+    lapic_write(LAPIC_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_ICR_LO, cmd);
+}
+
+void lapic_eoi(void) {
+    if (lapic)
+        lapic_write(LAPIC_EOI, 0);
+}
+
+void smp_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (lapic)
+        lapic_icr(apic_id, ICR_ASSERT | vector);
+}
+
+void smp_broadcast_ipi(uint8_t vector) {
+    if (lapic && nonline > 1)
+        lapic_icr(0, ICR_ALL_BUT_SELF | ICR_ASSERT | vector);
+}
+
+/* Wakes a CPU out of hlt; the work itself is picked up from the queues */
+__attribute__((interrupt))
+static void ipi_wake_handler(struct interrupt_frame *f) {
+    (void)f;
+    lapic_eoi();
+}
+
+__attribute__((interrupt))
+static void ipi_tlb_handler(struct interrupt_frame *f) {
+    (void)f;
+    paging_tlb_ipi();
+    lapic_eoi();
+}
+
+/* ---------- Discovery ---------- */
+
+static int checksum_ok(const uint8_t *p, uint32_t len) {
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++)
+        sum += p[i];
+    return sum == 0;
+}
+
+static struct mp_floating *mp_scan(uint32_t start, uint32_t len) {
+    for (uint32_t a = start; a + sizeof(struct mp_floating) <= start + len; a += 16) {
+        struct mp_floating *mp = (struct mp_floating *)a;
+        if (mp->signature[0] == '_' && mp->signature[1] == 'M' &&
+            mp->signature[2] == 'P' && mp->signature[3] == '_' &&
+            mp->length && checksum_ok((const uint8_t *)mp, mp->length * 16u))
+            return mp;
+    }
+    return 0;
+}
+
+/* The floating pointer is in the first KiB of the EBDA, the last KiB of
+   base memory, or the BIOS ROM */
+static struct mp_floating *mp_find(void) {
+    struct mp_floating *mp;
+    uint32_t ebda = (uint32_t)(*(volatile uint16_t *)0x40E) << 4;
+    if (ebda && (mp = mp_scan(ebda, 1024)))
+        return mp;
+    uint32_t base_kb = *(volatile uint16_t *)0x413;
+    if (base_kb && (mp = mp_scan(base_kb * 1024u - 1024u, 1024)))
+        return mp;
+    return mp_scan(0xF0000, 0x10000);
+}
+
+int smp_detect(void) {
+    ncpus = 1;   // the BSP, whatever the table says
+
+    struct mp_floating *mp = mp_find();
+    if (!mp || mp->features[0] || !mp->config)
+        return (int)ncpus;
+
+    struct mp_config *cfg = (struct mp_config *)mp->config;
+    if (cfg->signature[0] != 'P' || cfg->signature[1] != 'C' ||
+        cfg->signature[2] != 'M' || cfg->signature[3] != 'P' ||
+        !checksum_ok((const uint8_t *)cfg, cfg->length))
+        return (int)ncpus;
+
+    lapic_phys = cfg->lapic_addr;
+
+    // Entries follow the header; processors are 20 bytes, the rest 8
+    uint8_t *p = (uint8_t *)(cfg + 1);
+    uint8_t *end = (uint8_t *)cfg + cfg->length;
+    for (uint16_t i = 0; i < cfg->entries && p < end; i++) {
+        if (*p != MP_ENTRY_PROCESSOR) {
+            p += 8;
+            continue;
+        }
+        struct mp_processor *proc = (struct mp_processor *)p;
+        p += sizeof(*proc);
+        if (!(proc->flags & MP_CPU_ENABLED))
+            continue;
+        if (proc->flags & MP_CPU_BSP) {
+            cpus[0].apic_id = proc->apic_id;
+            continue;
+        }
+        if (ncpus >= SMP_MAX_CPUS)
+            continue;
+        cpus[ncpus].apic_id = proc->apic_id;
+        cpus[ncpus].id = ncpus;
+        ncpus++;
+    }
+    return (int)ncpus;
+}
+
+/* ---------- AP start-up ---------- */
+
+extern char ap_trampoline[], ap_trampoline_end[];
+extern uint32_t ap_param_cr3, ap_param_cr4, ap_param_stack, ap_param_entry, ap_param_cpu;
+
+/* Address of a trampoline symbol in the low-memory copy */
+#define TRAMP_PARAM(sym) \
+    (*(volatile uint32_t *)(SMP_TRAMPOLINE + ((uint32_t)&(sym) - (uint32_t)ap_trampoline)))
+
+static void ap_entry(struct cpu *c) {
+    load_gdt_cpu(c);
+    load_idt();
+    df_task_init(c);
+    lapic_write(LAPIC_SVR, 0x100u | APIC_SPURIOUS_VECTOR);   // software enable
+
+    atomic_inc(&nonline);
+    c->online = 1;
+    taskpool_worker();   // never returns
+}
+
+/* Busy-wait on the PIT: at least `ticks` full ticks. Spins rather than
+   halting, since the one-shot timer may not fire for a while. */
+static void delay_ticks(uint32_t ticks) {
+    uint32_t start = timer_ticks();
+    while (timer_ticks() - start <= ticks)
+        cpu_relax();
+}
+
+/* Roughly 1 us per ISA port read */
+static void delay_us(uint32_t us) {
+    while (us--)
+        (void)inb(0x80);
+}
+
+static int start_ap(struct cpu *c) {
+    uint8_t *stack = kmalloc(SMP_STACK_SIZE);
+    if (!stack)
+        return -1;
+    c->self = c;
+    c->stack_top = (uint32_t)stack + SMP_STACK_SIZE;
+
+    TRAMP_PARAM(ap_param_stack) = c->stack_top;
+    TRAMP_PARAM(ap_param_cpu) = (uint32_t)c;
+
+    // INIT, wait 10 ms, then up to two STARTUPs per the MP spec
+    lapic_icr(c->apic_id, ICR_INIT | ICR_ASSERT);
+    delay_ticks(1);
+    for (int i = 0; i < 2 && !c->online; i++) {
+        lapic_icr(c->apic_id, ICR_STARTUP | ICR_ASSERT | (SMP_TRAMPOLINE >> 12));
+        delay_us(200);
+    }
+
+    // Give it up to a second to reach C code
+    for (int t = 0; t < 100 && !c->online; t++)
+        delay_ticks(1);
+    if (!c->online) {
+        // It may still be on its way. Park it with INIT (back to waiting
+        // for a STARTUP) so it cannot come up later on the next CPU's
+        // trampoline parameters. The stack is leaked on purpose: nothing
+        // confirms the INIT arrived, and a late AP running on memory the
+        // heap has handed out again would corrupt it silently.
+        lapic_icr(c->apic_id, ICR_INIT | ICR_ASSERT);
+        delay_ticks(1);
+        return -1;
+    }
+    return 0;
+}
+
+int smp_init(void) {
+    idt_install(IPI_WAKE_VECTOR, ipi_wake_handler);
+    idt_install(IPI_TLB_VECTOR, ipi_tlb_handler);
+
+    if (ncpus < 2)
+        return (int)nonline;
+
+    lapic = vm_map_device(lapic_phys, PAGE_SIZE, "lapic");
+    if (!lapic)
+        return (int)nonline;
+    cpus[0].apic_id = lapic_read(LAPIC_ID) >> 24;
+
+    // The low megabyte is identity mapped, so the copy is reachable as is
+    uint8_t *dst = (uint8_t *)SMP_TRAMPOLINE;
+    for (char *s = ap_trampoline; s < ap_trampoline_end; s++)
+        *dst++ = (uint8_t)*s;
+
+    uint32_t cr4;
+    __asm__ __volatile__("mov %%cr4, %0" : "=r"(cr4));
+    TRAMP_PARAM(ap_param_cr3) = (uint32_t)kernel_pd;
+    TRAMP_PARAM(ap_param_cr4) = cr4;
+    TRAMP_PARAM(ap_param_entry) = (uint32_t)ap_entry;
+
+    // One at a time: the trampoline parameters are shared
+    for (uint32_t i = 1; i < ncpus; i++) {
+        if (start_ap(&cpus[i]))
+            esp_printf(putc, "CPU %d (APIC %d) did not start\n",
+                       (int)i, (int)cpus[i].apic_id);
+    }
+    return (int)nonline;
+}
+
+uint32_t smp_cpu_count(void) {
+    return ncpus;
+}
+
+uint32_t smp_online_count(void) {
+    return nonline;
+}
@@ -0,0 +1,74 @@
+#ifndef SMP_H
+#define SMP_H
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/* Multiprocessor support. smp_detect() reads the Intel MP configuration
+   table left by the BIOS; smp_init() maps the local APIC and starts every
+   application processor with INIT/SIPI through a real-mode trampoline
+   copied to SMP_TRAMPOLINE. Each CPU owns a struct cpu holding its GDT,
+   TSS and stack; %gs points at it, so this_cpu() is a single load. */
+
+#define SMP_MAX_CPUS      16
+#define SMP_TRAMPOLINE    0x8000u   /* page aligned, below 1 MiB (SIPI vector 0x08) */
+#define SMP_STACK_SIZE    16384u
+#define SMP_DF_STACK_SIZE 4096u     /* per CPU, for the double-fault task */
+
+/* IPI vector used to wake a halted CPU when work is queued for it */
+#define IPI_WAKE_VECTOR   0xF0
+/* IPI vector that asks the other CPUs to invalidate TLB entries */
+#define IPI_TLB_VECTOR    0xF1
+#define APIC_SPURIOUS_VECTOR 0xFF
+
+/* GDT selectors shared by every CPU */
+#define GDT_KERNEL_CS  0x08
+#define GDT_KERNEL_DS  0x10
+#define GDT_PERCPU     0x18   /* %gs: base = the CPU's struct cpu */
+#define GDT_TSS        0x20
+#define GDT_DF_TSS     0x28   /* the double-fault task; vector 8 is a task gate to it */
+#define GDT_ENTRIES    6
+
+struct cpu {
+    struct cpu *self;             // must stay first: this_cpu() reads %gs:0
+    uint32_t id;                  // logical index, 0 = bootstrap processor
+    uint32_t apic_id;
+    volatile uint32_t online;     // set by the CPU once it runs C code
+    uint32_t stack_top;
+    volatile uint32_t preempt_count;   // > 0: the scheduler must not switch threads
+    volatile uint32_t need_resched;    // a switch or bottom half was deferred by preempt_count
+    struct gdt_entry gdt[GDT_ENTRIES];
+    struct tss_entry tss;
+    struct tss_entry df_tss;
+};
+
+extern struct cpu cpus[SMP_MAX_CPUS];
+
+static inline struct cpu *this_cpu(void) {
+    struct cpu *c;
+    __asm__ __volatile__("movl %%gs:0, %0" : "=r"(c));
+    return c;
+}
+
+static inline uint32_t smp_cpu_id(void) {
+    return this_cpu()->id;
+}
+
+/* Look for the MP table (before paging: it is read physically).
+   Returns the number of usable CPUs found, at least 1. */
+int smp_detect(void);
+
+/* Start the application processors. Needs paging, the heap and a running
+   PIT (for the INIT/SIPI delays). Returns the number of CPUs online. */
+int smp_init(void);
+
+/* CPUs found by smp_detect() / currently online */
+uint32_t smp_cpu_count(void);
+uint32_t smp_online_count(void);
+
+/* Local APIC */
+void lapic_eoi(void);
+void smp_send_ipi(uint32_t apic_id, uint8_t vector);
+void smp_broadcast_ipi(uint8_t vector);   // every CPU but this one
+
+#endif /* SMP_H */
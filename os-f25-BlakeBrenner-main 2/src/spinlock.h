@@ -0,0 +1,90 @@
+#ifndef SPINLOCK_H
+#define SPINLOCK_H
+
+#include <stdint.h>
+
+/* Test-and-test-and-set spinlock. Only xchg and lock-prefixed inc/dec/or
+   are used so the code still runs on a plain i386 (no cmpxchg/xadd). */
+
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void cpu_relax(void) {
+    __asm__ __volatile__("rep; nop" ::: "memory");   // PAUSE on CPUs that have it
+}
+
+/* Full barrier: a locked RMW on the stack orders earlier stores before
+   later loads (mfence does not exist on i386). */
+static inline void smp_mb(void) {
+    __asm__ __volatile__("lock; addl $0, (%%esp)" ::: "memory", "cc");
+}
+
+static inline uint32_t xchg32(volatile uint32_t *p, uint32_t v) {
+    __asm__ __volatile__("xchgl %0, %1" : "+r"(v), "+m"(*p) :: "memory");
+    return v;
+}
+
+static inline void atomic_inc(volatile uint32_t *p) {
+    __asm__ __volatile__("lock; incl %0" : "+m"(*p) :: "memory", "cc");
+}
+
+/* Returns non-zero if the counter reached zero */
+static inline int atomic_dec_and_test(volatile uint32_t *p) {
+    uint8_t zero;
+    __asm__ __volatile__("lock; decl %0; setz %1" : "+m"(*p), "=q"(zero) :: "memory", "cc");
+    return zero;
+}
+
+static inline void atomic_or(volatile uint32_t *p, uint32_t v) {
+    __asm__ __volatile__("lock; orl %1, %0" : "+m"(*p) : "r"(v) : "memory", "cc");
+}
+
+static inline void atomic_and(volatile uint32_t *p, uint32_t v) {
+    __asm__ __volatile__("lock; andl %1, %0" : "+m"(*p) : "r"(v) : "memory", "cc");
+}
+
+static inline void spin_lock(spinlock_t *l) {
+    while (xchg32(&l->locked, 1)) {
+        while (l->locked)
+            cpu_relax();
+    }
+}
+
+static inline int spin_trylock(spinlock_t *l) {
+    return !xchg32(&l->locked, 1);
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    __asm__ __volatile__("" ::: "memory");   // x86 stores are not reordered with earlier accesses
+    l->locked = 0;
+}
+
+/* Disable interrupts on this CPU, returning the previous EFLAGS */
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    __asm__ __volatile__("pushfl; popl %0; cli" : "=r"(flags) :: "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200u)   // EFLAGS.IF
+        __asm__ __volatile__("sti" ::: "memory");
+}
+
+/* Variants that also keep interrupts off on this CPU while the lock is held,
+   for data shared with interrupt handlers. */
+static inline uint32_t spin_lock_irqsave(spinlock_t *l) {
+    uint32_t flags = irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint32_t flags) {
+    spin_unlock(l);
+    irq_restore(flags);
+}
+
+#endif /* SPINLOCK_H */
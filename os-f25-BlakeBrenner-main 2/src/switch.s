@@ -0,0 +1,26 @@
+; switch.s - Kernel thread context switch
+;
+; void switch_context(uint32_t *save_esp, uint32_t next_esp);
+;
+; Pushes the callee-saved registers on the current stack, stores the stack
+; pointer in *save_esp, switches to next_esp and pops the next thread's
+; registers. The caller-saved ones (eax, ecx, edx) are already dead across
+; the call. A new thread's stack is laid out by thread_create() so that
+; the final ret lands in thread_start().
+
+section .text
+    [BITS 32]
+    global switch_context
+switch_context:
+    push ebp
+    push ebx
+    push esi
+    push edi
+    mov eax, [esp + 20]             ; save_esp
+    mov [eax], esp
+    mov esp, [esp + 24]             ; next_esp
+    pop edi
+    pop esi
+    pop ebx
+    pop ebp
+    ret
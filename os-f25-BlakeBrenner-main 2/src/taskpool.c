@@ -0,0 +1,148 @@
+#include "taskpool.h"
+#include "smp.h"
+
+/* head is the steal end, tail the owner's end; both only grow, the slot
+   is index % TASKQ_SIZE. A spinlock per deque keeps push/pop/steal simple
+   on a CPU without cmpxchg. */
+struct task_queue {
+    spinlock_t lock;
+    uint32_t head;
+    uint32_t tail;
+    struct task *slot[TASKQ_SIZE];
+    struct taskpool_stats stats;
+};
+
+static struct task_queue queues[SMP_MAX_CPUS];
+
+/* Bit per CPU halted in taskpool_worker(), waiting for a wake IPI */
+static volatile uint32_t idle_mask = 0;
+
+static int queue_push(struct task_queue *q, struct task *t) {
+    int ok = 0;
+    spin_lock(&q->lock);
+    if (q->tail - q->head < TASKQ_SIZE) {
+        q->slot[q->tail % TASKQ_SIZE] = t;
+        q->tail++;
+        ok = 1;
+    }
+    spin_unlock(&q->lock);
+    return ok;
+}
+
+static struct task *queue_pop(struct task_queue *q) {
+    struct task *t = 0;
+    spin_lock(&q->lock);
+    if (q->tail != q->head) {
+        q->tail--;
+        t = q->slot[q->tail % TASKQ_SIZE];
+    }
+    spin_unlock(&q->lock);
+    return t;
+}
+
+static struct task *queue_steal(struct task_queue *q) {
+    struct task *t = 0;
+    if (q->tail == q->head)   // cheap unlocked peek
+        return 0;
+    spin_lock(&q->lock);
+    if (q->tail != q->head) {
+        t = q->slot[q->head % TASKQ_SIZE];
+        q->head++;
+    }
+    spin_unlock(&q->lock);
+    return t;
+}
+
+static int work_available(void) {
+    uint32_t n = smp_cpu_count();
+    for (uint32_t i = 0; i < n; i++)
+        if (queues[i].tail != queues[i].head)
+            return 1;
+    return 0;
+}
+
+/* Own deque first, then every other CPU starting with the next one */
+static struct task *task_next(uint32_t self) {
+    struct task *t = queue_pop(&queues[self]);
+    if (t)
+        return t;
+
+    uint32_t n = smp_cpu_count();
+    for (uint32_t k = 1; k < n; k++) {
+        uint32_t victim = (self + k) % n;
+        if (!cpus[victim].online)
+            continue;
+        if ((t = queue_steal(&queues[victim]))) {
+            queues[self].stats.stolen++;
+            return t;
+        }
+    }
+    return 0;
+}
+
+static void task_run(uint32_t self, struct task *t) {
+    // t may be reused by its owner as soon as the group drops to zero
+    struct task_group *g = t->group;
+    t->fn(t->arg);
+    queues[self].stats.executed++;
+    atomic_dec_and_test(&g->pending);
+}
+
+void task_submit(struct task_group *g, struct task *t, void (*fn)(void *), void *arg) {
+    uint32_t self = smp_cpu_id();
+
+    t->fn = fn;
+    t->arg = arg;
+    t->group = g;
+    atomic_inc(&g->pending);
+
+    if (!queue_push(&queues[self], t)) {
+        task_run(self, t);
+        return;
+    }
+
+    // Order the push before reading idle_mask; pairs with the worker
+    // publishing its idle bit before it re-checks the queues
+    smp_mb();
+    if (idle_mask)
+        smp_broadcast_ipi(IPI_WAKE_VECTOR);
+}
+
+void task_wait(struct task_group *g) {
+    uint32_t self = smp_cpu_id();
+    while (g->pending) {
+        struct task *t = task_next(self);
+        if (t)
+            task_run(self, t);
+        else
+            cpu_relax();
+    }
+}
+
+void taskpool_worker(void) {
+    uint32_t self = smp_cpu_id();
+    uint32_t bit = 1u << self;
+
+    for (;;) {
+        struct task *t = task_next(self);
+        if (t) {
+            task_run(self, t);
+            continue;
+        }
+
+        // sti;hlt is atomic, so a wake IPI sent after the re-check below
+        // cannot be lost
+        __asm__ __volatile__("cli");
+        atomic_or(&idle_mask, bit);
+        if (!work_available())
+            __asm__ __volatile__("sti; hlt" ::: "memory");
+        atomic_and(&idle_mask, ~bit);
+        __asm__ __volatile__("sti");
+    }
+}
+
+void taskpool_stats(uint32_t cpu, struct taskpool_stats *out) {
+    if (cpu >= SMP_MAX_CPUS)
+        return;
+    *out = queues[cpu].stats;
+}
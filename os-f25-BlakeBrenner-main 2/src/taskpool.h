@@ -0,0 +1,46 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <stdint.h>
+#include "spinlock.h"
+
+/* Work-stealing task pool. Every CPU owns a deque of tasks: it pushes and
+   pops at the tail (newest first, cache-warm), idle CPUs steal from the
+   head of other CPUs' deques (oldest first, usually the biggest pieces).
+   Application processors run nothing but taskpool_worker(); the BSP joins
+   in while it waits in task_wait().
+
+   Tasks run on any CPU with interrupts enabled. They must only touch
+   memory that is mapped for the whole job (no demand-paged regions, no
+   kmalloc); the page allocator and kmap() are safe to use. */
+
+#define TASKQ_SIZE 256
+
+struct task_group {
+    volatile uint32_t pending;    // submitted but not yet finished
+};
+
+struct task {
+    void (*fn)(void *arg);
+    void *arg;
+    struct task_group *group;
+};
+
+struct taskpool_stats {
+    uint32_t executed;            // tasks run on this CPU
+    uint32_t stolen;              // ... of which taken from another CPU
+};
+
+/* Queue t on the calling CPU. t must stay valid until task_wait(g)
+   returns. If the deque is full the task runs immediately. */
+void task_submit(struct task_group *g, struct task *t, void (*fn)(void *), void *arg);
+
+/* Run and steal tasks until every task of g has finished */
+void task_wait(struct task_group *g);
+
+/* Main loop of an application processor */
+void taskpool_worker(void) __attribute__((noreturn));
+
+void taskpool_stats(uint32_t cpu, struct taskpool_stats *out);
+
+#endif /* TASKPOOL_H */
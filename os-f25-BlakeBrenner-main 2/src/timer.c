@@ -0,0 +1,222 @@
+#include "timer.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "defer.h"
+
+extern void outb(uint16_t port, uint8_t val);
+extern uint8_t inb(uint16_t port);
+
+#define PIT_CH0       0x40
+#define PIT_CMD       0x43
+#define WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1)
+
+/* All state is only touched with interrupts off, on the BSP (the only CPU
+   that receives IRQ0). */
+static uint64_t ticks64;          // whole ticks accounted so far
+static uint32_t tick_rem;         // PIT counts towards the next tick
+static uint32_t armed;            // length of the running one-shot
+static uint32_t armed_seen;       // largest elapsed count read for it
+static uint64_t armed_deadline;   // tick of the next event; one-shots are
+                                  // chained until it is reached
+static uint64_t wheel_tick;       // next wheel slot to run
+static struct timer *wheel[TIMER_WHEEL_SLOTS];
+static volatile uint32_t irq_count;
+
+/* ---------- PIT channel 0 ---------- */
+
+static void pit_arm(uint32_t count) {
+    outb(PIT_CMD, 0x30);          // channel 0, lo/hi byte, mode 0 (one-shot)
+    outb(PIT_CH0, count & 0xFF);
+    outb(PIT_CH0, (count >> 8) & 0xFF);
+    armed = count;
+    armed_seen = 0;
+}
+
+static uint32_t pit_read(void) {
+    outb(PIT_CMD, 0x00);          // latch channel 0
+    uint32_t lo = inb(PIT_CH0);
+    uint32_t hi = inb(PIT_CH0);
+    return lo | (hi << 8);
+}
+
+/* OUT goes high at terminal count and stays there until re-armed */
+static int pit_expired(void) {
+    outb(PIT_CMD, 0xE2);          // read-back: status only, channel 0
+    return inb(PIT_CH0) & 0x80;
+}
+
+/* Counts elapsed in the running one-shot, capped at its length. The
+   counter can read stale for one input clock after arming, so never let
+   the result go backwards. */
+static uint32_t pit_elapsed(void) {
+    uint32_t cur = pit_read();
+    uint32_t e = cur > armed ? armed : armed - cur;
+    if (e < armed_seen)
+        e = armed_seen;
+    armed_seen = e;
+    return e;
+}
+
+static void advance(uint32_t counts) {
+    tick_rem += counts;
+    while (tick_rem >= PIT_COUNTS_PER_TICK) {   // a handful of iterations at most
+        tick_rem -= PIT_COUNTS_PER_TICK;
+        ticks64++;
+    }
+}
+
+/* ---------- Wheel ---------- */
+
+static void wheel_unlink(struct timer *t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+static void wheel_insert(struct timer *t) {
+    struct timer **head = &wheel[t->expires & WHEEL_MASK];
+    t->next = *head;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *head = t;
+    t->pprev = head;
+}
+
+/* Run every timer due by ticks64. Each slot also holds timers one or more
+   wheel revolutions out; those stay put. */
+static void run_wheel(void) {
+    struct timer *due = 0;
+    for (; wheel_tick <= ticks64; wheel_tick++) {
+        struct timer *t = wheel[wheel_tick & WHEEL_MASK];
+        while (t) {
+            struct timer *next = t->next;
+            if (t->expires <= ticks64) {
+                wheel_unlink(t);
+                t->next = due;
+                due = t;
+            }
+            t = next;
+        }
+    }
+
+    // Callbacks may add timers; they land at wheel_tick or later
+    while (due) {
+        struct timer *t = due;
+        due = t->next;
+        t->next = 0;
+        t->fn(t->arg);
+    }
+}
+
+/* Pick the next event: one tick when threads wait for the CPU, otherwise
+   the first occupied wheel slot, at most one wheel revolution out. Then
+   arm the PIT for it, or for as far as the counter reaches if it is
+   further; the interrupt at the end of that shot just arms the next one. */
+static void arm_next(void) {
+    uint32_t d = 1;
+    if (!sched_wants_tick()) {
+        while (d < TIMER_WHEEL_SLOTS && !wheel[(ticks64 + d) & WHEEL_MASK])
+            d++;
+    }
+    armed_deadline = ticks64 + d;
+    uint32_t count = d * PIT_COUNTS_PER_TICK - tick_rem;
+    pit_arm(count < PIT_MAX_COUNT ? count : PIT_MAX_COUNT);
+}
+
+/* Fold the time spent so far in the current one-shot and arm anew */
+static void rearm(void) {
+    advance(pit_elapsed());
+    run_wheel();
+    arm_next();
+}
+
+__attribute__((interrupt))
+void pit_handler(struct interrupt_frame *f) {
+    (void)f;
+    uint64_t before = ticks64;
+
+    if (pit_expired()) {
+        // Past terminal count the counter wraps to 0xFFFF and keeps going
+        // down, so it shows how late this interrupt is whatever the length
+        // of the shot
+        uint32_t cur = pit_read();
+        advance(armed + (cur ? 0x10000u - cur : 0));
+    } else {
+        advance(pit_elapsed());   // raised before a rearm() replaced it
+    }
+    irq_count++;
+    run_wheel();
+    arm_next();
+
+    PIC_sendEOI(0);
+    defer_irq_exit();
+    sched_tick((uint32_t)(ticks64 - before));   // may switch threads
+}
+
+/* ---------- API ---------- */
+
+void timer_init(void) {
+    uint32_t flags = irq_save();
+    armed_deadline = 1;
+    pit_arm(PIT_COUNTS_PER_TICK);
+    irq_restore(flags);
+}
+
+static uint64_t live_ticks(void) {
+    return ticks64 + (tick_rem + pit_elapsed()) / PIT_COUNTS_PER_TICK;
+}
+
+uint64_t timer_ticks64(void) {
+    uint32_t flags = irq_save();
+    uint64_t t = live_ticks();
+    irq_restore(flags);
+    return t;
+}
+
+uint32_t timer_ticks(void) {
+    return (uint32_t)timer_ticks64();
+}
+
+uint64_t timer_pit_counts(void) {
+    uint32_t flags = irq_save();
+    uint64_t c = ticks64 * PIT_COUNTS_PER_TICK + tick_rem + pit_elapsed();
+    irq_restore(flags);
+    return c;
+}
+
+void timer_add(struct timer *t, uint32_t ticks, void (*fn)(void *), void *arg) {
+    uint32_t flags = irq_save();
+    if (t->pprev)
+        wheel_unlink(t);
+    t->fn = fn;
+    t->arg = arg;
+    t->expires = live_ticks() + ticks;
+    if (t->expires < wheel_tick)
+        t->expires = wheel_tick;   // that slot has already been run
+    wheel_insert(t);
+    if (t->expires < armed_deadline)
+        rearm();
+    irq_restore(flags);
+}
+
+int timer_cancel(struct timer *t) {
+    uint32_t flags = irq_save();
+    int pending = t->pprev != 0;
+    if (pending)
+        wheel_unlink(t);
+    irq_restore(flags);
+    return pending;
+}
+
+void timer_kick(void) {
+    uint32_t flags = irq_save();
+    if (armed_deadline > live_ticks() + 1)
+        rearm();
+    irq_restore(flags);
+}
+
+uint32_t timer_irq_count(void) {
+    return irq_count;
+}
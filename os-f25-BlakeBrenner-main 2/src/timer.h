@@ -0,0 +1,59 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/* Tickless timekeeping on PIT channel 0. The PIT runs in one-shot mode
+   (mode 0) and is armed only for the next event: the next expiring timer,
+   or the end of a time slice when threads are waiting for the CPU. The
+   16-bit counter reaches about 55 ms, so a later event takes a chain of
+   full-length shots; each one is folded into the count when it ends, so
+   no wrap goes unseen, and the deadline itself is a 64-bit tick.
+
+   Time is counted in ticks of 1/TIMER_HZ s (64-bit, never wraps) and read
+   live from the counter, so timer_ticks() advances even between
+   interrupts. Kernel timeouts live in a hashed timer wheel: O(1) add and
+   cancel, one slot visited per elapsed tick. */
+
+#define TIMER_HZ             100u
+#define PIT_HZ               1193182u
+#define PIT_COUNTS_PER_TICK  ((PIT_HZ + TIMER_HZ / 2) / TIMER_HZ)          /* 11932 */
+#define PIT_MAX_COUNT        0xFFFFu   /* longest one-shot, ~55 ms */
+#define TIMER_WHEEL_SLOTS    256u   /* power of two */
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;     // NULL: not queued
+    uint64_t expires;         // tick at which fn runs
+    void (*fn)(void *arg);    // runs with interrupts off, normally in the PIT interrupt
+    void *arg;
+};
+
+/* Arm the PIT and start counting; IRQ0 must be routed to pit_handler */
+void timer_init(void);
+
+/* Ticks since timer_init() */
+uint64_t timer_ticks64(void);
+uint32_t timer_ticks(void);
+
+/* PIT input clock periods (1/PIT_HZ s) since timer_init() */
+uint64_t timer_pit_counts(void);
+
+/* Run fn(arg) after at least `ticks` ticks (0: on the next tick).
+   t must stay valid until it fires or is cancelled. */
+void timer_add(struct timer *t, uint32_t ticks, void (*fn)(void *), void *arg);
+
+/* Returns 1 if t was still pending */
+int timer_cancel(struct timer *t);
+
+/* Something became runnable outside the timer interrupt: make sure the
+   next tick comes soon enough to time-slice it */
+void timer_kick(void);
+
+/* PIT interrupts taken so far (a periodic timer would take TIMER_HZ/s) */
+uint32_t timer_irq_count(void);
+
+void pit_handler(struct interrupt_frame *f);
+
+#endif /* TIMER_H */
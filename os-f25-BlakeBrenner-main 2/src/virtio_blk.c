@@ -0,0 +1,507 @@
+#include "virtio_blk.h"
+#include "interrupt.h"
+#include "defer.h"
+#include "spinlock.h"
+#include "paging.h"
+#include "page.h"
+#include "vm.h"
+#include "pci.h"
+#include "io.h"
+
+#define barrier()  __asm__ __volatile__("" ::: "memory")
+
+/* Legacy register block at BAR0; without MSI-X the device configuration
+   follows directly at 0x14 */
+#define VIRTIO_HOST_FEATURES    0x00
+#define VIRTIO_GUEST_FEATURES   0x04
+#define VIRTIO_QUEUE_PFN        0x08   /* physical page number of the ring */
+#define VIRTIO_QUEUE_SIZE       0x0C
+#define VIRTIO_QUEUE_SELECT     0x0E
+#define VIRTIO_QUEUE_NOTIFY     0x10
+#define VIRTIO_STATUS           0x12
+#define VIRTIO_ISR              0x13   /* read: also acknowledges the interrupt */
+#define VIRTIO_BLK_CAPACITY     0x14   /* 64-bit, 512-byte sectors */
+#define VIRTIO_BLK_SEG_MAX      0x20
+
+#define VIRTIO_STATUS_ACK       0x01
+#define VIRTIO_STATUS_DRIVER    0x02
+#define VIRTIO_STATUS_DRIVER_OK 0x04
+#define VIRTIO_STATUS_FAILED    0x80
+
+#define VIRTIO_ISR_QUEUE        0x01
+
+#define VIRTIO_BLK_F_SEG_MAX    (1u << 2)
+#define VIRTIO_BLK_F_RO         (1u << 5)
+#define VIRTIO_BLK_F_FLUSH      (1u << 9)
+
+#define VIRTIO_BLK_T_IN         0
+#define VIRTIO_BLK_T_OUT        1
+#define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_S_OK         0
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2      /* the device writes this buffer */
+#define VRING_USED_F_NO_NOTIFY  1
+#define VRING_ALIGN             4096u  /* legacy: the used ring starts on a page */
+#define VIRTQ_MAX_SIZE          1024u
+
+struct vring_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct vring_avail {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct vring_used_elem {
+    uint32_t id;         // head descriptor of the finished chain
+    uint32_t len;
+};
+
+struct vring_used {
+    uint16_t flags;
+    uint16_t idx;
+    struct vring_used_elem ring[];
+};
+
+/* Leads every request; the status byte ends it */
+struct virtio_blk_hdr {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+};
+
+/* Bottom-half events */
+#define EV_KICK         1   /* requests were queued */
+#define EV_IRQ          2   /* the device used some buffers */
+
+static int present;
+static struct virtio_blk_info info;
+static struct virtio_blk_stats stats;
+
+/* One page-allocator block: descriptors, available ring, used ring (page
+   aligned), then a header and a status byte per descriptor, indexed by
+   the head of the request's chain */
+static struct vring_desc *desc;
+static struct vring_avail *avail;
+static volatile struct vring_used *used;
+static struct virtio_blk_hdr *hdrs;
+static volatile uint8_t *status_bytes;
+static uint32_t ring_phys;
+static uint32_t seg_max;        // data descriptors the device takes per request
+/* Requests carried by each chain, linked through ->next, by head */
+static struct ata_request *inflight[VIRTQ_MAX_SIZE];
+
+/* Submitted but not in the ring yet, FIFO, changed with interrupts off */
+static struct ata_request *q_head, *q_tail;
+static int plugged;
+
+/* Only touched from bottom halves, which never run concurrently */
+static uint16_t free_head;      // free descriptors, linked through ->next
+static uint32_t num_free;
+static uint16_t last_used;      // used ring entries consumed so far
+
+static void virtio_bottom_half(void *arg, uint32_t ev);
+
+static uint32_t ring_pa(const volatile void *p) {
+    return ring_phys + (uint32_t)((const volatile uint8_t *)p - (const uint8_t *)desc);
+}
+
+/* Worst case for r's buffer: one descriptor per page it touches */
+static uint32_t data_descs(const struct ata_request *r) {
+    if (r->op == ATA_FLUSH)
+        return 0;
+    uint32_t first = (uint32_t)(uintptr_t)r->buf & (PAGE_SIZE - 1);
+    return (first + r->count * SECTOR_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+
+static uint16_t alloc_desc(void) {
+    uint16_t d = free_head;
+    free_head = desc[d].next;
+    num_free--;
+    return d;
+}
+
+/* A chain is already linked through ->next: splice it onto the free list */
+static void free_chain(uint16_t head) {
+    uint16_t d = head;
+    num_free++;
+    while (desc[d].flags & VRING_DESC_F_NEXT) {
+        d = desc[d].next;
+        num_free++;
+    }
+    desc[d].next = free_head;
+    free_head = head;
+}
+
+/* Complete every request of a chain */
+static void finish(struct ata_request *r, int status) {
+    if (status)
+        stats.errors++;
+    while (r) {
+        struct ata_request *next = r->next;   // the callback may reuse r
+        if (!status)
+            r->done = r->count;
+        r->status = status;
+        if (r->callback)
+            r->callback(r);
+        else
+            wake_up(&r->wait);
+        r = next;
+    }
+}
+
+/* A coalesced chain failed: put its requests back at the front of the
+   queue, in order, to go one by one, so one bad sector or unmapped page
+   only fails the request that covers it */
+static void retry_alone(struct ata_request *r) {
+    struct ata_request *last = r;
+    for (struct ata_request *m = r; m; m = m->next) {
+        m->nomerge = 1;
+        last = m;
+    }
+    uint32_t flags = irq_save();
+    last->next = q_head;
+    q_head = r;
+    if (!q_tail)
+        q_tail = last;
+    irq_restore(flags);
+    stats.retries++;
+}
+
+/* Describe r, and the requests chained to it through ->next that carry
+   on from it on disk, to the device as one request and publish it in the
+   available ring. Physically contiguous pieces of the buffers share a
+   descriptor. The caller has made sure the descriptors are there.
+   Returns -1 (leaving nothing allocated) if a page of a buffer is not
+   mapped, or is read-only and would be written. */
+static int add_request(struct ata_request *r) {
+    uint16_t head = alloc_desc();
+    struct virtio_blk_hdr *h = &hdrs[head];
+    h->type = r->op == ATA_READ ? VIRTIO_BLK_T_IN :
+              r->op == ATA_WRITE ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_FLUSH;
+    h->reserved = 0;
+    h->sector = r->op == ATA_FLUSH ? 0 : r->lba;
+    desc[head].addr = ring_pa(h);
+    desc[head].len = sizeof(*h);
+    desc[head].flags = VRING_DESC_F_NEXT;
+
+    uint16_t prev = head;
+    for (struct ata_request *m = r; m && m->op != ATA_FLUSH; m = m->next) {
+        uint32_t va = (uint32_t)(uintptr_t)m->buf;
+        uint32_t left = m->count * SECTOR_SIZE;
+        while (left) {
+            uint32_t pte = get_pte((void *)va);
+            uint32_t pa = (uint32_t)(uintptr_t)get_physaddr((void *)va);
+            if (!pa || (m->op == ATA_READ && pte && !(pte & PTE_RW))) {
+                desc[prev].flags &= ~VRING_DESC_F_NEXT;
+                free_chain(head);
+                return -1;
+            }
+            uint32_t len = PAGE_SIZE - (va & (PAGE_SIZE - 1));
+            if (len > left)
+                len = left;
+            if (prev != head && desc[prev].addr + desc[prev].len == pa) {
+                desc[prev].len += len;
+            } else {
+                uint16_t d = alloc_desc();
+                desc[prev].next = d;
+                desc[d].addr = pa;
+                desc[d].len = len;
+                desc[d].flags = VRING_DESC_F_NEXT | (m->op == ATA_READ ? VRING_DESC_F_WRITE : 0);
+                prev = d;
+            }
+            va += len;
+            left -= len;
+        }
+    }
+
+    uint16_t s = alloc_desc();
+    desc[prev].next = s;
+    status_bytes[head] = 0xFF;
+    desc[s].addr = ring_pa(&status_bytes[head]);
+    desc[s].len = 1;
+    desc[s].flags = VRING_DESC_F_WRITE;
+
+    inflight[head] = r;
+    avail->ring[avail->idx & (info.queue_size - 1)] = head;
+    barrier();   // the entry before the index that publishes it
+    avail->idx++;
+    stats.requests++;
+    return 0;
+}
+
+/* Move waiting requests into the ring while they fit, then ring the
+   doorbell once for all of them. Reads or writes queued back to back
+   that continue each other on disk go as one request, up to seg_max
+   data descriptors; only neighbours in the FIFO are joined, so nothing
+   is reordered. */
+static void fill_ring(void) {
+    uint32_t added = 0;
+    for (;;) {
+        uint32_t flags = irq_save();
+        struct ata_request *r = q_head;
+        if (r && !plugged && 2 + data_descs(r) <= num_free) {
+            struct ata_request *last = r, *m;
+            uint32_t segs = data_descs(r);
+            uint64_t end = r->lba + r->count;
+            while (r->op != ATA_FLUSH && !r->nomerge && (m = last->next) &&
+                   m->op == r->op && !m->nomerge && m->lba == end &&
+                   segs + data_descs(m) <= seg_max && 2 + segs + data_descs(m) <= num_free) {
+                segs += data_descs(m);
+                end += m->count;
+                last = m;
+                stats.merged++;
+            }
+            q_head = last->next;
+            if (!q_head)
+                q_tail = 0;
+            last->next = 0;
+        } else {
+            if (r && !plugged)
+                stats.ring_full++;
+            r = 0;
+        }
+        irq_restore(flags);
+        if (!r)
+            break;
+
+        if (!add_request(r))
+            added++;
+        else if (r->next)
+            retry_alone(r);
+        else
+            finish(r, -1);
+    }
+    // The index stores must be visible before used->flags is read, or a
+    // stale NO_NOTIFY skips the doorbell while the host goes to sleep;
+    // x86 lets a later load pass an earlier store, so a full fence
+    smp_mb();
+    if (added && !(used->flags & VRING_USED_F_NO_NOTIFY)) {
+        outw(info.iobase + VIRTIO_QUEUE_NOTIFY, 0);
+        stats.notifies++;
+    }
+}
+
+/* Complete everything the device has handed back */
+static void reap(void) {
+    uint16_t idx = used->idx;
+    barrier();   // the entries after the index that published them
+    while (last_used != idx) {
+        uint16_t head = used->ring[last_used & (info.queue_size - 1)].id;
+        struct ata_request *r = inflight[head];
+        int status = status_bytes[head] == VIRTIO_BLK_S_OK ? 0 : -1;
+        inflight[head] = 0;
+        free_chain(head);
+        last_used++;
+        if (r && status && r->next)
+            retry_alone(r);
+        else if (r)
+            finish(r, status);
+    }
+}
+
+static void virtio_bottom_half(void *arg, uint32_t ev) {
+    (void)arg;
+    if (ev == EV_IRQ) {
+        stats.irqs++;
+        reap();
+    }
+    fill_ring();
+}
+
+/* Top half: reading the ISR acknowledges the device and lowers the line.
+   The line may be shared, so a clear queue bit means it was not us. */
+__attribute__((interrupt))
+static void virtio_irq_handler(struct interrupt_frame *f) {
+    (void)f;
+    if (inb(info.iobase + VIRTIO_ISR) & VIRTIO_ISR_QUEUE)
+        defer_queue(virtio_bottom_half, 0, EV_IRQ);
+    PIC_sendEOI(info.irq);
+    defer_irq_exit();
+}
+
+static uint32_t align_up(uint32_t v, uint32_t a) {
+    return (v + a - 1) & ~(a - 1);
+}
+
+/* Lay out and hand the device queue 0; returns 0 or -1 */
+static int setup_queue(uint16_t io) {
+    outw(io + VIRTIO_QUEUE_SELECT, 0);
+    uint32_t qsize = inw(io + VIRTIO_QUEUE_SIZE);
+    if (qsize < 4 || qsize > VIRTQ_MAX_SIZE || (qsize & (qsize - 1)) || inl(io + VIRTIO_QUEUE_PFN))
+        return -1;
+
+    uint32_t avail_off = qsize * sizeof(struct vring_desc);
+    uint32_t used_off = align_up(avail_off + 6 + 2 * qsize, VRING_ALIGN);
+    uint32_t hdr_off = align_up(used_off + 6 + sizeof(struct vring_used_elem) * qsize, 16);
+    uint32_t status_off = hdr_off + qsize * sizeof(struct virtio_blk_hdr);
+    uint32_t order = 0;
+    while ((PAGE_SIZE << order) < status_off + qsize)
+        order++;
+
+    // The device only knows the start: the whole ring must be physically
+    // contiguous, hence one buddy block rather than a vm_reserve()
+    struct ppage *block = pfa_alloc_block(order);
+    if (!block)
+        return -1;
+    ring_phys = (uint32_t)(uintptr_t)block->physical_addr;
+    uint8_t *ring = vm_map_device(ring_phys, PAGE_SIZE << order, "virtq");
+    if (!ring) {
+        pfa_free_block(block);
+        return -1;
+    }
+    for (uint32_t i = 0; i < (1u << order); i++)
+        page_clear(ring + i * PAGE_SIZE);
+
+    desc = (struct vring_desc *)ring;
+    avail = (struct vring_avail *)(ring + avail_off);
+    used = (volatile struct vring_used *)(ring + used_off);
+    hdrs = (struct virtio_blk_hdr *)(ring + hdr_off);
+    status_bytes = ring + status_off;
+    for (uint32_t i = 0; i < qsize; i++)
+        desc[i].next = i + 1;
+    free_head = 0;
+    num_free = qsize;
+    last_used = 0;
+    info.queue_size = qsize;
+
+    outl(io + VIRTIO_QUEUE_PFN, ring_phys / VRING_ALIGN);
+    return 0;
+}
+
+int virtio_blk_init(void) {
+    const struct pci_device *d = 0;
+    for (uint32_t i = 0; i < pci_count() && !d; i++) {
+        const struct pci_device *p = pci_get(i);
+        if (p->vendor == VIRTIO_VENDOR && p->device == VIRTIO_DEV_BLK_LEGACY)
+            d = p;
+    }
+    if (!d)
+        return -1;
+    uint16_t io = pci_bar_io(d, 0);
+    if (!io || !d->irq_line || d->irq_line >= 16)
+        return -1;
+    pci_enable_bus_master(d);
+
+    // Reset, then say we found it and can drive it
+    outb(io + VIRTIO_STATUS, 0);
+    outb(io + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+    outb(io + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+    uint32_t features = inl(io + VIRTIO_HOST_FEATURES) &
+                        (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH);
+    outl(io + VIRTIO_GUEST_FEATURES, features);
+
+    if (setup_queue(io)) {
+        outb(io + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    // Data descriptors per request are bounded by seg_max and by what is
+    // left of the ring after the header and status; a buffer of n sectors
+    // touches at most n / 8 + 2 pages
+    uint32_t segs = info.queue_size - 2;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t s = inl(io + VIRTIO_BLK_SEG_MAX);
+        if (s && s < segs)
+            segs = s;
+    }
+    seg_max = segs;
+    info.max_sectors = segs > 2 ? (segs - 2) * (PAGE_SIZE / SECTOR_SIZE) : 0;
+    if (info.max_sectors > VIRTIO_BLK_MAX_SECTORS)
+        info.max_sectors = VIRTIO_BLK_MAX_SECTORS;
+    if (!info.max_sectors) {
+        outb(io + VIRTIO_STATUS, VIRTIO_STATUS_FAILED);
+        return -1;
+    }
+
+    info.sectors = inl(io + VIRTIO_BLK_CAPACITY) | ((uint64_t)inl(io + VIRTIO_BLK_CAPACITY + 4) << 32);
+    info.iobase = io;
+    info.irq = d->irq_line;
+    info.ro = !!(features & VIRTIO_BLK_F_RO);
+    info.flush = !!(features & VIRTIO_BLK_F_FLUSH);
+
+    idt_install(IRQ_VECTOR(info.irq), virtio_irq_handler);
+    if (info.irq >= 8)
+        IRQ_clear_mask(2);   // cascade
+    IRQ_clear_mask(info.irq);
+    outb(io + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+    present = 1;
+    return 0;
+}
+
+const struct virtio_blk_info *virtio_blk_get_info(void) {
+    return present ? &info : 0;
+}
+
+void virtio_blk_get_stats(struct virtio_blk_stats *out) {
+    uint32_t flags = irq_save();
+    *out = stats;
+    irq_restore(flags);
+}
+
+/* Fault the buffer in from the caller's context: the device cannot take
+   a page fault, and a lazily backed or copy-on-write page only gets its
+   own frame on first touch */
+static void touch_buffer(const struct ata_request *r) {
+    volatile uint8_t *p = r->buf;
+    uint32_t bytes = r->count * SECTOR_SIZE;
+    for (uint32_t off = 0; off < bytes; ) {
+        if (r->op == ATA_READ)
+            p[off] = p[off];
+        else
+            (void)p[off];
+        off += PAGE_SIZE - (((uint32_t)(uintptr_t)(p + off)) & (PAGE_SIZE - 1));
+    }
+}
+
+void virtio_blk_submit(struct ata_request *r) {
+    r->next = 0;
+    r->done = 0;
+    r->nomerge = 0;
+    r->wait.head = r->wait.tail = 0;
+    r->status = ATA_PENDING;
+    int bad = r->op == ATA_FLUSH ? !present :
+              !present || !r->count || r->count > info.max_sectors ||
+              (r->op == ATA_WRITE && info.ro) ||
+              r->lba >= info.sectors || r->count > info.sectors - r->lba;
+    if (bad || (r->op == ATA_FLUSH && !info.flush)) {
+        // Without VIRTIO_BLK_F_FLUSH the device writes through: nothing to flush
+        r->status = bad ? -1 : 0;
+        if (r->callback)
+            r->callback(r);
+        return;
+    }
+    if (r->op != ATA_FLUSH)
+        touch_buffer(r);
+
+    uint32_t flags = irq_save();
+    if (q_tail)
+        q_tail->next = r;
+    else
+        q_head = r;
+    q_tail = r;
+    if (!plugged)
+        defer_queue(virtio_bottom_half, 0, EV_KICK);
+    irq_restore(flags);
+    defer_run();
+}
+
+void virtio_blk_plug(void) {
+    uint32_t flags = irq_save();
+    plugged++;
+    irq_restore(flags);
+}
+
+void virtio_blk_unplug(void) {
+    uint32_t flags = irq_save();
+    if (--plugged == 0 && q_head)
+        defer_queue(virtio_bottom_half, 0, EV_KICK);
+    irq_restore(flags);
+    defer_run();
+}
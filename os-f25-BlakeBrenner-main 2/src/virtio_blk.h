@@ -0,0 +1,67 @@
+#ifndef VIRTIO_BLK_H
+#define VIRTIO_BLK_H
+
+#include <stdint.h>
+#include "ide.h"
+
+/* virtio-blk over the legacy (transitional) PCI interface: registers in
+   I/O BAR0, one virtqueue, INTx through the PIC.
+
+   Under QEMU every IDE register access is a VM exit, so PIO costs one
+   exit per 16-bit word and even ATA DMA needs several per command. A
+   virtio request is just three or more descriptors in a ring shared
+   with the host. The driver rings the doorbell once per batch (once per
+   ide_plug()-style plug/unplug), and the host completes everything it
+   picked up with a single interrupt. Requests queued back to back that
+   continue each other on disk in the same direction share one virtio
+   request, as long as the chain stays within the device's seg_max.
+
+   The ring, the request headers and the status bytes live in one
+   physically contiguous block from the page allocator. Requests are
+   struct ata_request, exactly as for the ATA driver, and complete the
+   same way (callback from a bottom half, or a wake_up on r->wait), so
+   the block layer can use either disk. Requests that do not fit in the
+   ring wait in a FIFO until completions free descriptors. There is no
+   elevator: the host does its own scheduling, and the queue is deep
+   enough that sorting in the guest buys nothing. */
+
+#define VIRTIO_VENDOR            0x1AF4
+#define VIRTIO_DEV_BLK_LEGACY    0x1001   /* transitional virtio-blk */
+
+#define VIRTIO_BLK_MAX_SECTORS   256u     /* per ata_request; also bounded by seg_max */
+
+struct virtio_blk_info {
+    uint64_t sectors;
+    uint16_t iobase;
+    uint8_t irq;
+    uint32_t queue_size;    // descriptors in the ring
+    uint32_t max_sectors;
+    int ro;                 // the host refuses writes
+    int flush;              // VIRTIO_BLK_F_FLUSH negotiated
+};
+
+struct virtio_blk_stats {
+    uint32_t requests;      // virtio requests placed in the ring
+    uint32_t merged;        // requests that joined the one before them
+    uint32_t retries;       // joined requests that failed and went again alone
+    uint32_t notifies;      // doorbell writes
+    uint32_t irqs;          // interrupts that reported completions
+    uint32_t ring_full;     // requests that had to wait for descriptors
+    uint32_t errors;
+};
+
+/* Find the device, negotiate features and set up the queue. Returns 0 if
+   a virtio-blk device is ready; needs pci_init() and paging. */
+int virtio_blk_init(void);
+
+/* NULL if there is no device */
+const struct virtio_blk_info *virtio_blk_get_info(void);
+void virtio_blk_get_stats(struct virtio_blk_stats *out);
+
+/* Same contract as ide_submit()/ide_plug()/ide_unplug(); wait with
+   ide_wait() or disk_wait() */
+void virtio_blk_submit(struct ata_request *r);
+void virtio_blk_plug(void);
+void virtio_blk_unplug(void);
+
+#endif /* VIRTIO_BLK_H */
@@ -0,0 +1,343 @@
+#include "rprintf.h"
+#include "vm.h"
+#include "page.h"
+#include "paging.h"
+#include "kmalloc.h"
+#include "sched.h"
+#include "smp.h"
+
+extern int putc(int ch);
+
+/* #PF error code bits */
+#define PF_PRESENT 0x1u   // protection violation (page was present)
+#define PF_WRITE   0x2u   // faulting access was a write
+
+static struct vm_region *region_list = 0;
+
+/* One zeroed frame shared read-only by every page that was only read.
+   It is pinned: mappings of it are counted per region (zero_mapped) and
+   never in its refcount, which could otherwise wrap. */
+static struct ppage *zero_frame = 0;
+
+static inline uint32_t read_cr2(void) {
+    uint32_t v;
+    __asm__ __volatile__("mov %%cr2, %0" : "=r"(v));
+    return v;
+}
+
+/* ---------- Region bookkeeping ---------- */
+
+static int do_release(void *addr);
+
+static void *do_reserve(uint32_t size, uint32_t flags, const char *name) {
+    if (size == 0)
+        return 0;
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    struct vm_region *r = kmalloc(sizeof(*r));
+    if (!r)
+        return 0;
+
+    // First fit in the gaps between existing (sorted) regions
+    struct vm_region **link = &region_list;
+    uint32_t cand = VM_AREA_BASE;
+    while (*link && (*link)->start - cand < size) {
+        cand = (*link)->end;
+        link = &(*link)->next;
+    }
+    if (cand > VM_AREA_LIMIT || VM_AREA_LIMIT - cand < size) {
+        kfree(r);
+        return 0;
+    }
+
+    r->start = cand;
+    r->end = cand + size;
+    r->flags = flags;
+    r->resident = 0;
+    r->zero_mapped = 0;
+    r->name = name;
+    r->next = *link;
+    *link = r;
+
+    // Back every page now (the guard page stays unmapped)
+    if (flags & VM_POPULATE) {
+        uint32_t va = r->start + ((flags & VM_GUARD) ? PAGE_SIZE : 0);
+        for (; va < r->end; va += PAGE_SIZE) {
+            struct ppage *frame = pfa_alloc_frame(0);
+            if (!frame || map_page(frame->physical_addr, (void *)va,
+                                   (flags & VM_WRITE) ? 0x003 : 0x001)) {
+                pfa_free_block(frame);
+                do_release((void *)r->start);
+                return 0;
+            }
+            r->resident++;
+        }
+    }
+    return (void *)r->start;
+}
+
+static void *do_map_device(uint32_t pa, uint32_t size, const char *name) {
+    uint32_t off = pa & (PAGE_SIZE - 1);
+    uint32_t len = (off + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    void *start = do_reserve(len, VM_WRITE | VM_DEVICE, name);
+    if (!start)
+        return 0;
+
+    // present | rw | write-through | cache disable
+    if (map_range((uint32_t)start, pa - off, len, 0x01B)) {
+        do_release(start);
+        return 0;
+    }
+    return (uint8_t *)start + off;
+}
+
+static int do_release(void *addr) {
+    uint32_t a = (uint32_t)addr;
+    struct vm_region **link = &region_list;
+    while (*link && (*link)->start != a)
+        link = &(*link)->next;
+    if (!*link)
+        return -1;
+
+    struct vm_region *r = *link;
+    *link = r->next;
+
+    // Collect the frames first, then drop all mappings in one batch. The
+    // zero frame is pinned and only leaves the region's count.
+    struct ppage *frames = 0;
+    for (uint32_t va = r->start; va < r->end && (r->resident || r->zero_mapped); va += PAGE_SIZE) {
+        void *pa = get_physaddr((void *)va);
+        struct ppage *pp = pa ? pfa_page_of(pa) : 0;
+        if (!pp)
+            continue;
+        if (pp == zero_frame) {
+            r->zero_mapped--;
+        } else {
+            pp->next = frames;
+            frames = pp;
+            r->resident--;
+        }
+    }
+    unmap_range(r->start, r->end - r->start);
+
+    while (frames) {
+        struct ppage *next = frames->next;
+        frames->next = 0;
+        pfa_put(frames);
+        frames = next;
+    }
+    kfree(r);
+    return 0;
+}
+
+static void *do_clone(void *addr) {
+    struct vm_region *src = vm_find((uint32_t)addr);
+    if (!src || src->start != (uint32_t)addr || (src->flags & VM_DEVICE))
+        return 0;
+
+    uint32_t size = src->end - src->start;
+    void *start = do_reserve(size, src->flags & ~VM_POPULATE, "clone");
+    if (!start)
+        return 0;
+    struct vm_region *dst = vm_find((uint32_t)start);
+
+    // Both sides lose write access; the first write to either takes a copy
+    for (uint32_t off = 0; off < size && (dst->resident + dst->zero_mapped <
+                                          src->resident + src->zero_mapped); off += PAGE_SIZE) {
+        uint32_t pte = get_pte((void *)(src->start + off));
+        if (!(pte & PTE_PRESENT))
+            continue;
+        void *pa = (void *)(pte & ~0xFFFu);
+        struct ppage *pp = pfa_page_of(pa);
+        if (!pp)
+            continue;
+
+        if (map_page(pa, (void *)(dst->start + off), PTE_COW)) {
+            do_release(start);
+            return 0;
+        }
+        if (pp == zero_frame) {
+            dst->zero_mapped++;
+        } else {
+            pfa_get(pp);
+            dst->resident++;
+            if (pte & PTE_RW)
+                map_page(pa, (void *)(src->start + off), PTE_COW);
+        }
+    }
+    return start;
+}
+
+/* The region list and page tables are not reentrant: no thread switch
+   while they are being changed */
+void *vm_reserve(uint32_t size, uint32_t flags, const char *name) {
+    preempt_disable();
+    void *start = do_reserve(size, flags, name);
+    preempt_enable();
+    return start;
+}
+
+void *vm_map_device(uint32_t pa, uint32_t size, const char *name) {
+    preempt_disable();
+    void *va = do_map_device(pa, size, name);
+    preempt_enable();
+    return va;
+}
+
+int vm_release(void *addr) {
+    preempt_disable();
+    int rc = do_release(addr);
+    preempt_enable();
+    return rc;
+}
+
+void *vm_clone(void *addr) {
+    preempt_disable();
+    void *start = do_clone(addr);
+    preempt_enable();
+    return start;
+}
+
+struct vm_region *vm_find(uint32_t addr) {
+    for (struct vm_region *r = region_list; r && r->start <= addr; r = r->next)
+        if (addr < r->end)
+            return r;
+    return 0;
+}
+
+struct vm_region *vm_regions(void) {
+    return region_list;
+}
+
+/* ---------- Fault handling ---------- */
+
+static void fault_fatal(struct interrupt_frame *f, uint32_t addr, uint32_t err, const char *why) {
+    esp_printf(putc, "\nPAGE FAULT: %s\n", why);
+    esp_printf(putc, "  addr=0x%08x eip=0x%08x err=0x%x (%s, %s)\n", addr, f->ip, err,
+               (err & PF_PRESENT) ? "protection" : "not present",
+               (err & PF_WRITE) ? "write" : "read");
+    esp_printf(putc, "System halted.\n");
+    for (;;)
+        __asm__ __volatile__("cli; hlt");
+}
+
+/* Map a fresh zeroed frame at va with the region's protection. Returns
+   NULL on success or the reason it failed. */
+static const char *back_private(struct vm_region *r, uint32_t va) {
+    struct ppage *frame = pfa_alloc_frame(PFA_ZERO);
+    if (!frame)
+        return "out of memory";
+
+    if (map_page(frame->physical_addr, (void *)va, (r->flags & VM_WRITE) ? 0x003 : 0x001)) {
+        pfa_free_block(frame);
+        return "out of memory for page tables";
+    }
+    r->resident++;
+    return 0;
+}
+
+static struct ppage *get_zero_frame(void) {
+    if (!zero_frame)
+        zero_frame = pfa_alloc_frame(PFA_ZERO);
+    return zero_frame;
+}
+
+/* Write to a PTE_COW page: give va a private, writable copy of its frame.
+   Returns NULL on success or the reason it failed. */
+static const char *break_cow(struct vm_region *r, uint32_t va, uint32_t pte) {
+    void *pa = (void *)(pte & ~0xFFFu);
+    struct ppage *old = pfa_page_of(pa);
+    if (!old)
+        return "protection violation";
+
+    // Nothing worth copying: swap the zero frame for a fresh one
+    if (old == zero_frame) {
+        const char *why = back_private(r, va);
+        if (why)
+            return why;
+        r->zero_mapped--;
+        return 0;
+    }
+
+    // Last user of the frame: just take it back writable
+    if (old->refcount == 1) {
+        map_page(pa, (void *)va, 0x003);
+        return 0;
+    }
+
+    struct ppage *copy = pfa_alloc_block(0);
+    if (!copy)
+        return "out of memory";
+    const uint32_t *src = kmap(pa, KMAP_SLOT_COPY_SRC);
+    if (!src) {
+        pfa_free_block(copy);
+        return "out of memory for page tables";
+    }
+
+    // The page table exists (va is mapped), so this cannot fail
+    map_page(copy->physical_addr, (void *)va, 0x003);
+    volatile uint32_t *dst = (volatile uint32_t *)va;
+    for (uint32_t i = 0; i < PAGE_SIZE / 4; i++)
+        dst[i] = src[i];
+    kunmap(KMAP_SLOT_COPY_SRC);
+
+    pfa_put(old);
+    return 0;
+}
+
+/* A fault on an overflowed stack cannot push its frame there either, so
+   it becomes a double fault. That arrives through a task gate: the CPU
+   saved the faulting state in this CPU's TSS and switched to a clean
+   stack, which is what lets this print at all. */
+void double_fault_task(void) {
+    const struct tss_entry *t = &this_cpu()->tss;
+    uint32_t addr = read_cr2();
+    struct vm_region *r = vm_find(addr);
+
+    if (r && (r->flags & VM_GUARD) && (addr & ~(PAGE_SIZE - 1)) == r->start)
+        esp_printf(putc, "\nDOUBLE FAULT: stack overflow (guard page of %s)\n", r->name);
+    else
+        esp_printf(putc, "\nDOUBLE FAULT\n");
+    esp_printf(putc, "  cpu=%d eip=0x%08x esp=0x%08x cr2=0x%08x\n", (int)smp_cpu_id(), t->eip, t->esp,
+               addr);
+    esp_printf(putc, "System halted.\n");
+    for (;;)
+        __asm__ __volatile__("cli; hlt");
+}
+
+/* Resolve a fault inside a reserved region: reads of untouched pages map
+   the zero frame, writes get a private frame (copying a shared one). */
+__attribute__((interrupt))
+void page_fault_handler(struct interrupt_frame *f, uint32_t error_code) {
+    uint32_t addr = read_cr2();
+    uint32_t va = addr & ~(PAGE_SIZE - 1);
+    struct vm_region *r = vm_find(addr);
+    const char *why = 0;
+
+    if (!r)
+        fault_fatal(f, addr, error_code, "access outside any mapped region");
+    if ((r->flags & VM_GUARD) && va == r->start)
+        fault_fatal(f, addr, error_code, "stack overflow (guard page)");
+    if ((error_code & PF_WRITE) && !(r->flags & VM_WRITE))
+        fault_fatal(f, addr, error_code, "write to read-only region");
+
+    if (error_code & PF_PRESENT) {
+        uint32_t pte = get_pte((void *)va);
+        if (!(error_code & PF_WRITE) || !(pte & PTE_COW))
+            fault_fatal(f, addr, error_code, "protection violation");
+        why = break_cow(r, va, pte);
+    } else if (error_code & PF_WRITE) {
+        why = back_private(r, va);
+    } else {
+        struct ppage *zf = get_zero_frame();
+        if (!zf)
+            why = "out of memory";
+        else if (map_page(zf->physical_addr, (void *)va, PTE_COW))
+            why = "out of memory for page tables";
+        else
+            r->zero_mapped++;
+    }
+
+    if (why)
+        fault_fatal(f, addr, error_code, why);
+}
@@ -0,0 +1,63 @@
+#ifndef VM_H
+#define VM_H
+
+#include <stdint.h>
+#include "interrupt.h"
+
+/* Demand-paged kernel regions. vm_reserve() only hands out address space;
+   the page-fault handler backs pages lazily, so a reservation costs only
+   what is used. A page that is only read maps the shared zero frame; the
+   first write replaces it with a private frame. Frames shared between
+   regions (vm_clone) are mapped read-only with PTE_COW and copied on the
+   first write. */
+
+#define VM_AREA_BASE  0xE0000000u   /* just above the kmalloc heap */
+#define VM_AREA_LIMIT 0xFF400000u   /* below the kmap, scratch + recursive PDEs */
+
+/* vm_region.flags */
+#define VM_WRITE  0x01u
+#define VM_DEVICE 0x02u   /* maps MMIO, not RAM: uncached, never demand paged */
+#define VM_POPULATE 0x04u /* back every page at reservation time */
+#define VM_GUARD  0x08u   /* first page is never backed: faults there are fatal */
+
+struct vm_region {
+    struct vm_region *next;   // sorted by start address
+    uint32_t start;           // page aligned
+    uint32_t end;             // exclusive, page aligned
+    uint32_t flags;           // VM_* bits
+    uint32_t resident;        // pages backed by a frame of their own (maybe shared COW)
+    uint32_t zero_mapped;     // pages mapping the shared zero frame
+    const char *name;
+};
+
+/* Reserve size bytes (rounded up to pages) of lazily backed memory.
+   Returns the start address or NULL if out of address space. */
+void *vm_reserve(uint32_t size, uint32_t flags, const char *name);
+
+/* Map size bytes of device memory at physical address pa into the region
+   area, uncached. Returns the virtual address of pa, or NULL. The mapping
+   is undone with vm_release() on the region start. */
+void *vm_map_device(uint32_t pa, uint32_t size, const char *name);
+
+/* Unmap a reservation and return its frames. Returns 0, -1 if unknown. */
+int vm_release(void *addr);
+
+/* Reserve a copy of the region starting at addr. Backed pages are shared
+   copy-on-write with the original, nothing is copied up front.
+   Returns the new region's start, or NULL. */
+void *vm_clone(void *addr);
+
+/* Region containing addr, or NULL */
+struct vm_region *vm_find(uint32_t addr);
+
+/* Head of the region list (for introspection) */
+struct vm_region *vm_regions(void);
+
+/* Vector 14 handler, installed by init_idt() */
+void page_fault_handler(struct interrupt_frame *f, uint32_t error_code);
+
+/* Entry point of each CPU's double-fault task (see df_task_init()); runs
+   on a stack of its own and never returns */
+void double_fault_task(void);
+
+#endif /* VM_H */
@@ -1,42 +1,275 @@
-#include <stdio.h>
+/* Counter scaling benchmark.
+ *
+ * Every thread bumps a shared counter `iters` times; the strategies differ
+ * only in how the increments are made safe:
+ *
+ *   mutex     pthread mutex around glbl++
+ *   spin      test-and-test-and-set spinlock (same design as the kernel's)
+ *   ticket    FIFO ticket lock
+ *   atomic    one atomic fetch-add per increment
+ *   sharded   per-thread counters, each on its own cache line, summed at
+ *             the end
+ *
+ * For each thread count in the sweep it prints throughput in ops/sec and
+ * the scaling efficiency ops(n) / (n * ops(1)), and checks the total.
+ *
+ *   ./threads [max_threads] [iters_per_thread]
+ */
+#define _GNU_SOURCE
 #include <pthread.h>
-#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+#define MAX_THREADS 256
+
+static inline void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+  __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+
+/* With more threads than CPUs the lock holder may be descheduled; give
+   the CPU back now and then instead of burning whole time slices. */
+#define SPINS_BEFORE_YIELD 64
+
+static inline void spin_wait(unsigned *spins){
+  if(++*spins % SPINS_BEFORE_YIELD == 0)
+    sched_yield();
+  else
+    cpu_relax();
+}
+
+/* ------------------------------------------------------------------ */
+/* shared state                                                        */
+
+static pthread_mutex_t mtx = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t glbl = 0;
+
+static _Alignas(CACHE_LINE) atomic_int spin_locked;
+
+static _Alignas(CACHE_LINE) atomic_uint ticket_next;
+static _Alignas(CACHE_LINE) atomic_uint ticket_owner;
+
+static _Alignas(CACHE_LINE) atomic_uint_fast64_t atomic_glbl;
+
+struct shard {
+  _Alignas(CACHE_LINE) uint64_t count;
+};
+static struct shard shards[MAX_THREADS];
+
+/* Each worker times itself: with fewer CPUs than threads, the ones that
+   leave the barrier first may finish before the others, or main, run. */
+struct span {
+  _Alignas(CACHE_LINE) double start, end;
+};
+static struct span spans[MAX_THREADS];
+
+static uint64_t iters = 1000000;
+static pthread_barrier_t start_line;
+
+static double now_sec(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void begin(void *arg){
+  pthread_barrier_wait(&start_line);
+  spans[(uintptr_t)arg].start = now_sec();
+}
+
+static void finish(void *arg){
+  spans[(uintptr_t)arg].end = now_sec();
+}
+
+/* ------------------------------------------------------------------ */
+/* locks                                                               */
+
+static void spin_lock(void){
+  unsigned spins = 0;
+  while(atomic_exchange_explicit(&spin_locked, 1, memory_order_acquire)){
+    while(atomic_load_explicit(&spin_locked, memory_order_relaxed))
+      spin_wait(&spins);
+  }
+}
+
+static void spin_unlock(void){
+  atomic_store_explicit(&spin_locked, 0, memory_order_release);
+}
 
-pthread_mutex_t mtx;
-uint64_t glbl=0;
+static void ticket_lock(void){
+  unsigned me = atomic_fetch_add_explicit(&ticket_next, 1, memory_order_relaxed);
+  unsigned spins = 0;
+  while(atomic_load_explicit(&ticket_owner, memory_order_acquire) != me)
+    spin_wait(&spins);
+}
 
+static void ticket_unlock(void){
+  unsigned next = atomic_load_explicit(&ticket_owner, memory_order_relaxed) + 1;
+  atomic_store_explicit(&ticket_owner, next, memory_order_release);
+}
 
+/* ------------------------------------------------------------------ */
+/* workers                                                             */
 
-void* thread_func(void *arg){
-  uint64_t idx = (uint64_t)arg;
-  //printf("in thread_");
-  //printf("func()!   %ld\n", idx);
-  for(int k = 0; k < 10000; k++){
-    pthread_mutex_lock(&mtx);  
+static void* run_mutex(void *arg){
+  begin(arg);
+  for(uint64_t k = 0; k < iters; k++){
+    pthread_mutex_lock(&mtx);
     glbl++;
     pthread_mutex_unlock(&mtx);
   }
+  finish(arg);
+  return NULL;
+}
 
-  return (void*)7;
+static void* run_spin(void *arg){
+  begin(arg);
+  for(uint64_t k = 0; k < iters; k++){
+    spin_lock();
+    glbl++;
+    spin_unlock();
+  }
+  finish(arg);
+  return NULL;
 }
 
-int main(){
+static void* run_ticket(void *arg){
+  begin(arg);
+  for(uint64_t k = 0; k < iters; k++){
+    ticket_lock();
+    glbl++;
+    ticket_unlock();
+  }
+  finish(arg);
+  return NULL;
+}
 
-  pthread_t new_thread[10];
-  void * retval = 0;
-  pthread_mutex_init(&mtx, NULL);
+static void* run_atomic(void *arg){
+  begin(arg);
+  for(uint64_t k = 0; k < iters; k++)
+    atomic_fetch_add_explicit(&atomic_glbl, 1, memory_order_relaxed);
+  finish(arg);
+  return NULL;
+}
 
-  for(uint64_t k = 0; k < 10; k++){
-    pthread_create(&new_thread[k],
-                       NULL,
-                       thread_func,
-                       (void*)k);
+static void* run_sharded(void *arg){
+  struct shard *s = &shards[(uintptr_t)arg];
+  begin(arg);
+  for(uint64_t k = 0; k < iters; k++){
+    s->count++;
+    __asm__ __volatile__("" ::: "memory");   // one store per op, like the others
   }
-  for(int k = 0; k < 10; k++){
-    pthread_join(new_thread[k], &retval);
+  finish(arg);
+  return NULL;
+}
+
+struct variant {
+  const char *name;
+  void *(*fn)(void *);
+  double base;          // ops/sec with one thread
+};
+
+static struct variant variants[] = {
+  { "mutex",   run_mutex,   0 },
+  { "spin",    run_spin,    0 },
+  { "ticket",  run_ticket,  0 },
+  { "atomic",  run_atomic,  0 },
+  { "sharded", run_sharded, 0 },
+};
+#define NVARIANTS (sizeof(variants) / sizeof(variants[0]))
+
+/* ------------------------------------------------------------------ */
+/* driver                                                              */
+
+static uint64_t total(const struct variant *v, int nthreads){
+  if(v->fn == run_atomic)
+    return atomic_load(&atomic_glbl);
+  if(v->fn == run_sharded){
+    uint64_t sum = 0;
+    for(int k = 0; k < nthreads; k++)
+      sum += shards[k].count;
+    return sum;
+  }
+  return glbl;
+}
+
+static void reset(void){
+  glbl = 0;
+  atomic_store(&atomic_glbl, 0);
+  atomic_store(&ticket_next, 0);
+  atomic_store(&ticket_owner, 0);
+  for(int k = 0; k < MAX_THREADS; k++)
+    shards[k].count = 0;
+}
+
+/* Returns ops/sec, or a negative value if the total came out wrong */
+static double run(struct variant *v, int nthreads){
+  pthread_t tids[MAX_THREADS];
+  reset();
+  pthread_barrier_init(&start_line, NULL, nthreads + 1);
+  for(int k = 0; k < nthreads; k++)
+    pthread_create(&tids[k], NULL, v->fn, (void*)(uintptr_t)k);
+
+  pthread_barrier_wait(&start_line);
+  for(int k = 0; k < nthreads; k++)
+    pthread_join(tids[k], NULL);
+  pthread_barrier_destroy(&start_line);
+
+  double t0 = spans[0].start, t1 = spans[0].end;
+  for(int k = 1; k < nthreads; k++){
+    if(spans[k].start < t0) t0 = spans[k].start;
+    if(spans[k].end > t1) t1 = spans[k].end;
+  }
+
+  uint64_t expect = iters * (uint64_t)nthreads;
+  if(total(v, nthreads) != expect)
+    return -1;
+  return expect / (t1 - t0);
+}
+
+int main(int argc, char *argv[]){
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_threads = argc > 1 ? atoi(argv[1]) : (int)(ncpu > 0 ? ncpu : 1);
+  if(argc > 2)
+    iters = strtoull(argv[2], NULL, 10);
+  if(max_threads < 1 || max_threads > MAX_THREADS || iters == 0){
+    fprintf(stderr, "usage: %s [max_threads 1..%d] [iters_per_thread]\n", argv[0], MAX_THREADS);
+    return 1;
+  }
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("%ld CPUs online, %llu increments per thread\n\n", ncpu, (unsigned long long)iters);
+  printf("%-8s %7s %14s %10s\n", "variant", "threads", "ops/sec", "scaling");
+
+  int failed = 0;
+  for(unsigned v = 0; v < NVARIANTS; v++){
+    // 1, 2, 4, ... and finally max_threads itself
+    for(int n = 1; ; n *= 2){
+      if(n > max_threads)
+        n = max_threads;
+      double ops = run(&variants[v], n);
+      if(ops < 0){
+        printf("%-8s %7d %14s\n", variants[v].name, n, "WRONG TOTAL");
+        failed = 1;
+        break;
+      }
+      if(n == 1)
+        variants[v].base = ops;
+      printf("%-8s %7d %14.0f %9.1f%%\n", variants[v].name, n, ops,
+             100.0 * ops / (n * variants[v].base));
+      if(n == max_threads)
+        break;
+    }
+    printf("\n");
   }
-  //sleep(1);
-  printf("done creating thread. glbl = %ld \n", glbl);
-  return 0;
+  return failed;
 }